@@ -4,10 +4,26 @@
 #include <linux/string.h>
 #include <linux/slab.h>
 #include <linux/list.h>
+#include <linux/llist.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
 #include <linux/rbtree.h>
+#include <linux/rbtree_augmented.h>
 #include <linux/hashtable.h>
+#include <linux/rhashtable.h>
 #include <linux/radix-tree.h>
 #include <linux/xarray.h>
+#include <linux/maple_tree.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/random.h>
+#include <linux/bitmap.h>
+#include <linux/vmstat.h>
+
+#include "kds_core.h"
 
 MODULE_LICENSE("GPL");
 
@@ -15,29 +31,106 @@ static char *int_str = "";
 module_param(int_str, charp, S_IRUGO);
 MODULE_PARM_DESC(int_str, "Input string containing integers");
 
+static int hash_bench_max = 0;
+module_param(hash_bench_max, int, S_IRUGO);
+MODULE_PARM_DESC(hash_bench_max, "Largest N for the hash table benchmark (0 disables it)");
+
+static int footprint_n = 0;
+module_param(footprint_n, int, S_IRUGO);
+MODULE_PARM_DESC(footprint_n, "Number of keys for the memory footprint benchmark (0 disables it)");
+
+static int range_lo = 0;
+module_param(range_lo, int, S_IRUGO);
+MODULE_PARM_DESC(range_lo, "Lower bound of the RB Tree range query");
+
+static int range_hi = -1;
+module_param(range_hi, int, S_IRUGO);
+MODULE_PARM_DESC(range_hi, "Upper bound of the RB Tree range query (below range_lo disables it)");
+
+static int range_bench_n = 0;
+module_param(range_bench_n, int, S_IRUGO);
+MODULE_PARM_DESC(range_bench_n, "Number of keys for the range query benchmark (0 disables it)");
+
+static int btree_bench_n = 0;
+module_param(btree_bench_n, int, S_IRUGO);
+MODULE_PARM_DESC(btree_bench_n, "Number of keys for the B+ tree lookup/scan benchmark (0 disables it)");
+
+static char *maple_ranges = "";
+module_param(maple_ranges, charp, S_IRUGO);
+MODULE_PARM_DESC(maple_ranges, "Ranges for the maple tree, e.g. \"0-99 200-299\"");
+
+static ulong maple_gap = 0;
+module_param(maple_gap, ulong, S_IRUGO);
+MODULE_PARM_DESC(maple_gap, "Size of the free range to search for in the maple tree (0 disables it)");
+
+static int maple_bench_ranges = 0;
+module_param(maple_bench_ranges, int, S_IRUGO);
+MODULE_PARM_DESC(maple_bench_ranges, "Number of ranges for the maple tree versus XArray benchmark (0 disables it)");
+
+static int mark1_mod = 10;
+module_param(mark1_mod, int, S_IRUGO);
+MODULE_PARM_DESC(mark1_mod, "Radix tree tag / XArray mark 1 is set on multiples of this");
+
+static int mark2_mod = 100;
+module_param(mark2_mod, int, S_IRUGO);
+MODULE_PARM_DESC(mark2_mod, "Radix tree tag / XArray mark 2 is set on multiples of this");
+
+static int gang_batch = 10;
+module_param(gang_batch, int, S_IRUGO);
+MODULE_PARM_DESC(gang_batch, "Entries fetched per batched marked lookup");
+
+static int mark_bench_n = 0;
+module_param(mark_bench_n, int, S_IRUGO);
+MODULE_PARM_DESC(mark_bench_n, "Number of keys for the marked iteration benchmark (0 disables it)");
+
+static int list_bench_n = 0;
+module_param(list_bench_n, int, S_IRUGO);
+MODULE_PARM_DESC(list_bench_n, "Appends per producer for the multi-producer list benchmark (0 disables it)");
+
+static int bitmap_bench_order = 0;
+module_param(bitmap_bench_order, int, S_IRUGO);
+MODULE_PARM_DESC(bitmap_bench_order, "Largest bitmap size, as a power of two, for the bitmap benchmark (0 disables it)");
+
 
 
 // Linked List
-struct int_node {
+LIST_HEAD(int_list);
+
+// Lock-free List
+// Producers llist_add() without a lock; the consumer takes everything at once with
+// llist_del_all(), which hands back the batch newest first.
+struct llist_int_node {
     int value;
-    struct list_head list;
+    struct llist_node llnode;
 };
-LIST_HEAD(int_list);
+static LLIST_HEAD(int_llist);
+
+// Per-CPU List
+// One lock-free list per CPU, so producers on different CPUs never touch the same head.
+static DEFINE_PER_CPU(struct llist_head, pcpu_int_list);
 
 // RB Tree
-struct rb_int_node {
-  int value;
-  struct rb_node rb_node;
-};
 static struct rb_root mytree = RB_ROOT;
 
 // Hash Table
 #define HASH_TABLE_SIZE 1024
-struct hash_int_node {
+static DEFINE_HASHTABLE(myhashtable, 10); // 2^10 = 1024 buckets
+
+// Resizable Hash Table
+struct rhash_int_node {
     int value;
-    struct hlist_node hnode;
+    struct rhash_head node;
 };
-static DEFINE_HASHTABLE(myhashtable, 10); // 2^10 = 1024 buckets
+static const struct rhashtable_params rhash_params = {
+    .key_len = sizeof(int),
+    .key_offset = offsetof(struct rhash_int_node, value),
+    .head_offset = offsetof(struct rhash_int_node, node),
+    .automatic_shrinking = true,
+};
+static struct rhashtable my_rhashtable;
+
+// B+ Tree Set
+static struct btree_set my_btree;
 
 // Radix Tree
 static RADIX_TREE(my_radix_tree, GFP_KERNEL);
@@ -45,41 +138,147 @@ static RADIX_TREE(my_radix_tree, GFP_KERNEL);
 // XArray
 DEFINE_XARRAY(my_xarray);
 
+// Marks
+// Each radix tree tag / XArray mark indexes one predicate, value % mod == rem. They are set
+// when a value is inserted, so a query for the predicate only visits matching entries.
+struct kds_mark {
+    xa_mark_t mark; // Radix tree tag n is XArray mark n.
+    int mod;
+    int rem;
+};
+static struct kds_mark kds_marks[] = {
+    { XA_MARK_0, 2, 1 },   // Odd
+    { XA_MARK_1, 10, 0 },  // mark1_mod
+    { XA_MARK_2, 100, 0 }, // mark2_mod
+};
+
+// Maple Tree
+// Stores ranges as single entries. ALLOC_RANGE keeps per-node gap information for gap search.
+static struct maple_tree my_maple_tree = MTREE_INIT(my_maple_tree, MT_FLAGS_ALLOC_RANGE);
+
 // Bitmap
 DECLARE_BITMAP(my_bitmap, 1001);
 
+// Slab caches, one per structure so each one's footprint is visible in /proc/slabinfo
+static struct kmem_cache *int_node_cache;
+static struct kmem_cache *llist_int_node_cache;
+static struct kmem_cache *rb_int_node_cache;
+static struct kmem_cache *hash_int_node_cache;
+static struct kmem_cache *rhash_int_node_cache;
+static struct kmem_cache *radix_item_cache;
+static struct kmem_cache *xa_item_cache;
+
+
+
+// Slab caches
+static void kds_caches_destroy(void) {
+    kmem_cache_destroy(xa_item_cache);
+    kmem_cache_destroy(radix_item_cache);
+    kmem_cache_destroy(rhash_int_node_cache);
+    kmem_cache_destroy(hash_int_node_cache);
+    kmem_cache_destroy(rb_int_node_cache);
+    kmem_cache_destroy(llist_int_node_cache);
+    kmem_cache_destroy(int_node_cache);
+}
 
+static int kds_caches_create(void) {
+    int_node_cache = KMEM_CACHE(int_node, 0);
+    llist_int_node_cache = KMEM_CACHE(llist_int_node, 0);
+    rb_int_node_cache = KMEM_CACHE(rb_int_node, 0);
+    hash_int_node_cache = KMEM_CACHE(hash_int_node, 0);
+    rhash_int_node_cache = KMEM_CACHE(rhash_int_node, 0);
+    radix_item_cache = kmem_cache_create("kds_radix_item", sizeof(int), 0, 0, NULL);
+    xa_item_cache = kmem_cache_create("kds_xa_item", sizeof(int), 0, 0, NULL);
+
+    if (!int_node_cache || !llist_int_node_cache || !rb_int_node_cache || !hash_int_node_cache ||
+        !rhash_int_node_cache || !radix_item_cache || !xa_item_cache) {
+        kds_caches_destroy();
+        return -ENOMEM;
+    }
+    return 0;
+}
 
-// RB Tree
-static int rb_insert(int value, struct rb_root *root) {
-    struct rb_node **new = &(root->rb_node), *parent = NULL;
-    struct rb_int_node *this;
 
-    while (*new) {
-      this = container_of(*new, struct rb_int_node, rb_node);
 
-      parent = *new;
-      if (this->value < value)
-        new = &((*new)->rb_right);
-      else if (this->value > value)
-        new = &((*new)->rb_left);
-      else
-        return false; // Value already exists.
+// Lock-free List
+static int llist_insert(int value, struct llist_head *head) {
+    struct llist_int_node *node = kmem_cache_alloc(llist_int_node_cache, GFP_KERNEL);
+
+    if (!node)
+        return -ENOMEM;
+    node->value = value;
+    llist_add(&node->llnode, head);
+    return 0;
+}
+
+// Takes the whole list in one atomic exchange and returns it oldest first.
+static struct llist_node *llist_drain(struct llist_head *head) {
+    return llist_reverse_order(llist_del_all(head));
+}
+
+static void llist_free_all(struct llist_node *first) {
+    struct llist_int_node *node, *tmp;
+
+    llist_for_each_entry_safe(node, tmp, first, llnode)
+        kmem_cache_free(llist_int_node_cache, node);
+}
+
+// Per-CPU List
+// llist_add() is safe against any CPU, so being migrated after picking a list only means
+// the value lands on another CPU's list.
+static int pcpu_list_insert(int value, struct llist_head __percpu *heads) {
+    return llist_insert(value, raw_cpu_ptr(heads));
+}
+
+// Drains every CPU's list and chains the batches, each oldest first, into one list.
+static struct llist_node *pcpu_list_drain(struct llist_head __percpu *heads) {
+    struct llist_node *first = NULL, **tail = &first, *batch;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        batch = llist_del_all(per_cpu_ptr(heads, cpu));
+        if (!batch)
+            continue;
+        // The newest node, batch, becomes the tail once the batch is reversed.
+        *tail = llist_reverse_order(batch);
+        tail = &batch->next;
     }
+    return first;
+}
+
+// RB Tree
+static void rb_print_range(int lo, int hi) {
+    struct rb_int_node *pos;
+    unsigned int size = rb_size(mytree.rb_node);
+
+    pr_info("RBTree size: %u\n", size);
+    if (size)
+        pr_info("RBTree median: %d\n", rb_select(&mytree, size / 2)->value);
+    if (hi < lo)
+        return;
 
-    this = kmalloc(sizeof(struct rb_int_node), GFP_KERNEL);
-        if (!this)
-            return -ENOMEM;
+    pr_info("RBTree rank of %d: %u, values in [%d, %d]: %u\n", lo, rb_rank(&mytree, lo, false),
+            lo, hi, rb_count_range(&mytree, lo, hi));
+    rb_for_each_in_range(pos, &mytree, lo, hi) {
+        pr_info("RBTree value in range: %d\n", pos->value);
+    }
+}
+
+static int rb_insert(int value, struct rb_root *root) {
+    struct rb_int_node *this = kmem_cache_alloc(rb_int_node_cache, GFP_KERNEL);
+
+    if (!this)
+        return -ENOMEM;
     this->value = value;
-    rb_link_node(&this->rb_node, parent, new);
-    rb_insert_color(&this->rb_node, root);
+    if (!rb_link_value(this, root))
+        kmem_cache_free(rb_int_node_cache, this);
 
     return 0;
 }
 
 // Hash Table
 static void hash_insert(int value) {
-    struct hash_int_node *new_node = kmalloc(sizeof(*new_node), GFP_KERNEL);
+    struct hash_int_node *new_node = kmem_cache_alloc(hash_int_node_cache, GFP_KERNEL);
     if (!new_node) {
         pr_err("Failed to allocate memory for hash table node\n");
         return;
@@ -99,48 +298,298 @@ static void hash_lookup_and_print(int value) {
     }
 }
 
+// Resizable Hash Table
+static void rhash_insert(int value) {
+    struct rhash_int_node *new_node = kmem_cache_alloc(rhash_int_node_cache, GFP_KERNEL);
+    int ret;
+
+    if (!new_node) {
+        pr_err("Failed to allocate memory for rhashtable node\n");
+        return;
+    }
+
+    new_node->value = value;
+    ret = rhashtable_lookup_insert_fast(&my_rhashtable, &new_node->node, rhash_params);
+    if (ret)
+        kmem_cache_free(rhash_int_node_cache, new_node); // -EEXIST for duplicates, like the rbtree
+}
+
+static void rhash_lookup_and_print(int value) {
+    struct rhash_int_node *node;
+
+    rcu_read_lock();
+    node = rhashtable_lookup(&my_rhashtable, &value, rhash_params);
+    if (node)
+        pr_info("RHashTable (lookup) value: %d\n", node->value);
+    rcu_read_unlock();
+}
+
+static void rhash_print(void) {
+    struct rhashtable_iter iter;
+    struct rhash_int_node *node;
+
+    rhashtable_walk_enter(&my_rhashtable, &iter);
+    rhashtable_walk_start(&iter);
+    while ((node = rhashtable_walk_next(&iter)) != NULL) {
+        if (IS_ERR(node)) {
+            if (PTR_ERR(node) == -EAGAIN)
+                continue; // Table was resized under us, keep walking.
+            break;
+        }
+        pr_info("RHashTable value: %d\n", node->value);
+    }
+    rhashtable_walk_stop(&iter);
+    rhashtable_walk_exit(&iter);
+}
+
+static void rhash_free_node(void *ptr, void *arg) {
+    kmem_cache_free(rhash_int_node_cache, ptr);
+}
+
+// Hash Table Benchmark
+// Fixed 1024-bucket table versus rhashtable at N = 1024, 2048, ... hash_bench_max.
+#define CHAIN_HIST_MAX 16
+static DEFINE_HASHTABLE(bench_hashtable, 10);
+
+static void chain_hist_print(const char *name, unsigned int *hist, unsigned int buckets) {
+    int i;
+
+    pr_info("  %s chain lengths (%u buckets):\n", name, buckets);
+    for (i = 0; i <= CHAIN_HIST_MAX; i++) {
+        if (!hist[i])
+            continue;
+        pr_info("    %s%2d: %u\n", i == CHAIN_HIST_MAX ? ">=" : "  ", i, hist[i]);
+    }
+}
+
+static unsigned int fixed_chain_hist(unsigned int *hist) {
+    struct hlist_node *pos;
+    unsigned int i, len, max = 0;
+
+    memset(hist, 0, (CHAIN_HIST_MAX + 1) * sizeof(*hist));
+    for (i = 0; i < HASH_SIZE(bench_hashtable); i++) {
+        len = 0;
+        hlist_for_each(pos, &bench_hashtable[i])
+            len++;
+        hist[min_t(unsigned int, len, CHAIN_HIST_MAX)]++;
+        max = max(max, len);
+    }
+    return max;
+}
+
+static unsigned int rhash_chain_hist(struct rhashtable *ht, unsigned int *hist, unsigned int *buckets) {
+    struct bucket_table *tbl;
+    struct rhash_head *pos;
+    unsigned int i, len, max = 0;
+
+    memset(hist, 0, (CHAIN_HIST_MAX + 1) * sizeof(*hist));
+    rcu_read_lock();
+    tbl = rht_dereference_rcu(ht->tbl, ht);
+    *buckets = tbl->size;
+    for (i = 0; i < tbl->size; i++) {
+        len = 0;
+        rht_for_each_rcu(pos, tbl, i)
+            len++;
+        hist[min_t(unsigned int, len, CHAIN_HIST_MAX)]++;
+        max = max(max, len);
+    }
+    rcu_read_unlock();
+    return max;
+}
+
+static u64 fixed_lookup_ns(int n) {
+    struct hash_int_node *hash_node;
+    u64 start, found = 0;
+    int i;
+
+    start = ktime_get_ns();
+    for (i = 0; i < n; i++) {
+        hash_for_each_possible(bench_hashtable, hash_node, hnode, i) {
+            if (hash_node->value == i) {
+                found++;
+                break;
+            }
+        }
+    }
+    start = ktime_get_ns() - start;
+
+    if (found != n)
+        pr_warn("HashTable benchmark: found %llu of %d keys\n", found, n);
+    return div_u64(start, n);
+}
+
+static u64 rhash_lookup_ns(struct rhashtable *ht, int n) {
+    u64 start, found = 0;
+    int i;
+
+    rcu_read_lock();
+    start = ktime_get_ns();
+    for (i = 0; i < n; i++) {
+        if (rhashtable_lookup(ht, &i, rhash_params))
+            found++;
+    }
+    start = ktime_get_ns() - start;
+    rcu_read_unlock();
+
+    if (found != n)
+        pr_warn("RHashTable benchmark: found %llu of %d keys\n", found, n);
+    return div_u64(start, n);
+}
+
+static int hash_bench_one(int n) {
+    struct hash_int_node *fixed_nodes;
+    struct rhash_int_node *rhash_nodes;
+    struct rhashtable ht;
+    unsigned int hist[CHAIN_HIST_MAX + 1];
+    unsigned int fixed_max, rhash_max, rhash_buckets;
+    u64 fixed_ns, rhash_ns;
+    int i, ret;
+
+    fixed_nodes = kvcalloc(n, sizeof(*fixed_nodes), GFP_KERNEL);
+    rhash_nodes = kvcalloc(n, sizeof(*rhash_nodes), GFP_KERNEL);
+    if (!fixed_nodes || !rhash_nodes) {
+        ret = -ENOMEM;
+        goto out_free;
+    }
+
+    ret = rhashtable_init(&ht, &rhash_params);
+    if (ret)
+        goto out_free;
+
+    hash_init(bench_hashtable);
+    for (i = 0; i < n; i++) {
+        fixed_nodes[i].value = i;
+        hash_add(bench_hashtable, &fixed_nodes[i].hnode, i);
+
+        rhash_nodes[i].value = i;
+        ret = rhashtable_insert_fast(&ht, &rhash_nodes[i].node, rhash_params);
+        if (ret)
+            goto out_destroy;
+        cond_resched();
+    }
+    // Let a pending deferred resize finish so the histogram shows the settled table.
+    flush_work(&ht.run_work);
+
+    fixed_ns = fixed_lookup_ns(n);
+    rhash_ns = rhash_lookup_ns(&ht, n);
+
+    pr_info("HashBench N=%d: fixed %llu ns/lookup, rhashtable %llu ns/lookup\n", n, fixed_ns, rhash_ns);
+    fixed_max = fixed_chain_hist(hist);
+    chain_hist_print("fixed", hist, HASH_SIZE(bench_hashtable));
+    rhash_max = rhash_chain_hist(&ht, hist, &rhash_buckets);
+    chain_hist_print("rhashtable", hist, rhash_buckets);
+    pr_info("  max chain: fixed %u, rhashtable %u\n", fixed_max, rhash_max);
+
+out_destroy:
+    rhashtable_destroy(&ht);
+    hash_init(bench_hashtable);
+out_free:
+    kvfree(rhash_nodes);
+    kvfree(fixed_nodes);
+    return ret;
+}
+
+static void hash_bench(void) {
+    int n;
+
+    for (n = HASH_SIZE(bench_hashtable); n > 0 && n <= hash_bench_max; n *= 2) {
+        if (hash_bench_one(n)) {
+            pr_err("HashBench N=%d failed\n", n);
+            break;
+        }
+    }
+}
+
+// Marks
+static inline bool kds_mark_match(const struct kds_mark *m, unsigned long value) {
+    return value % m->mod == m->rem;
+}
+
+static inline unsigned int kds_mark_tag(const struct kds_mark *m) {
+    return (__force unsigned int)m->mark;
+}
+
+// Entries are either int items or, in the benchmarks, value entries; both hold their index.
+static inline unsigned long kds_entry_index(void *entry) {
+    return xa_is_value(entry) ? xa_to_value(entry) : *(int *)entry;
+}
+
+// Up to batch tagged entries from *next on. Advances *next past the last one returned.
+static unsigned int radix_tree_gang_lookup_marked(struct radix_tree_root *root, void **results,
+                                                  unsigned long *next, unsigned int batch,
+                                                  const struct kds_mark *m) {
+    unsigned int found = radix_tree_gang_lookup_tag(root, results, *next, batch, kds_mark_tag(m));
+
+    if (found)
+        *next = kds_entry_index(results[found - 1]) + 1;
+    return found;
+}
+
+static unsigned int xa_gang_lookup_marked(struct xarray *xa, void **results, unsigned long *next,
+                                          unsigned int batch, const struct kds_mark *m) {
+    XA_STATE(xas, xa, *next);
+    unsigned int found = 0;
+    void *entry;
+
+    rcu_read_lock();
+    xas_for_each_marked(&xas, entry, ULONG_MAX, m->mark) {
+        if (xas_retry(&xas, entry))
+            continue;
+        results[found++] = entry;
+        if (found == batch)
+            break;
+    }
+    rcu_read_unlock();
+
+    if (found)
+        *next = xas.xa_index + 1;
+    return found;
+}
+
 // Radix Tree
 static int radix_tree_insert_num(int num) {
-    int *item = kmalloc(sizeof(int), GFP_KERNEL);
-    *item = num;
+    int *item = kmem_cache_alloc(radix_item_cache, GFP_KERNEL);
+    int ret, i;
 
-    return radix_tree_insert(&my_radix_tree, *((int *)item), item);
-}
+    if (!item)
+        return -ENOMEM;
+    *item = num;
 
-static void radix_tree_print(void) {
-    struct radix_tree_iter iter;
-    void **slot;
+    ret = radix_tree_insert(&my_radix_tree, *((int *)item), item);
+    if (ret) {
+        kmem_cache_free(radix_item_cache, item);
+        return ret;
+    }
 
-    radix_tree_for_each_slot(slot, &my_radix_tree, &iter, 0) {
-        pr_info("RadixTree value: %d\n", *(int *)*slot);
+    for (i = 0; i < ARRAY_SIZE(kds_marks); i++) {
+        if (kds_mark_match(&kds_marks[i], num))
+            radix_tree_tag_set(&my_radix_tree, num, kds_mark_tag(&kds_marks[i]));
     }
+    return 0;
 }
 
-static void radix_tree_tag_odds(void) {
+static void radix_tree_print(void) {
     struct radix_tree_iter iter;
     void **slot;
 
     radix_tree_for_each_slot(slot, &my_radix_tree, &iter, 0) {
-        if (iter.index & 1) { // Check if the number is odd
-            radix_tree_tag_set(&my_radix_tree, iter.index, 1);
-        }
+        pr_info("RadixTree value: %d\n", *(int *)*slot);
     }
 }
 
-static void radix_tree_print_tagged(void) {
+static void radix_tree_print_tagged(const struct kds_mark *m) {
     void **results;
-    unsigned int count;
-    int num_found, i = 0;
+    unsigned int count, num_found;
+    unsigned long next = 0;
 
-    results = kmalloc_array(10, sizeof(*results), GFP_KERNEL); // Example for 10 results at a time.
+    results = kmalloc_array(gang_batch, sizeof(*results), GFP_KERNEL); // gang_batch results at a time.
     if (!results)
         return;
 
-    while ((num_found = radix_tree_gang_lookup_tag(&my_radix_tree, results, i, 10, 1)) > 0) {
+    while ((num_found = radix_tree_gang_lookup_marked(&my_radix_tree, results, &next, gang_batch, m)) > 0) {
         for (count = 0; count < num_found; count++) {
-	    pr_info("Tagged RadixTree value: %d\n", *(int *)(uintptr_t)results[count]);
+	    pr_info("Tagged RadixTree value: %d\n", *(int *)results[count]);
         }
-	i = (int)(uintptr_t)results[num_found - 1] + 1;
     }
 
     kfree(results);
@@ -148,11 +597,33 @@ static void radix_tree_print_tagged(void) {
 
 //XArray
 static int xarray_insert_num(int num) {
-    int *item = kmalloc(sizeof(int), GFP_KERNEL);
+    int *item = kmem_cache_alloc(xa_item_cache, GFP_KERNEL);
+    int *old;
+    int i;
+
     if (!item)
         return -ENOMEM;
     *item = num;
-    xa_store(&my_xarray, num, item, GFP_KERNEL);
+
+    // Store and mark in one locked section, so other writers and marked iteration under the
+    // lock never see the entry without its marks. RCU readers still can, and __xa_store() may
+    // drop the lock to allocate nodes, though never once the entry is in place.
+    xa_lock(&my_xarray);
+    old = __xa_store(&my_xarray, num, item, GFP_KERNEL);
+    if (!xa_is_err(old)) {
+        for (i = 0; i < ARRAY_SIZE(kds_marks); i++) {
+            if (kds_mark_match(&kds_marks[i], num))
+                __xa_set_mark(&my_xarray, num, kds_marks[i].mark);
+        }
+    }
+    xa_unlock(&my_xarray);
+
+    if (xa_is_err(old)) {
+        kmem_cache_free(xa_item_cache, item);
+        return xa_err(old);
+    }
+    if (old)
+        kmem_cache_free(xa_item_cache, old);
     return 0;
 }
 
@@ -165,52 +636,1312 @@ static void xarray_print(void) {
     }
 }
 
-static void xarray_tag_odds(void) {
+static void xarray_print_tagged(const struct kds_mark *m) {
+    void **results;
+    unsigned int count, num_found;
+    unsigned long next = 0;
+
+    results = kmalloc_array(gang_batch, sizeof(*results), GFP_KERNEL);
+    if (!results)
+        return;
+
+    while ((num_found = xa_gang_lookup_marked(&my_xarray, results, &next, gang_batch, m)) > 0) {
+        for (count = 0; count < num_found; count++) {
+            pr_info("Tagged XArray value: %d\n", *(int *)results[count]);
+        }
+    }
+
+    kfree(results);
+}
+
+static void xarray_clear(void) {
     unsigned long index = 0;
     int *item;
 
     xa_for_each(&my_xarray, index, item) {
-        if (*item & 1)
-	    xa_set_mark(&my_xarray, index, XA_MARK_0);
+        xa_erase(&my_xarray, index);
+        kmem_cache_free(xa_item_cache, item);
     }
 }
-static void xarray_print_tagged(void) {
-    unsigned long index = 0;
-    int *item;
 
-    xa_for_each_marked(&my_xarray, index, item, XA_MARK_0) {
-        pr_info("Tagged XArray value: %d\n", *item);
+
+// Memory Footprint Benchmark
+// Builds each structure with footprint_n keys and reports bytes per element, counting
+// slab objects, hash buckets and internal radix/xarray nodes, and the cost of one full
+// iteration. List, rbtree and hash table are built twice, from kmalloc and from their
+// own kmem_cache, to show what dedicated caches do to iteration speed.
+struct fp_result {
+    unsigned long bytes;
+    u64 iter_ns;
+};
+
+static void *fp_alloc(struct kmem_cache *cache, size_t size, bool slab) {
+    return slab ? kmem_cache_alloc(cache, GFP_KERNEL) : kmalloc(size, GFP_KERNEL);
+}
+
+static void fp_free(struct kmem_cache *cache, void *ptr, bool slab) {
+    if (slab)
+        kmem_cache_free(cache, ptr);
+    else
+        kfree(ptr);
+}
+
+static size_t fp_obj_size(struct kmem_cache *cache, void *ptr, bool slab) {
+    return slab ? kmem_cache_size(cache) : ksize(ptr);
+}
+
+static void fp_check(const char *name, u64 sum, int n) {
+    if (sum != (u64)n * (n - 1) / 2)
+        pr_warn("Footprint %s: iteration sum mismatch\n", name);
+}
+
+// Radix trees are xarrays underneath, so one walker counts the nodes of both.
+static unsigned long xa_node_count(void *entry) {
+    struct xa_node *node;
+    unsigned long count = 1;
+    unsigned int i;
+
+    if (!xa_is_node(entry))
+        return 0;
+    node = xa_to_node(entry);
+    for (i = 0; i < XA_CHUNK_SIZE; i++)
+        count += xa_node_count(rcu_dereference_raw(node->slots[i]));
+    return count;
+}
+
+static unsigned long xa_node_bytes(struct xarray *xa) {
+    unsigned long nodes;
+
+    rcu_read_lock();
+    nodes = xa_node_count(rcu_dereference_raw(xa->xa_head));
+    rcu_read_unlock();
+    return nodes * sizeof(struct xa_node);
+}
+
+static int fp_list(int n, bool slab, struct fp_result *res) {
+    LIST_HEAD(head);
+    struct int_node *node, *tmp;
+    u64 start, sum = 0;
+    int i;
+
+    res->bytes = 0;
+    for (i = 0; i < n; i++) {
+        node = fp_alloc(int_node_cache, sizeof(*node), slab);
+        if (!node)
+            break;
+        node->value = i;
+        list_add_tail(&node->list, &head);
+        res->bytes += fp_obj_size(int_node_cache, node, slab);
+        cond_resched();
+    }
+
+    start = ktime_get_ns();
+    list_for_each_entry(node, &head, list)
+        sum += node->value;
+    res->iter_ns = ktime_get_ns() - start;
+
+    list_for_each_entry_safe(node, tmp, &head, list) {
+        list_del(&node->list);
+        fp_free(int_node_cache, node, slab);
     }
+    if (i < n)
+        return -ENOMEM;
+    fp_check("list", sum, n);
+    return 0;
 }
 
-static void xarray_clear(void) {
-    unsigned long index = 0;
+static int fp_rbtree(int n, bool slab, struct fp_result *res) {
+    struct rb_root root = RB_ROOT;
+    struct rb_node *rb_node, *next;
+    struct rb_int_node *node;
+    u64 start, sum = 0;
+    int i;
+
+    res->bytes = 0;
+    for (i = 0; i < n; i++) {
+        node = fp_alloc(rb_int_node_cache, sizeof(*node), slab);
+        if (!node)
+            break;
+        node->value = i;
+        rb_link_value(node, &root);
+        res->bytes += fp_obj_size(rb_int_node_cache, node, slab);
+        cond_resched();
+    }
+
+    start = ktime_get_ns();
+    for (rb_node = rb_first(&root); rb_node; rb_node = rb_next(rb_node))
+        sum += container_of(rb_node, struct rb_int_node, rb_node)->value;
+    res->iter_ns = ktime_get_ns() - start;
+
+    for (rb_node = rb_first(&root); rb_node; rb_node = next) {
+        next = rb_next(rb_node);
+        rb_erase_value(container_of(rb_node, struct rb_int_node, rb_node), &root);
+        fp_free(rb_int_node_cache, container_of(rb_node, struct rb_int_node, rb_node), slab);
+    }
+    if (i < n)
+        return -ENOMEM;
+    fp_check("rbtree", sum, n);
+    return 0;
+}
+
+static int fp_hash(int n, bool slab, struct fp_result *res) {
+    struct hash_int_node *node;
+    struct hlist_node *tmp;
+    u64 start, sum = 0;
+    int i, bkt;
+
+    hash_init(bench_hashtable);
+    res->bytes = sizeof(bench_hashtable);
+    for (i = 0; i < n; i++) {
+        node = fp_alloc(hash_int_node_cache, sizeof(*node), slab);
+        if (!node)
+            break;
+        node->value = i;
+        hash_add(bench_hashtable, &node->hnode, i);
+        res->bytes += fp_obj_size(hash_int_node_cache, node, slab);
+        cond_resched();
+    }
+
+    start = ktime_get_ns();
+    hash_for_each(bench_hashtable, bkt, node, hnode)
+        sum += node->value;
+    res->iter_ns = ktime_get_ns() - start;
+
+    hash_for_each_safe(bench_hashtable, bkt, tmp, node, hnode) {
+        hash_del(&node->hnode);
+        fp_free(hash_int_node_cache, node, slab);
+    }
+    if (i < n)
+        return -ENOMEM;
+    fp_check("hashtable", sum, n);
+    return 0;
+}
+
+static void fp_rhash_free(void *ptr, void *arg) {
+    kmem_cache_free(rhash_int_node_cache, ptr);
+}
+
+static int fp_rhash(int n, struct fp_result *res) {
+    struct rhashtable ht;
+    struct rhashtable_iter iter;
+    struct rhash_int_node *node;
+    struct bucket_table *tbl;
+    u64 start, sum = 0;
+    int i, ret;
+
+    ret = rhashtable_init(&ht, &rhash_params);
+    if (ret)
+        return ret;
+
+    res->bytes = 0;
+    for (i = 0; i < n; i++) {
+        node = kmem_cache_alloc(rhash_int_node_cache, GFP_KERNEL);
+        if (!node) {
+            ret = -ENOMEM;
+            break;
+        }
+        node->value = i;
+        ret = rhashtable_insert_fast(&ht, &node->node, rhash_params);
+        if (ret) {
+            kmem_cache_free(rhash_int_node_cache, node);
+            break;
+        }
+        res->bytes += kmem_cache_size(rhash_int_node_cache);
+        cond_resched();
+    }
+    flush_work(&ht.run_work);
+
+    rcu_read_lock();
+    tbl = rht_dereference_rcu(ht.tbl, &ht);
+    res->bytes += sizeof(*tbl) + tbl->size * sizeof(tbl->buckets[0]);
+    rcu_read_unlock();
+
+    rhashtable_walk_enter(&ht, &iter);
+    rhashtable_walk_start(&iter);
+    start = ktime_get_ns();
+    while ((node = rhashtable_walk_next(&iter)) != NULL) {
+        if (IS_ERR(node))
+            continue;
+        sum += node->value;
+    }
+    res->iter_ns = ktime_get_ns() - start;
+    rhashtable_walk_stop(&iter);
+    rhashtable_walk_exit(&iter);
+
+    rhashtable_free_and_destroy(&ht, fp_rhash_free, NULL);
+    if (!ret)
+        fp_check("rhashtable", sum, n);
+    return ret;
+}
+
+static int fp_radix(int n, struct fp_result *res) {
+    struct radix_tree_root root;
+    struct radix_tree_iter iter;
+    void **slot;
     int *item;
+    u64 start, sum = 0;
+    int i, ret = 0;
+
+    INIT_RADIX_TREE(&root, GFP_KERNEL);
+    res->bytes = 0;
+    for (i = 0; i < n; i++) {
+        item = kmem_cache_alloc(radix_item_cache, GFP_KERNEL);
+        if (!item) {
+            ret = -ENOMEM;
+            break;
+        }
+        *item = i;
+        ret = radix_tree_insert(&root, i, item);
+        if (ret) {
+            kmem_cache_free(radix_item_cache, item);
+            break;
+        }
+        res->bytes += kmem_cache_size(radix_item_cache);
+        cond_resched();
+    }
+    res->bytes += xa_node_bytes(&root);
+
+    start = ktime_get_ns();
+    radix_tree_for_each_slot(slot, &root, &iter, 0)
+        sum += *(int *)*slot;
+    res->iter_ns = ktime_get_ns() - start;
+
+    radix_tree_for_each_slot(slot, &root, &iter, 0)
+        kmem_cache_free(radix_item_cache, radix_tree_delete(&root, iter.index));
+    if (!ret)
+        fp_check("radix tree", sum, n);
+    return ret;
+}
 
-    xa_for_each(&my_xarray, index, item) {
-        xa_erase(&my_xarray, index);
-        kfree(item);
+// With values set, keys are stored as xa_mk_value() entries and need no allocation.
+static int fp_xarray(int n, bool values, struct fp_result *res) {
+    struct xarray xa;
+    unsigned long index;
+    void *entry;
+    int *item;
+    u64 start, sum = 0;
+    int i, ret = 0;
+
+    xa_init(&xa);
+    res->bytes = 0;
+    for (i = 0; i < n; i++) {
+        if (values) {
+            entry = xa_mk_value(i);
+        } else {
+            item = kmem_cache_alloc(xa_item_cache, GFP_KERNEL);
+            if (!item) {
+                ret = -ENOMEM;
+                break;
+            }
+            *item = i;
+            entry = item;
+            res->bytes += kmem_cache_size(xa_item_cache);
+        }
+        ret = xa_err(xa_store(&xa, i, entry, GFP_KERNEL));
+        if (ret) {
+            if (!values)
+                kmem_cache_free(xa_item_cache, entry);
+            break;
+        }
+        cond_resched();
+    }
+    res->bytes += xa_node_bytes(&xa);
+
+    start = ktime_get_ns();
+    xa_for_each(&xa, index, entry)
+        sum += values ? xa_to_value(entry) : *(int *)entry;
+    res->iter_ns = ktime_get_ns() - start;
+
+    if (!values) {
+        xa_for_each(&xa, index, entry)
+            kmem_cache_free(xa_item_cache, entry);
+    }
+    xa_destroy(&xa);
+    if (!ret)
+        fp_check("xarray", sum, n);
+    return ret;
+}
+
+static void fp_print(const char *name, const char *alloc, int n, struct fp_result *res) {
+    unsigned long bytes = res->bytes * 100 / n;
+    u64 ns = div_u64(res->iter_ns * 100, n);
+
+    pr_info("Footprint %-10s %-8s N=%d: %lu.%02lu bytes/elem, iteration %llu.%02llu ns/elem\n",
+            name, alloc, n, bytes / 100, bytes % 100, ns / 100, ns % 100);
+}
+
+static void footprint_bench(int n) {
+    struct fp_result res;
+    int slab;
+
+    for (slab = 0; slab <= 1; slab++) {
+        const char *alloc = slab ? "slab" : "kmalloc";
+
+        if (!fp_list(n, slab, &res))
+            fp_print("list", alloc, n, &res);
+        if (!fp_rbtree(n, slab, &res))
+            fp_print("rbtree", alloc, n, &res);
+        if (!fp_hash(n, slab, &res))
+            fp_print("hashtable", alloc, n, &res);
+    }
+    if (!fp_rhash(n, &res))
+        fp_print("rhashtable", "slab", n, &res);
+    if (!fp_radix(n, &res))
+        fp_print("radixtree", "slab", n, &res);
+    if (!fp_xarray(n, false, &res))
+        fp_print("xarray", "slab", n, &res);
+    if (!fp_xarray(n, true, &res))
+        fp_print("xarray", "value", n, &res);
+
+    res.bytes = BITS_TO_LONGS(n) * sizeof(long);
+    res.iter_ns = 0;
+    fp_print("bitmap", "-", n, &res);
+}
+
+
+// Maple Tree
+// Each range is stored once; its entry records the first index of the range.
+static int maple_insert_range(unsigned long first, unsigned long last) {
+    return mtree_store_range(&my_maple_tree, first, last, xa_mk_value(first), GFP_KERNEL);
+}
+
+static void maple_parse_ranges(void) {
+    char *str = kstrdup(maple_ranges, GFP_KERNEL), *cur = str, *token;
+    unsigned long first, last;
+
+    if (!str)
+        return;
+    while ((token = strsep(&cur, " "))) {
+        if (sscanf(token, "%lu-%lu", &first, &last) != 2 || first > last)
+            continue;
+        if (maple_insert_range(first, last))
+            pr_err("Failed to store maple tree range [%lu, %lu]\n", first, last);
+    }
+    kfree(str);
+}
+
+static void maple_lookup_and_print(unsigned long index) {
+    MA_STATE(mas, &my_maple_tree, index, index);
+    void *entry;
+
+    rcu_read_lock();
+    entry = mas_walk(&mas);
+    if (entry)
+        pr_info("MapleTree lookup %lu: in range [%lu, %lu]\n", index, mas.index, mas.last);
+    else
+        pr_info("MapleTree lookup %lu: in gap [%lu, %lu]\n", index, mas.index, mas.last);
+    rcu_read_unlock();
+}
+
+static void maple_print(void) {
+    MA_STATE(mas, &my_maple_tree, 0, 0);
+    void *entry;
+
+    rcu_read_lock();
+    mas_for_each(&mas, entry, ULONG_MAX) {
+        pr_info("MapleTree range: [%lu, %lu]\n", mas.index, mas.last);
+    }
+    rcu_read_unlock();
+}
+
+// Lowest free range of at least size indices.
+static int maple_find_gap(struct maple_tree *mt, unsigned long size, unsigned long *start) {
+    MA_STATE(mas, mt, 0, 0);
+    int ret;
+
+    mtree_lock(mt);
+    ret = mas_empty_area(&mas, 0, ULONG_MAX, size);
+    mtree_unlock(mt);
+    if (!ret)
+        *start = mas.index;
+    return ret;
+}
+
+// Maple Tree Benchmark
+// maple_bench_ranges ranges of length len, each followed by a gap of the same length, are
+// stored as one maple tree entry per range and as one XArray entry per index. XArray memory
+// is its nodes, counted by walking the tree. Maple tree nodes cannot be walked from a module,
+// so its memory is the change in slab, reclaimable and unreclaimable together, which also
+// picks up whatever the rest of the system allocates meanwhile.
+#define MAPLE_BENCH_LOOKUPS 1000000
+
+static long slab_bytes(void) {
+    rcu_barrier(); // Maple nodes are freed through RCU.
+    return (global_node_page_state_pages(NR_SLAB_RECLAIMABLE_B) +
+            global_node_page_state_pages(NR_SLAB_UNRECLAIMABLE_B)) << PAGE_SHIFT;
+}
+
+static void maple_bench_len(int ranges, unsigned long len) {
+    struct maple_tree mt = MTREE_INIT(mt, MT_FLAGS_ALLOC_RANGE);
+    struct xarray xa;
+    unsigned long span = (unsigned long)ranges * 2 * len, first, index, gap;
+    unsigned long *keys;
+    long base, maple_bytes;
+    u64 start, maple_ns, xa_ns, maple_hits = 0, xa_hits = 0;
+    int i, ret = 0;
+
+    keys = kvmalloc_array(MAPLE_BENCH_LOOKUPS, sizeof(*keys), GFP_KERNEL);
+    if (!keys)
+        return;
+    for (i = 0; i < MAPLE_BENCH_LOOKUPS; i++)
+        keys[i] = get_random_u64() % span;
+    xa_init(&xa);
+
+    base = slab_bytes();
+    for (i = 0; i < ranges && !ret; i++) {
+        first = i * 2 * len;
+        ret = mtree_store_range(&mt, first, first + len - 1, xa_mk_value(i), GFP_KERNEL);
+        cond_resched();
+    }
+    maple_bytes = slab_bytes() - base;
+
+    for (i = 0; i < ranges && !ret; i++) {
+        first = i * 2 * len;
+        for (index = first; index < first + len && !ret; index++)
+            ret = xa_err(xa_store(&xa, index, xa_mk_value(i), GFP_KERNEL));
+        cond_resched();
+    }
+    if (ret)
+        goto out;
+
+    start = ktime_get_ns();
+    for (i = 0; i < MAPLE_BENCH_LOOKUPS; i++)
+        maple_hits += mtree_load(&mt, keys[i]) != NULL;
+    maple_ns = ktime_get_ns() - start;
+
+    start = ktime_get_ns();
+    for (i = 0; i < MAPLE_BENCH_LOOKUPS; i++)
+        xa_hits += xa_load(&xa, keys[i]) != NULL;
+    xa_ns = ktime_get_ns() - start;
+
+    pr_info("MapleBench ranges=%d len=%lu: memory maple %ld bytes, xarray %lu bytes\n",
+            ranges, len, maple_bytes, xa_node_bytes(&xa));
+    pr_info("MapleBench ranges=%d len=%lu: lookup maple %llu ns, xarray %llu ns per 1000 lookups\n",
+            ranges, len, div_u64(maple_ns, MAPLE_BENCH_LOOKUPS / 1000), div_u64(xa_ns, MAPLE_BENCH_LOOKUPS / 1000));
+    if (maple_hits != xa_hits)
+        pr_warn("MapleBench: hit counts differ (%llu, %llu)\n", maple_hits, xa_hits);
+
+    start = ktime_get_ns();
+    ret = maple_find_gap(&mt, len + 1, &gap);
+    pr_info("MapleBench ranges=%d len=%lu: first gap of %lu at %lu, found in %llu ns\n",
+            ranges, len, len + 1, ret ? 0 : gap, ktime_get_ns() - start);
+
+out:
+    if (ret)
+        pr_err("MapleBench ranges=%d len=%lu failed: %d\n", ranges, len, ret);
+    mtree_destroy(&mt);
+    xa_destroy(&xa);
+    kvfree(keys);
+}
+
+static void maple_bench(int ranges) {
+    unsigned long len;
+
+    for (len = 1; len <= 4096; len *= 16)
+        maple_bench_len(ranges, len);
+}
+
+// Bitmap Benchmark
+// Random bitmaps of 2^10, 2^14, ... 2^order bits. AND, popcount and iteration are done
+// bit by bit with test_bit(), as the module used to print its bitmap, and compared with
+// the kernel's word-at-a-time bitmap library and the vector operations in kds_core.h.
+#define BITMAP_BENCH_RESCHED_BITS (1UL << 20)
+
+static u64 bitmap_bench_per_bit_and(unsigned long *dst, const unsigned long *a, const unsigned long *b,
+                                    unsigned long nbits) {
+    u64 start = ktime_get_ns();
+    unsigned long bit;
+
+    for (bit = 0; bit < nbits; bit++) {
+        if (test_bit(bit, a) && test_bit(bit, b))
+            __set_bit(bit, dst);
+        else
+            __clear_bit(bit, dst);
+        if (!(bit % BITMAP_BENCH_RESCHED_BITS))
+            cond_resched();
     }
+    return ktime_get_ns() - start;
 }
 
+static void bitmap_bench_size(unsigned long nbits) {
+    unsigned long *a, *b, *dst, *ref;
+    unsigned long bit, weight[3], count;
+    u64 start, ns[3];
+    int op;
+    static const char * const op_names[] = { "and", "or", "xor", "andnot" };
+
+    a = kds_bitmap_zalloc(nbits);
+    b = kds_bitmap_zalloc(nbits);
+    dst = kds_bitmap_zalloc(nbits);
+    ref = kds_bitmap_zalloc(nbits);
+    if (!a || !b || !dst || !ref) {
+        pr_err("BitmapBench: cannot allocate 4 bitmaps of %lu bits\n", nbits);
+        goto out;
+    }
+    get_random_bytes(a, BITS_TO_LONGS(nbits) * sizeof(long));
+    get_random_bytes(b, BITS_TO_LONGS(nbits) * sizeof(long));
+
+    // Set operations: per bit (AND only), kernel library, vector
+    ns[0] = bitmap_bench_per_bit_and(ref, a, b, nbits);
+    for (op = 0; op < ARRAY_SIZE(op_names); op++) {
+        start = ktime_get_ns();
+        switch (op) {
+        case 0: bitmap_and(ref, a, b, nbits); break;
+        case 1: bitmap_or(ref, a, b, nbits); break;
+        case 2: bitmap_xor(ref, a, b, nbits); break;
+        case 3: bitmap_andnot(ref, a, b, nbits); break;
+        }
+        ns[1] = ktime_get_ns() - start;
+
+        start = ktime_get_ns();
+        switch (op) {
+        case 0: kds_bitmap_and(dst, a, b, nbits); break;
+        case 1: kds_bitmap_or(dst, a, b, nbits); break;
+        case 2: kds_bitmap_xor(dst, a, b, nbits); break;
+        case 3: kds_bitmap_andnot(dst, a, b, nbits); break;
+        }
+        ns[2] = ktime_get_ns() - start;
+
+        if (op == 0)
+            pr_info("BitmapBench bits=%lu %s: per-bit %llu us, word %llu us, vector %llu us\n",
+                    nbits, op_names[op], div_u64(ns[0], 1000), div_u64(ns[1], 1000), div_u64(ns[2], 1000));
+        else
+            pr_info("BitmapBench bits=%lu %s: word %llu us, vector %llu us\n",
+                    nbits, op_names[op], div_u64(ns[1], 1000), div_u64(ns[2], 1000));
+        if (!bitmap_equal(ref, dst, nbits))
+            pr_warn("BitmapBench bits=%lu %s: vector result differs\n", nbits, op_names[op]);
+        cond_resched();
+    }
+
+    // Popcount
+    start = ktime_get_ns();
+    for (weight[0] = 0, bit = 0; bit < nbits; bit++) {
+        weight[0] += test_bit(bit, a);
+        if (!(bit % BITMAP_BENCH_RESCHED_BITS))
+            cond_resched();
+    }
+    ns[0] = ktime_get_ns() - start;
+
+    start = ktime_get_ns();
+    weight[1] = bitmap_weight(a, nbits);
+    ns[1] = ktime_get_ns() - start;
+
+    start = ktime_get_ns();
+    weight[2] = kds_bitmap_weight(a, nbits);
+    ns[2] = ktime_get_ns() - start;
+
+    pr_info("BitmapBench bits=%lu popcount: per-bit %llu us, word %llu us, vector %llu us\n",
+            nbits, div_u64(ns[0], 1000), div_u64(ns[1], 1000), div_u64(ns[2], 1000));
+    if (weight[0] != weight[1] || weight[0] != weight[2])
+        pr_warn("BitmapBench bits=%lu: weights differ (%lu, %lu, %lu)\n", nbits, weight[0], weight[1], weight[2]);
+
+    // Iteration over set bits, on a sparse bitmap (1 in 64) where skipping words pays off
+    bitmap_zero(dst, nbits);
+    for (bit = get_random_u32() % 64; bit < nbits; bit += 64)
+        __set_bit(bit, dst);
+
+    start = ktime_get_ns();
+    for (count = 0, bit = 0; bit < nbits; bit++) {
+        if (test_bit(bit, dst))
+            count++;
+        if (!(bit % BITMAP_BENCH_RESCHED_BITS))
+            cond_resched();
+    }
+    ns[0] = ktime_get_ns() - start;
+
+    start = ktime_get_ns();
+    weight[1] = 0;
+    for_each_set_bit(bit, dst, nbits)
+        weight[1]++;
+    ns[1] = ktime_get_ns() - start;
+
+    pr_info("BitmapBench bits=%lu iterate: per-bit %llu us, find_next_bit %llu us\n",
+            nbits, div_u64(ns[0], 1000), div_u64(ns[1], 1000));
+    if (count != weight[1])
+        pr_warn("BitmapBench bits=%lu: iteration counts differ (%lu, %lu)\n", nbits, count, weight[1]);
+
+out:
+    kds_bitmap_free(ref);
+    kds_bitmap_free(dst);
+    kds_bitmap_free(b);
+    kds_bitmap_free(a);
+}
 
+static void bitmap_bench(int order) {
+    int i;
 
+    for (i = 10; i <= order; i += 4)
+        bitmap_bench_size(1UL << i);
+    if ((order - 10) % 4)
+        bitmap_bench_size(1UL << order);
+}
+
+// Marked Iteration Benchmark
+// Keys 0..N-1 are stored as value entries with all three marks set at insert time. For
+// each mark (selectivity 1/mod) the matching entries are visited through the marks, with
+// and without gang_batch-sized batches, and by a full scan that tests the predicate.
+static void mark_bench_one(struct radix_tree_root *radix, struct xarray *xa, void **results,
+                           const struct kds_mark *m, int n) {
+    struct radix_tree_iter iter;
+    unsigned long index, next;
+    unsigned int found, i;
+    void **slot;
+    void *entry;
+    u64 start, ns[5], count[5] = { 0 };
+
+    // XArray, marked iteration
+    start = ktime_get_ns();
+    xa_for_each_marked(xa, index, entry, m->mark)
+        count[0] += xa_to_value(entry);
+    ns[0] = ktime_get_ns() - start;
+
+    // XArray, batched marked lookup
+    start = ktime_get_ns();
+    next = 0;
+    while ((found = xa_gang_lookup_marked(xa, results, &next, gang_batch, m)) > 0) {
+        for (i = 0; i < found; i++)
+            count[1] += xa_to_value(results[i]);
+    }
+    ns[1] = ktime_get_ns() - start;
+
+    // XArray, filtered full scan
+    start = ktime_get_ns();
+    xa_for_each(xa, index, entry) {
+        if (kds_mark_match(m, xa_to_value(entry)))
+            count[2] += xa_to_value(entry);
+    }
+    ns[2] = ktime_get_ns() - start;
+
+    // Radix tree, batched tagged lookup
+    start = ktime_get_ns();
+    next = 0;
+    while ((found = radix_tree_gang_lookup_marked(radix, results, &next, gang_batch, m)) > 0) {
+        for (i = 0; i < found; i++)
+            count[3] += xa_to_value(results[i]);
+    }
+    ns[3] = ktime_get_ns() - start;
+
+    // Radix tree, filtered full scan
+    start = ktime_get_ns();
+    radix_tree_for_each_slot(slot, radix, &iter, 0) {
+        if (kds_mark_match(m, xa_to_value(*slot)))
+            count[4] += xa_to_value(*slot);
+    }
+    ns[4] = ktime_get_ns() - start;
+
+    pr_info("MarkBench N=%d mark %u (1/%d selected): xarray marked %llu us, batched %llu us, scan %llu us; "
+            "radix batched %llu us, scan %llu us\n", n, kds_mark_tag(m), m->mod,
+            div_u64(ns[0], 1000), div_u64(ns[1], 1000), div_u64(ns[2], 1000),
+            div_u64(ns[3], 1000), div_u64(ns[4], 1000));
+    for (i = 1; i < ARRAY_SIZE(count); i++) {
+        if (count[i] != count[0])
+            pr_warn("MarkBench mark %u: results differ\n", kds_mark_tag(m));
+    }
+}
+
+static void mark_bench(int n) {
+    struct radix_tree_root radix;
+    struct radix_tree_iter iter;
+    struct xarray xa;
+    void **results, **slot;
+    int i, j;
+
+    INIT_RADIX_TREE(&radix, GFP_KERNEL);
+    xa_init(&xa);
+    results = kmalloc_array(gang_batch, sizeof(*results), GFP_KERNEL);
+    if (!results)
+        return;
+
+    for (i = 0; i < n; i++) {
+        if (radix_tree_insert(&radix, i, xa_mk_value(i)) ||
+            xa_err(xa_store(&xa, i, xa_mk_value(i), GFP_KERNEL)))
+            goto out;
+        for (j = 0; j < ARRAY_SIZE(kds_marks); j++) {
+            if (kds_mark_match(&kds_marks[j], i)) {
+                radix_tree_tag_set(&radix, i, kds_mark_tag(&kds_marks[j]));
+                xa_set_mark(&xa, i, kds_marks[j].mark);
+            }
+        }
+        cond_resched();
+    }
+
+    for (j = 0; j < ARRAY_SIZE(kds_marks); j++)
+        mark_bench_one(&radix, &xa, results, &kds_marks[j], n);
+
+out:
+    radix_tree_for_each_slot(slot, &radix, &iter, 0)
+        radix_tree_delete(&radix, iter.index);
+    xa_destroy(&xa);
+    kfree(results);
+}
+
+// Multi-Producer List Benchmark
+// 1, 2, 4, ... up to every online CPU run one producer kthread each, bound to its own CPU,
+// and append list_bench_n preallocated nodes to a spinlocked list_head, a shared llist and
+// the per-CPU llists. Append throughput is measured from a common start to the last
+// producer finishing; afterwards a single consumer drains each list in one batch.
+enum mp_variant {
+    MP_LOCKED,
+    MP_LLIST,
+    MP_PERCPU,
+    MP_VARIANTS,
+};
+static const char *const mp_variant_names[MP_VARIANTS] = { "spinlocked list", "llist", "per-cpu llist" };
+
+struct mp_bench {
+    enum mp_variant variant;
+    int n;
+    atomic_t ready;
+    bool go;
+    spinlock_t lock;
+    struct list_head list;
+    struct llist_head llist;
+    struct llist_head __percpu *pcpu;
+};
+
+struct mp_producer {
+    struct mp_bench *b;
+    int cpu;
+    struct int_node *list_nodes;
+    struct llist_int_node *llist_nodes;
+    u64 end_ns;
+    struct completion done;
+};
+
+static int mp_producer_fn(void *data) {
+    struct mp_producer *p = data;
+    struct mp_bench *b = p->b;
+    int i;
+
+    atomic_inc(&b->ready);
+    while (!READ_ONCE(b->go))
+        cond_resched();
+
+    switch (b->variant) {
+    case MP_LOCKED:
+        for (i = 0; i < b->n; i++) {
+            spin_lock(&b->lock);
+            list_add_tail(&p->list_nodes[i].list, &b->list);
+            spin_unlock(&b->lock);
+        }
+        break;
+    case MP_LLIST:
+        for (i = 0; i < b->n; i++)
+            llist_add(&p->llist_nodes[i].llnode, &b->llist);
+        break;
+    case MP_PERCPU:
+        for (i = 0; i < b->n; i++)
+            llist_add(&p->llist_nodes[i].llnode, per_cpu_ptr(b->pcpu, p->cpu));
+        break;
+    default:
+        break;
+    }
+
+    p->end_ns = ktime_get_ns();
+    kthread_complete_and_exit(&p->done, 0);
+}
+
+// Appends with nr producers; returns the elapsed ns, or 0 if a producer could not start.
+static u64 mp_bench_append(struct mp_bench *b, struct mp_producer *p, int nr) {
+    struct task_struct *task;
+    u64 start, end = 0;
+    int i, started = 0;
+
+    atomic_set(&b->ready, 0);
+    WRITE_ONCE(b->go, false);
+    for (i = 0; i < nr; i++) {
+        init_completion(&p[i].done);
+        task = kthread_create(mp_producer_fn, &p[i], "kds_mp/%d", p[i].cpu);
+        if (IS_ERR(task))
+            break;
+        kthread_bind(task, p[i].cpu);
+        wake_up_process(task);
+        started++;
+    }
+
+    while (atomic_read(&b->ready) < started)
+        cond_resched();
+    start = ktime_get_ns();
+    WRITE_ONCE(b->go, true);
+
+    for (i = 0; i < started; i++) {
+        wait_for_completion(&p[i].done);
+        end = max(end, p[i].end_ns);
+    }
+    return started == nr ? end - start : 0;
+}
+
+// Takes everything appended in one batch and walks it; returns the sum of the values.
+static u64 mp_bench_drain(struct mp_bench *b) {
+    struct int_node *list_node;
+    struct llist_int_node *llist_node;
+    struct llist_node *first = NULL;
+    LIST_HEAD(batch);
+    u64 sum = 0;
+
+    switch (b->variant) {
+    case MP_LOCKED:
+        spin_lock(&b->lock);
+        list_splice_init(&b->list, &batch);
+        spin_unlock(&b->lock);
+        list_for_each_entry(list_node, &batch, list)
+            sum += list_node->value;
+        return sum;
+    case MP_LLIST:
+        first = llist_drain(&b->llist);
+        break;
+    case MP_PERCPU:
+        first = pcpu_list_drain(b->pcpu);
+        break;
+    default:
+        break;
+    }
+    llist_for_each_entry(llist_node, first, llnode)
+        sum += llist_node->value;
+    return sum;
+}
+
+static void list_bench_producers(struct mp_bench *b, struct mp_producer *p, int nr) {
+    u64 append_ns[MP_VARIANTS], drain_ns[MP_VARIANTS];
+    u64 total = (u64)nr * b->n, expect = 0, sum, start;
+    int i, j;
+
+    for (i = 0; i < nr; i++) {
+        for (j = 0; j < b->n; j++) {
+            p[i].list_nodes[j].value = i * b->n + j;
+            p[i].llist_nodes[j].value = i * b->n + j;
+            expect += i * b->n + j;
+        }
+    }
+
+    for (b->variant = 0; b->variant < MP_VARIANTS; b->variant++) {
+        append_ns[b->variant] = mp_bench_append(b, p, nr);
+        start = ktime_get_ns();
+        sum = mp_bench_drain(b);
+        drain_ns[b->variant] = ktime_get_ns() - start;
+        if (!append_ns[b->variant]) {
+            pr_err("ListBench: failed to start %d producers\n", nr);
+            return;
+        }
+        if (sum != expect)
+            pr_warn("ListBench producers=%d %s: lost appends\n", nr, mp_variant_names[b->variant]);
+    }
+
+    for (i = 0; i < MP_VARIANTS; i++) {
+        pr_info("ListBench producers=%d %s: append %llu Kops/s, drain %llu ns per item\n", nr,
+                mp_variant_names[i], div64_u64(total * (NSEC_PER_SEC / 1000), append_ns[i]),
+                div64_u64(drain_ns[i], total));
+    }
+}
+
+static void list_bench(int n) {
+    struct mp_bench b = { .n = n };
+    struct mp_producer *p;
+    int nr_cpus = num_online_cpus();
+    int i = 0, nr, cpu;
+
+    spin_lock_init(&b.lock);
+    INIT_LIST_HEAD(&b.list);
+    init_llist_head(&b.llist);
+    b.pcpu = alloc_percpu(struct llist_head);
+    p = kcalloc(nr_cpus, sizeof(*p), GFP_KERNEL);
+    if (!b.pcpu || !p)
+        goto out;
+
+    // One producer per online CPU, in CPU order. CPUs going offline meanwhile are not
+    // handled; kthread_bind() would simply leave that producer unbound.
+    for_each_online_cpu(cpu) {
+        if (i == nr_cpus)
+            break;
+        p[i].b = &b;
+        p[i].cpu = cpu;
+        p[i].list_nodes = kvmalloc_array(n, sizeof(*p[i].list_nodes), GFP_KERNEL);
+        p[i].llist_nodes = kvmalloc_array(n, sizeof(*p[i].llist_nodes), GFP_KERNEL);
+        if (!p[i].list_nodes || !p[i].llist_nodes) {
+            pr_err("ListBench: failed to allocate %d nodes\n", n);
+            goto out;
+        }
+        i++;
+    }
+    nr_cpus = i;
+
+    for (nr = 1; nr < nr_cpus; nr *= 2)
+        list_bench_producers(&b, p, nr);
+    list_bench_producers(&b, p, nr_cpus);
+
+out:
+    if (p) {
+        for (i = 0; i < nr_cpus; i++) {
+            kvfree(p[i].list_nodes);
+            kvfree(p[i].llist_nodes);
+        }
+    }
+    kfree(p);
+    free_percpu(b.pcpu);
+}
+
+// Range Query Benchmark
+// The same random keys go into the rbtree, the list and a bitmap. Random ranges of a
+// few widths are then counted and summed with the order-statistic rbtree, a linear
+// scan of the list and a popcount / find_next_bit walk over the bitmap.
+#define RANGE_BENCH_QUERIES 1000
+
+struct range_query {
+    int lo, hi;
+};
+
+static void range_bench_width(struct rb_root *root, struct list_head *head, unsigned long *map,
+                              unsigned int space, unsigned int width) {
+    struct range_query *q;
+    struct rb_int_node *rb_pos;
+    struct int_node *list_pos;
+    u64 start, rb_ns, list_ns, bitmap_ns;
+    u64 rb_count = 0, list_count = 0, bitmap_count = 0;
+    u64 rb_sum = 0, list_sum = 0, bitmap_sum = 0;
+    unsigned int bit;
+    int i;
+
+    q = kmalloc_array(RANGE_BENCH_QUERIES, sizeof(*q), GFP_KERNEL);
+    if (!q)
+        return;
+    for (i = 0; i < RANGE_BENCH_QUERIES; i++) {
+        q[i].lo = get_random_u32() % (space - width + 1);
+        q[i].hi = q[i].lo + width - 1;
+    }
+
+    // Count in range
+    start = ktime_get_ns();
+    for (i = 0; i < RANGE_BENCH_QUERIES; i++)
+        rb_count += rb_count_range(root, q[i].lo, q[i].hi);
+    rb_ns = ktime_get_ns() - start;
+
+    start = ktime_get_ns();
+    for (i = 0; i < RANGE_BENCH_QUERIES; i++) {
+        list_for_each_entry(list_pos, head, list)
+            list_count += list_pos->value >= q[i].lo && list_pos->value <= q[i].hi;
+        cond_resched();
+    }
+    list_ns = ktime_get_ns() - start;
+
+    start = ktime_get_ns();
+    for (i = 0; i < RANGE_BENCH_QUERIES; i++)
+        bitmap_count += bitmap_weight_range(map, q[i].lo, q[i].hi + 1);
+    bitmap_ns = ktime_get_ns() - start;
+
+    pr_info("RangeBench width=%u count: rbtree %llu ns, list %llu ns, bitmap %llu ns per query\n",
+            width, div_u64(rb_ns, RANGE_BENCH_QUERIES), div_u64(list_ns, RANGE_BENCH_QUERIES),
+            div_u64(bitmap_ns, RANGE_BENCH_QUERIES));
+    if (rb_count != list_count || rb_count != bitmap_count)
+        pr_warn("RangeBench width=%u: counts differ (%llu, %llu, %llu)\n", width, rb_count, list_count, bitmap_count);
+
+    // Iterate over range
+    start = ktime_get_ns();
+    for (i = 0; i < RANGE_BENCH_QUERIES; i++) {
+        rb_for_each_in_range(rb_pos, root, q[i].lo, q[i].hi)
+            rb_sum += rb_pos->value;
+    }
+    rb_ns = ktime_get_ns() - start;
+
+    start = ktime_get_ns();
+    for (i = 0; i < RANGE_BENCH_QUERIES; i++) {
+        list_for_each_entry(list_pos, head, list) {
+            if (list_pos->value >= q[i].lo && list_pos->value <= q[i].hi)
+                list_sum += list_pos->value;
+        }
+        cond_resched();
+    }
+    list_ns = ktime_get_ns() - start;
+
+    start = ktime_get_ns();
+    for (i = 0; i < RANGE_BENCH_QUERIES; i++) {
+        for (bit = find_next_bit(map, q[i].hi + 1, q[i].lo); bit <= q[i].hi;
+             bit = find_next_bit(map, q[i].hi + 1, bit + 1))
+            bitmap_sum += bit;
+    }
+    bitmap_ns = ktime_get_ns() - start;
+
+    pr_info("RangeBench width=%u iterate: rbtree %llu ns, list %llu ns, bitmap %llu ns per query\n",
+            width, div_u64(rb_ns, RANGE_BENCH_QUERIES), div_u64(list_ns, RANGE_BENCH_QUERIES),
+            div_u64(bitmap_ns, RANGE_BENCH_QUERIES));
+    if (rb_sum != list_sum || rb_sum != bitmap_sum)
+        pr_warn("RangeBench width=%u: sums differ\n", width);
+
+    kfree(q);
+}
+
+static void range_bench(int n) {
+    struct rb_root root = RB_ROOT;
+    LIST_HEAD(head);
+    struct rb_int_node *rb_node;
+    struct rb_node *node, *next;
+    struct int_node *list_node, *tmp;
+    unsigned long *map;
+    unsigned int space = 4 * n, width;
+    int i;
+
+    map = bitmap_zalloc(space, GFP_KERNEL);
+    if (!map)
+        return;
+
+    for (i = 0; i < n; i++) {
+        rb_node = kmem_cache_alloc(rb_int_node_cache, GFP_KERNEL);
+        list_node = kmem_cache_alloc(int_node_cache, GFP_KERNEL);
+        if (!rb_node || !list_node) {
+            if (rb_node)
+                kmem_cache_free(rb_int_node_cache, rb_node);
+            if (list_node)
+                kmem_cache_free(int_node_cache, list_node);
+            goto out;
+        }
+        rb_node->value = get_random_u32() % space;
+        if (!rb_link_value(rb_node, &root)) {
+            kmem_cache_free(rb_int_node_cache, rb_node);
+            kmem_cache_free(int_node_cache, list_node);
+            continue;
+        }
+        list_node->value = rb_node->value;
+        list_add_tail(&list_node->list, &head);
+        set_bit(rb_node->value, map);
+        cond_resched();
+    }
+
+    pr_info("RangeBench: %u distinct keys in [0, %u)\n", rb_size(root.rb_node), space);
+    for (width = space / 1000; width <= space; width *= 10) {
+        if (width)
+            range_bench_width(&root, &head, map, space, width);
+    }
+
+out:
+    list_for_each_entry_safe(list_node, tmp, &head, list) {
+        list_del(&list_node->list);
+        kmem_cache_free(int_node_cache, list_node);
+    }
+    for (node = rb_first(&root); node; node = next) {
+        next = rb_next(node);
+        rb_erase_value(rb_entry(node, struct rb_int_node, rb_node), &root);
+        kmem_cache_free(rb_int_node_cache, rb_entry(node, struct rb_int_node, rb_node));
+    }
+    bitmap_free(map);
+}
+
+
+// B+ Tree Benchmark
+// The same random keys go into the rbtree, radix tree, XArray and B+ tree set. Random
+// lookups measure pointer chasing; a full ordered scan measures sequential access.
+#define BTREE_BENCH_LOOKUPS 1000000
+
+static void btree_bench(int n) {
+    struct rb_root root = RB_ROOT;
+    struct radix_tree_root radix;
+    struct radix_tree_iter iter;
+    struct xarray xa;
+    struct btree_set set;
+    struct rb_int_node *rb_node;
+    struct rb_node *node, *next;
+    unsigned long index;
+    unsigned int space = 4 * n, pos;
+    void **slot;
+    void *entry;
+    int *keys;
+    u64 start, rb_ns, radix_ns, xa_ns, btree_ns;
+    u64 rb_hits = 0, radix_hits = 0, xa_hits = 0, btree_hits = 0;
+    u64 rb_sum = 0, radix_sum = 0, xa_sum = 0, btree_sum = 0;
+    int i;
+
+    INIT_RADIX_TREE(&radix, GFP_KERNEL);
+    xa_init(&xa);
+    keys = kvmalloc_array(BTREE_BENCH_LOOKUPS, sizeof(int), GFP_KERNEL);
+    if (!keys)
+        return;
+
+    // Keys are stored as value entries in the radix tree and XArray, so every structure
+    // resolves a lookup to the key without a separate item allocation.
+    for (i = 0; i < n; i++) {
+        rb_node = kmem_cache_alloc(rb_int_node_cache, GFP_KERNEL);
+        if (!rb_node)
+            goto out;
+        rb_node->value = get_random_u32() % space;
+        if (!rb_link_value(rb_node, &root)) {
+            kmem_cache_free(rb_int_node_cache, rb_node);
+            continue;
+        }
+        if (radix_tree_insert(&radix, rb_node->value, xa_mk_value(rb_node->value)) ||
+            xa_err(xa_store(&xa, rb_node->value, xa_mk_value(rb_node->value), GFP_KERNEL)))
+            goto out;
+        cond_resched();
+    }
+    if (btree_set_from_rbtree(&set, &root))
+        goto out;
+
+    for (i = 0; i < BTREE_BENCH_LOOKUPS; i++)
+        keys[i] = get_random_u32() % space;
+
+    // Lookup-heavy
+    start = ktime_get_ns();
+    for (i = 0; i < BTREE_BENCH_LOOKUPS; i++) {
+        rb_node = rb_lower_bound(&root, keys[i]);
+        rb_hits += rb_node && rb_node->value == keys[i];
+    }
+    rb_ns = ktime_get_ns() - start;
+
+    start = ktime_get_ns();
+    for (i = 0; i < BTREE_BENCH_LOOKUPS; i++)
+        radix_hits += radix_tree_lookup(&radix, keys[i]) != NULL;
+    radix_ns = ktime_get_ns() - start;
+
+    start = ktime_get_ns();
+    for (i = 0; i < BTREE_BENCH_LOOKUPS; i++)
+        xa_hits += xa_load(&xa, keys[i]) != NULL;
+    xa_ns = ktime_get_ns() - start;
+
+    start = ktime_get_ns();
+    for (i = 0; i < BTREE_BENCH_LOOKUPS; i++)
+        btree_hits += btree_set_contains(&set, keys[i]);
+    btree_ns = ktime_get_ns() - start;
+
+    pr_info("BTreeBench N=%u lookup: rbtree %llu, radix %llu, xarray %llu, btree %llu ns per 1000 lookups\n",
+            set.n, div_u64(rb_ns, BTREE_BENCH_LOOKUPS / 1000), div_u64(radix_ns, BTREE_BENCH_LOOKUPS / 1000),
+            div_u64(xa_ns, BTREE_BENCH_LOOKUPS / 1000), div_u64(btree_ns, BTREE_BENCH_LOOKUPS / 1000));
+    if (rb_hits != radix_hits || rb_hits != xa_hits || rb_hits != btree_hits)
+        pr_warn("BTreeBench: hit counts differ (%llu, %llu, %llu, %llu)\n", rb_hits, radix_hits, xa_hits, btree_hits);
+
+    // Scan-heavy
+    start = ktime_get_ns();
+    for (node = rb_first(&root); node; node = rb_next(node))
+        rb_sum += rb_entry(node, struct rb_int_node, rb_node)->value;
+    rb_ns = ktime_get_ns() - start;
+
+    start = ktime_get_ns();
+    radix_tree_for_each_slot(slot, &radix, &iter, 0)
+        radix_sum += xa_to_value(*slot);
+    radix_ns = ktime_get_ns() - start;
+
+    start = ktime_get_ns();
+    xa_for_each(&xa, index, entry)
+        xa_sum += xa_to_value(entry);
+    xa_ns = ktime_get_ns() - start;
+
+    start = ktime_get_ns();
+    btree_set_for_each(pos, &set)
+        btree_sum += set.layers[0][pos];
+    btree_ns = ktime_get_ns() - start;
+
+    pr_info("BTreeBench N=%u scan: rbtree %llu, radix %llu, xarray %llu, btree %llu ns per 1000 keys\n",
+            set.n, div_u64(rb_ns * 1000, set.n), div_u64(radix_ns * 1000, set.n),
+            div_u64(xa_ns * 1000, set.n), div_u64(btree_ns * 1000, set.n));
+    if (rb_sum != radix_sum || rb_sum != xa_sum || rb_sum != btree_sum)
+        pr_warn("BTreeBench: scan sums differ\n");
+
+    btree_set_destroy(&set);
+out:
+    for (node = rb_first(&root); node; node = next) {
+        next = rb_next(node);
+        rb_erase_value(rb_entry(node, struct rb_int_node, rb_node), &root);
+        kmem_cache_free(rb_int_node_cache, rb_entry(node, struct rb_int_node, rb_node));
+    }
+    radix_tree_for_each_slot(slot, &radix, &iter, 0)
+        radix_tree_delete(&radix, iter.index);
+    xa_destroy(&xa);
+    kvfree(keys);
+}
+
+
+
+
+// Frees everything kds_init set up, whether or not it got to the end.
+static void kds_free_all(void) {
+    struct int_node *tmp_node, *itr;
+    struct rb_node *node, *node_next;
+    struct hash_int_node *hash_node;
+    struct hlist_node *tmp;
+    int bkt;
+    void **slot;
+    struct radix_tree_iter iter;
+
+    // Remove all inserted numbers in the Linked List
+    list_for_each_entry_safe(itr, tmp_node, &int_list, list) {
+        list_del(&itr->list);
+        kmem_cache_free(int_node_cache, itr);
+    }
+
+    // Remove anything left in the Lock-free List and the Per-CPU List
+    llist_free_all(llist_del_all(&int_llist));
+    llist_free_all(pcpu_list_drain(&pcpu_int_list));
+
+    // Remove all inserted numbers in the RB Tree
+    for (node = rb_first(&mytree); node; node = node_next) {
+        node_next = rb_next(node);
+        rb_erase_value(container_of(node, struct rb_int_node, rb_node), &mytree);
+        kmem_cache_free(rb_int_node_cache, container_of(node, struct rb_int_node, rb_node));
+    }
+
+    // Remove all inserted numbers in the Hash Table
+    hash_for_each_safe(myhashtable, bkt, tmp, hash_node, hnode) {
+        hash_del(&hash_node->hnode);
+        kmem_cache_free(hash_int_node_cache, hash_node);
+    }
+
+    // Free the B+ Tree Set
+    btree_set_destroy(&my_btree);
+
+    // Remove all inserted numbers in the Resizable Hash Table
+    rhashtable_free_and_destroy(&my_rhashtable, rhash_free_node, NULL);
+
+    // Remove all inserted numbers in the Radix Tree
+    radix_tree_for_each_slot(slot, &my_radix_tree, &iter, 0) {
+        kmem_cache_free(radix_item_cache, radix_tree_delete(&my_radix_tree, iter.index));
+    }
+
+    // Remove all inserted numbers in the XArray
+    xarray_clear();
+
+    // Remove all ranges in the Maple Tree
+    mtree_destroy(&my_maple_tree);
+
+    // Remove all inserted numbers in Bitmap
+    bitmap_zero(my_bitmap, 1001);
+
+    kds_caches_destroy();
+}
 
 //kds_init
 static int __init kds_init(void) {
     char *token;
-    char *temp_str = kstrdup(int_str, GFP_KERNEL);
+    char *str = kstrdup(int_str, GFP_KERNEL), *temp_str = str;
     struct rb_node *rb_node;
     struct int_node *itr, *list_node;
+    struct llist_int_node *llist_node;
+    struct llist_node *first;
     struct hash_int_node *hash_node;
     int bkt;
     int i;
 
-    if (!temp_str) {
+    if (!str) {
         pr_err("Failed to allocate memory for temporary string\n");
         return -ENOMEM;
     }
 
+    if (mark1_mod <= 0 || mark2_mod <= 0 || gang_batch <= 0) {
+        pr_err("mark1_mod, mark2_mod and gang_batch must be positive\n");
+        kfree(str);
+        return -EINVAL;
+    }
+    kds_marks[1].mod = mark1_mod;
+    kds_marks[2].mod = mark2_mod;
+
+    if (kds_caches_create()) {
+        pr_err("Failed to create slab caches\n");
+        kfree(str);
+        return -ENOMEM;
+    }
+
+    if (rhashtable_init(&my_rhashtable, &rhash_params)) {
+        pr_err("Failed to initialize rhashtable\n");
+        kds_caches_destroy();
+        kfree(str);
+        return -ENOMEM;
+    }
+
     pr_info("kds module loaded with string: %s\n", int_str);
 
     while ((token = strsep(&temp_str, " "))) {
@@ -220,14 +1951,19 @@ static int __init kds_init(void) {
             pr_info("Parsed number: %d\n", num);
 
             // For Linked List
-            list_node = kmalloc(sizeof(*list_node), GFP_KERNEL);
+            list_node = kmem_cache_alloc(int_node_cache, GFP_KERNEL);
             if (!list_node) {
-                kfree(temp_str);
+                kfree(str);
+                kds_free_all();
                 return -ENOMEM;
             }
             list_node->value = num;
             list_add_tail(&list_node->list, &int_list);
 
+            // For Lock-free List and Per-CPU List
+            if (llist_insert(num, &int_llist) || pcpu_list_insert(num, &pcpu_int_list))
+                pr_err("Failed to allocate lock-free list node\n");
+
             // For Red-black Tree
             rb_insert(num, &mytree);
 
@@ -235,6 +1971,9 @@ static int __init kds_init(void) {
             hash_insert(num);
 	    hash_lookup_and_print(num);
 
+            // For Resizable Hash Table
+            rhash_insert(num);
+            rhash_lookup_and_print(num);
 
             // For Radix Tree
 	    radix_tree_insert_num(num);
@@ -246,7 +1985,7 @@ static int __init kds_init(void) {
 	    set_bit(num, my_bitmap);
         }
     }
-    kfree(temp_str);
+    kfree(str);
 
 
     // Print Linked List values
@@ -254,27 +1993,70 @@ static int __init kds_init(void) {
         pr_info("Linked list value: %d\n", itr->value);
     }
 
+    // Drain the Lock-free List and the Per-CPU List in one batch each, as an event queue
+    // consumer would, then print and free what was taken
+    first = llist_drain(&int_llist);
+    llist_for_each_entry(llist_node, first, llnode) {
+        pr_info("Lock-free list value: %d\n", llist_node->value);
+    }
+    llist_free_all(first);
+
+    first = pcpu_list_drain(&pcpu_int_list);
+    llist_for_each_entry(llist_node, first, llnode) {
+        pr_info("Per-CPU list value: %d\n", llist_node->value);
+    }
+    llist_free_all(first);
+
     // Print RB Tree values
     for (rb_node = rb_first(&mytree); rb_node; rb_node = rb_next(rb_node)) {
       pr_info("RBTree value: %d\n", container_of(rb_node, struct rb_int_node, rb_node)->value);
     }
 
+    // Order statistics and range query on the RB Tree
+    rb_print_range(range_lo, range_hi);
+
+    // Maple Tree
+    // Store the requested ranges, print them and look up every parsed number
+    maple_parse_ranges();
+    maple_print();
+    list_for_each_entry(itr, &int_list, list) {
+        maple_lookup_and_print(itr->value);
+    }
+    if (maple_gap > 0) {
+        unsigned long gap;
+
+        if (!maple_find_gap(&my_maple_tree, maple_gap, &gap))
+            pr_info("MapleTree first gap of %lu: starts at %lu\n", maple_gap, gap);
+        else
+            pr_info("MapleTree has no gap of %lu\n", maple_gap);
+    }
+
+    // Build the B+ Tree Set from the RB Tree and print its values
+    if (btree_set_from_rbtree(&my_btree, &mytree))
+        pr_err("Failed to build B+ tree set\n");
+    btree_set_for_each(i, &my_btree) {
+        pr_info("BTree value: %d\n", my_btree.layers[0][i]);
+    }
+
     // Print Hash Table values
     hash_for_each(myhashtable, bkt, hash_node, hnode) {
         pr_info("HashTable value: %d\n", hash_node->value);
     }
 
+    // Print Resizable Hash Table values
+    rhash_print();
+
     // Radix Tree
     // Print the initial Radix Tree values
     pr_info("Initial Radix Tree Values:\n");
     radix_tree_print();
 
-    // Tag odd numbers in Radix Tree
-    radix_tree_tag_odds();
-
-    // Print tagged odd numbers from the Radix Tree
-    pr_info("Tagged Odd Radix Tree Values:\n");
-    radix_tree_print_tagged();
+    // Print the values behind every tag, which were set at insert time
+    for (i = 0; i < ARRAY_SIZE(kds_marks); i++) {
+        pr_info("Tagged Radix Tree Values (tag %u: value %% %d == %d):\n", kds_mark_tag(&kds_marks[i]),
+                kds_marks[i].mod, kds_marks[i].rem);
+        radix_tree_print_tagged(&kds_marks[i]);
+    }
 
 
     // XArray
@@ -282,64 +2064,57 @@ static int __init kds_init(void) {
     pr_info("Initial XArray Values:\n");
     xarray_print();
 
-    // Tag odd numbers in XArray
-    xarray_tag_odds();
-
-    // Print tagged odd numbers from the XArray
-    pr_info("Tagged Odd XArray Values:\n");
-    xarray_print_tagged();
+    // Print the values behind every mark, which were set at insert time
+    for (i = 0; i < ARRAY_SIZE(kds_marks); i++) {
+        pr_info("Tagged XArray Values (mark %u: value %% %d == %d):\n", kds_mark_tag(&kds_marks[i]),
+                kds_marks[i].mod, kds_marks[i].rem);
+        xarray_print_tagged(&kds_marks[i]);
+    }
 
     // Print Bitmap values
-    for (i = 0; i <= 1000; i++) {
-        if (test_bit(i, my_bitmap)) {
-            pr_info("Bitmap bit turned on for: %d\n", i);
-        }
+    for_each_set_bit(i, my_bitmap, 1001) {
+        pr_info("Bitmap bit turned on for: %d\n", i);
     }
 
-    return 0;
-}
+    // Fixed versus resizable hash table benchmark
+    if (hash_bench_max > 0)
+        hash_bench();
 
+    // Bytes per element and iteration cost of every structure
+    if (footprint_n > 0)
+        footprint_bench(footprint_n);
 
+    // Order-statistic rbtree versus list scan and bitmap popcount
+    if (range_bench_n > 0)
+        range_bench(range_bench_n);
 
-static void __exit kds_exit(void) {
-    struct int_node *tmp_node, *itr;
-    struct rb_node *node, *node_next;
-    struct hash_int_node *hash_node;
-    struct hlist_node *tmp;
-    int bkt;
-    void **slot;
-    struct radix_tree_iter iter;
+    // B+ tree set versus rbtree, radix tree and XArray
+    if (btree_bench_n > 0)
+        btree_bench(btree_bench_n);
 
-    // Remove all inserted numbers in the Linked List
-    list_for_each_entry_safe(itr, tmp_node, &int_list, list) {
-        list_del(&itr->list);
-        kfree(itr);
-    }
+    // Maple tree ranges versus one XArray entry per index
+    if (maple_bench_ranges > 0)
+        maple_bench(maple_bench_ranges);
 
-    // Remove all inserted numbers in the RB Tree
-    for (node = rb_first(&mytree); node; node = node_next) {
-        node_next = rb_next(node);
-        rb_erase(node, &mytree);
-        kfree(container_of(node, struct rb_int_node, rb_node));
-    }
+    // Spinlocked list versus lock-free and per-CPU lists with concurrent producers
+    if (list_bench_n > 0)
+        list_bench(list_bench_n);
 
-    // Remove all inserted numbers in the Hash Table
-    hash_for_each_safe(myhashtable, bkt, tmp, hash_node, hnode) {
-        hash_del(&hash_node->hnode);
-        kfree(hash_node);
-    }
+    // Marked iteration versus filtered full scan
+    if (mark_bench_n > 0)
+        mark_bench(mark_bench_n);
 
-    // Remove all inserted numbers in the Radix Tree
-    radix_tree_for_each_slot(slot, &my_radix_tree, &iter, 0) {
-        radix_tree_delete(&my_radix_tree, iter.index);
-    }
+    // Per-bit loops versus word-parallel and vector bitmap operations
+    if (bitmap_bench_order > 0)
+        bitmap_bench(min(bitmap_bench_order, 30));
+
+    return 0;
+}
 
-    // Remove all inserted numbers in the XArray
-    xarray_clear();
 
-    // Remove all inserted numbers in Bitmap
-    bitmap_zero(my_bitmap, 1001);
 
+static void __exit kds_exit(void) {
+    kds_free_all();
     pr_info("kds module unloaded\n");
 }
 
@@ -0,0 +1,406 @@
+// Userspace microbenchmark for the kds structures.
+//
+// Builds the list, rbtree, hash table, B+ tree set and bitmap from kds_core.h with the
+// kernel's own list/rbtree/hashtable code (tools/include, tools/lib), then times each
+// operation over a number of repetitions after a warmup and reports percentiles of the
+// per-operation cost. Benchmarks in the same group must agree on their result, so a
+// broken structure fails the run instead of only looking fast.
+#include <getopt.h>
+
+#include "kds_core.h"
+
+static int nr_keys = 1 << 20;
+static int nr_queries = 1 << 16;
+static int repetitions = 20;
+static int warmup = 3;
+
+static int *keys, *queries;
+static struct int_node *list_nodes;
+static struct rb_int_node *rb_nodes;
+static struct hash_int_node *hash_nodes;
+static unsigned long *key_bitmap, *query_bitmap, *result_bitmap;
+static int key_space;
+static unsigned int range_width;
+
+static LIST_HEAD(bench_list);
+static struct rb_root bench_tree = RB_ROOT;
+static DEFINE_HASHTABLE(bench_hashtable, 10);
+static struct btree_set bench_btree;
+
+struct bench {
+    const char *name;
+    const char *group;   // Benchmarks in one group must return the same checksum.
+    void (*reset)(void); // Runs untimed before every repetition, may be NULL.
+    u64 (*run)(void);    // Returns a checksum over what it looked at.
+    int *ops;            // Operations per run, for the per-operation cost.
+};
+
+// Setup
+static int setup(void) {
+    unsigned int n = 0;
+    int i;
+
+    key_space = 4 * nr_keys;
+    range_width = key_space / 100 ? key_space / 100 : 1;
+    keys = kmalloc_array(nr_keys, sizeof(*keys), GFP_KERNEL);
+    queries = kmalloc_array(nr_queries, sizeof(*queries), GFP_KERNEL);
+    list_nodes = kmalloc_array(nr_keys, sizeof(*list_nodes), GFP_KERNEL);
+    rb_nodes = kmalloc_array(nr_keys, sizeof(*rb_nodes), GFP_KERNEL);
+    hash_nodes = kmalloc_array(nr_keys, sizeof(*hash_nodes), GFP_KERNEL);
+    key_bitmap = kds_bitmap_zalloc(key_space);
+    query_bitmap = kds_bitmap_zalloc(key_space);
+    result_bitmap = kds_bitmap_zalloc(key_space);
+    if (!keys || !queries || !list_nodes || !rb_nodes || !hash_nodes ||
+        !key_bitmap || !query_bitmap || !result_bitmap)
+        return -ENOMEM;
+
+    // Distinct random keys, deduplicated through the rbtree.
+    for (i = 0; i < nr_keys; i++) {
+        rb_nodes[n].value = get_random_u32() % key_space;
+        if (!rb_link_value(&rb_nodes[n], &bench_tree))
+            continue;
+        keys[n] = rb_nodes[n].value;
+        n++;
+    }
+    nr_keys = n;
+
+    for (i = 0; i < nr_keys; i++) {
+        list_nodes[i].value = keys[i];
+        list_add_tail(&list_nodes[i].list, &bench_list);
+        hash_nodes[i].value = keys[i];
+        hash_add(bench_hashtable, &hash_nodes[i].hnode, keys[i]);
+        set_bit(keys[i], key_bitmap);
+    }
+    for (i = 0; i < nr_queries; i++) {
+        queries[i] = get_random_u32() % (key_space - range_width + 1);
+        set_bit(queries[i], query_bitmap);
+    }
+
+    return btree_set_from_rbtree(&bench_btree, &bench_tree);
+}
+
+// Lookups
+static u64 run_rbtree_lookup(void) {
+    struct rb_int_node *node;
+    u64 hits = 0;
+    int i;
+
+    for (i = 0; i < nr_queries; i++) {
+        node = rb_lower_bound(&bench_tree, queries[i]);
+        hits += node && node->value == queries[i];
+    }
+    return hits;
+}
+
+static u64 run_hash_lookup(void) {
+    struct hash_int_node *node;
+    u64 hits = 0;
+    int i;
+
+    for (i = 0; i < nr_queries; i++) {
+        hash_for_each_possible(bench_hashtable, node, hnode, queries[i]) {
+            if (node->value == queries[i]) {
+                hits++;
+                break;
+            }
+        }
+    }
+    return hits;
+}
+
+static u64 run_btree_lookup(void) {
+    u64 hits = 0;
+    int i;
+
+    for (i = 0; i < nr_queries; i++)
+        hits += btree_set_contains(&bench_btree, queries[i]);
+    return hits;
+}
+
+static u64 run_bitmap_lookup(void) {
+    u64 hits = 0;
+    int i;
+
+    for (i = 0; i < nr_queries; i++)
+        hits += test_bit(queries[i], key_bitmap);
+    return hits;
+}
+
+// Full scans
+static u64 run_list_scan(void) {
+    struct int_node *node;
+    u64 sum = 0;
+
+    list_for_each_entry(node, &bench_list, list)
+        sum += node->value;
+    return sum;
+}
+
+static u64 run_rbtree_scan(void) {
+    struct rb_node *node;
+    u64 sum = 0;
+
+    for (node = rb_first(&bench_tree); node; node = rb_next(node))
+        sum += rb_entry(node, struct rb_int_node, rb_node)->value;
+    return sum;
+}
+
+static u64 run_btree_scan(void) {
+    unsigned int pos;
+    u64 sum = 0;
+
+    btree_set_for_each(pos, &bench_btree)
+        sum += bench_btree.layers[0][pos];
+    return sum;
+}
+
+// Range counts
+static u64 run_rbtree_range(void) {
+    u64 count = 0;
+    int i;
+
+    for (i = 0; i < nr_queries; i++)
+        count += rb_count_range(&bench_tree, queries[i], queries[i] + range_width - 1);
+    return count;
+}
+
+static u64 run_bitmap_range(void) {
+    u64 count = 0;
+    int i;
+
+    for (i = 0; i < nr_queries; i++)
+        count += bitmap_weight_range(key_bitmap, queries[i], queries[i] + range_width);
+    return count;
+}
+
+// Order statistics
+static u64 run_rbtree_rank(void) {
+    u64 sum = 0;
+    int i;
+
+    for (i = 0; i < nr_queries; i++)
+        sum += rb_rank(&bench_tree, queries[i], false);
+    return sum;
+}
+
+static u64 run_rbtree_select(void) {
+    u64 sum = 0;
+    int i;
+
+    for (i = 0; i < nr_queries; i++)
+        sum += rb_select(&bench_tree, queries[i] % nr_keys)->value;
+    return sum;
+}
+
+// Whole-bitmap operations, one word at a time versus a vector of words at a time
+static u64 run_bitmap_and_word(void) {
+    unsigned long i;
+
+    for (i = 0; i < BITS_TO_LONGS(key_space); i++)
+        result_bitmap[i] = key_bitmap[i] & query_bitmap[i];
+    return kds_bitmap_weight(result_bitmap, key_space);
+}
+
+static u64 run_bitmap_and_vec(void) {
+    kds_bitmap_and(result_bitmap, key_bitmap, query_bitmap, key_space);
+    return kds_bitmap_weight(result_bitmap, key_space);
+}
+
+static u64 run_bitmap_weight_word(void) {
+    unsigned long i, weight = 0;
+
+    for (i = 0; i < key_space / BITS_PER_LONG; i++)
+        weight += hweight_long(key_bitmap[i]);
+    if (key_space % BITS_PER_LONG)
+        weight += hweight_long(key_bitmap[i] & BITMAP_LAST_WORD_MASK(key_space));
+    return weight;
+}
+
+static u64 run_bitmap_weight_vec(void) {
+    return kds_bitmap_weight(key_bitmap, key_space);
+}
+
+// Inserts
+static void reset_rbtree_insert(void) {
+    bench_tree = RB_ROOT;
+}
+
+static u64 run_rbtree_insert(void) {
+    u64 inserted = 0;
+    int i;
+
+    for (i = 0; i < nr_keys; i++)
+        inserted += rb_link_value(&rb_nodes[i], &bench_tree);
+    return inserted;
+}
+
+static void reset_hash_insert(void) {
+    hash_init(bench_hashtable);
+}
+
+static u64 run_hash_insert(void) {
+    int i;
+
+    for (i = 0; i < nr_keys; i++)
+        hash_add(bench_hashtable, &hash_nodes[i].hnode, hash_nodes[i].value);
+    return nr_keys;
+}
+
+static u64 run_btree_build(void) {
+    btree_set_destroy(&bench_btree);
+    if (btree_set_from_rbtree(&bench_btree, &bench_tree))
+        return 0;
+    return bench_btree.n;
+}
+
+static struct bench benches[] = {
+    { "rbtree_lookup", "lookup", NULL, run_rbtree_lookup, &nr_queries },
+    { "hash_lookup", "lookup", NULL, run_hash_lookup, &nr_queries },
+    { "btree_lookup", "lookup", NULL, run_btree_lookup, &nr_queries },
+    { "bitmap_lookup", "lookup", NULL, run_bitmap_lookup, &nr_queries },
+    { "list_scan", "scan", NULL, run_list_scan, &nr_keys },
+    { "rbtree_scan", "scan", NULL, run_rbtree_scan, &nr_keys },
+    { "btree_scan", "scan", NULL, run_btree_scan, &nr_keys },
+    { "rbtree_range", "range", NULL, run_rbtree_range, &nr_queries },
+    { "bitmap_range", "range", NULL, run_bitmap_range, &nr_queries },
+    { "rbtree_rank", "rank", NULL, run_rbtree_rank, &nr_queries },
+    { "rbtree_select", "select", NULL, run_rbtree_select, &nr_queries },
+    { "bitmap_and_word", "and", NULL, run_bitmap_and_word, &key_space },
+    { "bitmap_and_vec", "and", NULL, run_bitmap_and_vec, &key_space },
+    { "bitmap_weight_word", "weight", NULL, run_bitmap_weight_word, &key_space },
+    { "bitmap_weight_vec", "weight", NULL, run_bitmap_weight_vec, &key_space },
+    // Inserts go last: they rebuild the structures the lookups above read.
+    { "rbtree_insert", "insert", reset_rbtree_insert, run_rbtree_insert, &nr_keys },
+    { "hash_insert", "insert", reset_hash_insert, run_hash_insert, &nr_keys },
+    { "btree_build", "insert", NULL, run_btree_build, &nr_keys },
+};
+
+// Driver
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples.
+static double percentile(const double *sorted, int n, int pct) {
+    int rank = (pct * n + 99) / 100;
+
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static bool selected(const char *name, int argc, char **argv) {
+    int i;
+
+    if (optind >= argc)
+        return true;
+    for (i = optind; i < argc; i++) {
+        if (strstr(name, argv[i]))
+            return true;
+    }
+    return false;
+}
+
+static int run_bench(struct bench *b, u64 *checksum) {
+    double *samples;
+    u64 start, sum = 0;
+    int i;
+
+    samples = kmalloc_array(repetitions, sizeof(*samples), GFP_KERNEL);
+    if (!samples)
+        return -ENOMEM;
+
+    for (i = -warmup; i < repetitions; i++) {
+        if (b->reset)
+            b->reset();
+        start = ktime_get_ns();
+        sum = b->run();
+        start = ktime_get_ns() - start;
+        if (i >= 0)
+            samples[i] = (double)start / *b->ops;
+        if (i > -warmup && sum != *checksum) {
+            pr_err("%s: result changed between repetitions\n", b->name);
+            kfree(samples);
+            return -EINVAL;
+        }
+        *checksum = sum;
+    }
+
+    qsort(samples, repetitions, sizeof(*samples), cmp_double);
+    pr_info("%-16s %-8s %10d %9.2f %9.2f %9.2f %9.2f %9.2f\n", b->name, b->group, *b->ops,
+            samples[0], percentile(samples, repetitions, 50), percentile(samples, repetitions, 90),
+            percentile(samples, repetitions, 99), samples[repetitions - 1]);
+    kfree(samples);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n keys] [-q queries] [-r repetitions] [-w warmup] [benchmark ...]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    u64 checksums[ARRAY_SIZE(benches)];
+    int option, ret = 0;
+    unsigned int i, j;
+
+    while ((option = getopt(argc, argv, "n:q:r:w:")) != -1) {
+        switch (option) {
+            case 'n':
+                nr_keys = atoi(optarg);
+                break;
+            case 'q':
+                nr_queries = atoi(optarg);
+                break;
+            case 'r':
+                repetitions = atoi(optarg);
+                break;
+            case 'w':
+                warmup = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (nr_keys <= 0 || nr_queries <= 0 || repetitions <= 0 || warmup < 0)
+        usage(argv[0]);
+
+    if (setup()) {
+        pr_err("Failed to set up benchmark data\n");
+        return EXIT_FAILURE;
+    }
+
+    pr_info("kds_bench: %d keys in [0, %d), %d queries, range width %u, %d repetitions after %d warmup\n",
+            nr_keys, key_space, nr_queries, range_width, repetitions, warmup);
+    pr_info("%-16s %-8s %10s %9s %9s %9s %9s %9s  (ns/op)\n", "benchmark", "group", "ops",
+            "min", "p50", "p90", "p99", "max");
+
+    for (i = 0; i < ARRAY_SIZE(benches); i++) {
+        checksums[i] = 0;
+        if (!selected(benches[i].name, argc, argv))
+            continue;
+        if (run_bench(&benches[i], &checksums[i])) {
+            ret = EXIT_FAILURE;
+            continue;
+        }
+        for (j = 0; j < i; j++) {
+            if (checksums[j] && !strcmp(benches[i].group, benches[j].group) &&
+                checksums[i] != checksums[j]) {
+                pr_err("%s and %s disagree (%llu vs %llu)\n", benches[i].name, benches[j].name,
+                       (unsigned long long)checksums[i], (unsigned long long)checksums[j]);
+                ret = EXIT_FAILURE;
+            }
+        }
+    }
+
+    btree_set_destroy(&bench_btree);
+    kds_bitmap_free(result_bitmap);
+    kds_bitmap_free(query_bitmap);
+    kds_bitmap_free(key_bitmap);
+    kfree(hash_nodes);
+    kfree(rb_nodes);
+    kfree(list_nodes);
+    kfree(queries);
+    kfree(keys);
+    return ret;
+}
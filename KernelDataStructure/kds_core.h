@@ -0,0 +1,368 @@
+#ifndef _KDS_CORE_H
+#define _KDS_CORE_H
+
+// Structures shared by the kds module and the userspace benchmark (kds_bench.c).
+// Only list, rbtree, hash table and bitmap code lives here, since those are the
+// parts of the kernel that tools/include also provides to userspace.
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/list.h>
+#include <linux/rbtree.h>
+#include <linux/rbtree_augmented.h>
+#include <linux/hashtable.h>
+#include <linux/bitmap.h>
+#else
+#include "kds_shim.h"
+#endif
+
+
+
+// Linked List
+struct int_node {
+    int value;
+    struct list_head list;
+};
+
+// RB Tree
+struct rb_int_node {
+  int value;
+  unsigned int size; // Nodes in the subtree rooted here, for rank/select.
+  struct rb_node rb_node;
+};
+
+// Hash Table
+struct hash_int_node {
+    int value;
+    struct hlist_node hnode;
+};
+
+// B+ Tree Set
+// Static B+ tree over a sorted array. Every node is one cache line of keys; layer 0 holds
+// the sorted keys themselves and layer h holds the largest key under each child in layer h-1.
+#define BTREE_NODE_BYTES L1_CACHE_BYTES
+#define BTREE_B (BTREE_NODE_BYTES / sizeof(int))
+#define BTREE_MAX_HEIGHT 8
+struct btree_set {
+    void *mem;
+    int *layers[BTREE_MAX_HEIGHT];
+    unsigned int nodes[BTREE_MAX_HEIGHT];
+    unsigned int height;
+    unsigned int n;
+};
+
+
+
+// RB Tree
+static inline unsigned int rb_size(struct rb_node *node) {
+    return node ? rb_entry(node, struct rb_int_node, rb_node)->size : 0;
+}
+
+static inline bool rb_int_node_compute_size(struct rb_int_node *node, bool exit) {
+    unsigned int size = 1 + rb_size(node->rb_node.rb_left) + rb_size(node->rb_node.rb_right);
+
+    if (exit && node->size == size)
+        return true;
+    node->size = size;
+    return false;
+}
+
+RB_DECLARE_CALLBACKS(static, rb_size_callbacks, struct rb_int_node, rb_node, size, rb_int_node_compute_size);
+
+static inline bool rb_link_value(struct rb_int_node *node, struct rb_root *root) {
+    struct rb_node **new = &(root->rb_node), *parent = NULL;
+    struct rb_int_node *this;
+
+    while (*new) {
+      this = container_of(*new, struct rb_int_node, rb_node);
+
+      parent = *new;
+      if (this->value < node->value)
+        new = &((*new)->rb_right);
+      else if (this->value > node->value)
+        new = &((*new)->rb_left);
+      else
+        return false; // Value already exists.
+    }
+
+    node->size = 1;
+    rb_link_node(&node->rb_node, parent, new);
+    rb_size_callbacks_propagate(parent, NULL);
+    rb_insert_augmented(&node->rb_node, root, &rb_size_callbacks);
+
+    return true;
+}
+
+static inline void rb_erase_value(struct rb_int_node *node, struct rb_root *root) {
+    rb_erase_augmented(&node->rb_node, root, &rb_size_callbacks);
+}
+
+// Number of keys below value, or at most value when inclusive.
+static inline unsigned int rb_rank(struct rb_root *root, int value, bool inclusive) {
+    struct rb_node *node = root->rb_node;
+    struct rb_int_node *this;
+    unsigned int rank = 0;
+
+    while (node) {
+        this = rb_entry(node, struct rb_int_node, rb_node);
+        if (this->value < value || (inclusive && this->value == value)) {
+            rank += rb_size(node->rb_left) + 1;
+            node = node->rb_right;
+        } else {
+            node = node->rb_left;
+        }
+    }
+    return rank;
+}
+
+// The k-th smallest key, counting from 0.
+static inline struct rb_int_node *rb_select(struct rb_root *root, unsigned int k) {
+    struct rb_node *node = root->rb_node;
+    unsigned int left;
+
+    while (node) {
+        left = rb_size(node->rb_left);
+        if (k < left) {
+            node = node->rb_left;
+        } else if (k == left) {
+            return rb_entry(node, struct rb_int_node, rb_node);
+        } else {
+            k -= left + 1;
+            node = node->rb_right;
+        }
+    }
+    return NULL;
+}
+
+static inline unsigned int rb_count_range(struct rb_root *root, int lo, int hi) {
+    if (hi < lo)
+        return 0;
+    return rb_rank(root, hi, true) - rb_rank(root, lo, false);
+}
+
+// First node with a value of at least value.
+static inline struct rb_int_node *rb_lower_bound(struct rb_root *root, int value) {
+    struct rb_node *node = root->rb_node;
+    struct rb_int_node *this, *found = NULL;
+
+    while (node) {
+        this = rb_entry(node, struct rb_int_node, rb_node);
+        if (this->value < value) {
+            node = node->rb_right;
+        } else {
+            found = this;
+            node = node->rb_left;
+        }
+    }
+    return found;
+}
+
+static inline struct rb_int_node *rb_int_next(struct rb_int_node *this) {
+    struct rb_node *node = rb_next(&this->rb_node);
+
+    return node ? rb_entry(node, struct rb_int_node, rb_node) : NULL;
+}
+
+#define rb_for_each_in_range(pos, root, lo, hi) \
+    for (pos = rb_lower_bound(root, lo); pos && pos->value <= (hi); pos = rb_int_next(pos))
+
+// B+ Tree Set
+// One node's keys are compared against the target as a single vector. GCC vector
+// extensions become SIMD compares where the target allows it and plain word operations
+// in the kernel, which is built without FPU/SIMD registers; either way there is no branch.
+typedef int btree_vec __attribute__((vector_size(BTREE_NODE_BYTES)));
+
+static inline unsigned int btree_node_rank(const int *keys, int value) {
+    btree_vec k, lt;
+    unsigned int i, rank = 0;
+
+    memcpy(&k, keys, sizeof(k));
+    lt = k < value; // -1 in every lane whose key is below value
+    for (i = 0; i < BTREE_B; i++)
+        rank -= lt[i];
+    return rank;
+}
+
+static inline void btree_set_destroy(struct btree_set *set) {
+    kvfree(set->mem);
+    memset(set, 0, sizeof(*set));
+}
+
+// Builds the set from n distinct keys in ascending order.
+static inline int btree_set_build(struct btree_set *set, const int *sorted, unsigned int n) {
+    unsigned int h, i, nodes, total = 0;
+    int *base;
+
+    memset(set, 0, sizeof(*set));
+    set->n = n;
+    if (!n)
+        return 0;
+
+    nodes = DIV_ROUND_UP(n, BTREE_B);
+    for (h = 0; ; h++) {
+        if (h == BTREE_MAX_HEIGHT)
+            return -E2BIG;
+        set->nodes[h] = nodes;
+        total += nodes;
+        if (nodes == 1)
+            break;
+        nodes = DIV_ROUND_UP(nodes, BTREE_B);
+    }
+    set->height = h + 1;
+
+    set->mem = kvmalloc(total * BTREE_NODE_BYTES + BTREE_NODE_BYTES, GFP_KERNEL);
+    if (!set->mem)
+        return -ENOMEM;
+    base = PTR_ALIGN((int *)set->mem, BTREE_NODE_BYTES);
+    for (h = 0; h < set->height; h++) {
+        set->layers[h] = base;
+        base += set->nodes[h] * BTREE_B;
+    }
+
+    // Padding keys are INT_MAX so they never rank below a real key.
+    memcpy(set->layers[0], sorted, n * sizeof(int));
+    for (i = n; i < set->nodes[0] * BTREE_B; i++)
+        set->layers[0][i] = INT_MAX;
+    for (h = 1; h < set->height; h++) {
+        for (i = 0; i < set->nodes[h] * BTREE_B; i++)
+            set->layers[h][i] = i < set->nodes[h - 1] ? set->layers[h - 1][i * BTREE_B + BTREE_B - 1] : INT_MAX;
+    }
+    return 0;
+}
+
+// Position of the first key of at least value, or n if there is none.
+static inline unsigned int btree_set_lower_bound(const struct btree_set *set, int value) {
+    unsigned int node = 0;
+    int h;
+
+    // Above the maximum every separator ranks below value and the descent would run off the tree.
+    if (!set->n || value > set->layers[0][set->n - 1])
+        return set->n;
+
+    for (h = set->height - 1; h > 0; h--)
+        node = node * BTREE_B + btree_node_rank(set->layers[h] + node * BTREE_B, value);
+    return node * BTREE_B + btree_node_rank(set->layers[0] + node * BTREE_B, value);
+}
+
+static inline bool btree_set_contains(const struct btree_set *set, int value) {
+    unsigned int pos = btree_set_lower_bound(set, value);
+
+    return pos < set->n && set->layers[0][pos] == value;
+}
+
+#define btree_set_for_each(pos, set) \
+    for (pos = 0; pos < (set)->n; pos++)
+
+// Builds the B+ tree from the keys of an rbtree, which are already distinct and ordered.
+static inline int btree_set_from_rbtree(struct btree_set *set, struct rb_root *root) {
+    struct rb_node *node;
+    unsigned int n = 0;
+    int *sorted, ret;
+
+    sorted = kvmalloc_array(max(rb_size(root->rb_node), 1U), sizeof(int), GFP_KERNEL);
+    if (!sorted)
+        return -ENOMEM;
+    for (node = rb_first(root); node; node = rb_next(node))
+        sorted[n++] = rb_entry(node, struct rb_int_node, rb_node)->value;
+
+    ret = btree_set_build(set, sorted, n);
+    kvfree(sorted);
+    return ret;
+}
+
+// Bitmap
+// Set bits in [start, end), touching only the words that overlap the range.
+static inline unsigned int bitmap_weight_range(const unsigned long *map, unsigned int start, unsigned int end) {
+    unsigned int first, last, i, weight;
+
+    if (start >= end)
+        return 0;
+    first = BIT_WORD(start);
+    last = BIT_WORD(end - 1);
+    if (first == last)
+        return hweight_long(map[first] & BITMAP_FIRST_WORD_MASK(start) & BITMAP_LAST_WORD_MASK(end));
+
+    weight = hweight_long(map[first] & BITMAP_FIRST_WORD_MASK(start));
+    for (i = first + 1; i < last; i++)
+        weight += hweight_long(map[i]);
+    return weight + hweight_long(map[last] & BITMAP_LAST_WORD_MASK(end));
+}
+
+// Large bitmaps
+// Allocated with kvcalloc so they can go past the kmalloc limit (2^30 bits is 128 MiB).
+// Set operations and popcount work on a vector of words at a time. As with the B+ tree
+// search, GCC vector extensions give SIMD where vector registers are available and
+// unrolled word operations in the kernel.
+#define KDS_BITMAP_VEC_BYTES 32
+#define KDS_BITMAP_VEC_LONGS (KDS_BITMAP_VEC_BYTES / sizeof(long))
+typedef unsigned long kds_bitmap_vec __attribute__((vector_size(KDS_BITMAP_VEC_BYTES)));
+
+static inline unsigned long *kds_bitmap_zalloc(unsigned long nbits) {
+    return kvcalloc(BITS_TO_LONGS(nbits), sizeof(unsigned long), GFP_KERNEL);
+}
+
+static inline void kds_bitmap_free(unsigned long *map) {
+    kvfree(map);
+}
+
+#define KDS_BITMAP_AND(x, y) ((x) & (y))
+#define KDS_BITMAP_OR(x, y) ((x) | (y))
+#define KDS_BITMAP_XOR(x, y) ((x) ^ (y))
+#define KDS_BITMAP_ANDNOT(x, y) ((x) & ~(y))
+
+#define KDS_BITMAP_OP(name, OP)                                                             \
+static inline void kds_bitmap_##name(unsigned long *dst, const unsigned long *a,           \
+                                     const unsigned long *b, unsigned long nbits) {        \
+    unsigned long i, words = BITS_TO_LONGS(nbits);                                          \
+    kds_bitmap_vec va, vb;                                                                  \
+                                                                                            \
+    for (i = 0; i + KDS_BITMAP_VEC_LONGS <= words; i += KDS_BITMAP_VEC_LONGS) {             \
+        memcpy(&va, a + i, sizeof(va));                                                     \
+        memcpy(&vb, b + i, sizeof(vb));                                                     \
+        va = OP(va, vb);                                                                    \
+        memcpy(dst + i, &va, sizeof(va));                                                   \
+    }                                                                                       \
+    for (; i < words; i++)                                                                  \
+        dst[i] = OP(a[i], b[i]);                                                            \
+}
+
+KDS_BITMAP_OP(and, KDS_BITMAP_AND)
+KDS_BITMAP_OP(or, KDS_BITMAP_OR)
+KDS_BITMAP_OP(xor, KDS_BITMAP_XOR)
+KDS_BITMAP_OP(andnot, KDS_BITMAP_ANDNOT)
+
+// Set bits in the first nbits. Each lane is reduced to per-byte counts (at most 8), which
+// are summed across up to 31 vectors before a byte in the accumulator could overflow.
+// The bytes are then widened to 16-bit fields and added up with a multiply.
+static inline unsigned long kds_bitmap_weight(const unsigned long *map, unsigned long nbits) {
+    const unsigned long m1 = ~0UL / 3, m2 = ~0UL / 5, m4 = ~0UL / 17;
+    const unsigned long m8 = ~0UL / 257, h16 = ~0UL / 65535;
+    unsigned long i, j, x, words = nbits / BITS_PER_LONG, weight = 0;
+    kds_bitmap_vec v, acc;
+    int batch = 0;
+
+    acc = (kds_bitmap_vec){};
+    for (i = 0; i + KDS_BITMAP_VEC_LONGS <= words; i += KDS_BITMAP_VEC_LONGS) {
+        memcpy(&v, map + i, sizeof(v));
+        v = v - ((v >> 1) & m1);
+        v = (v & m2) + ((v >> 2) & m2);
+        acc += (v + (v >> 4)) & m4;
+        if (++batch == 31 || i + 2 * KDS_BITMAP_VEC_LONGS > words) {
+            for (j = 0; j < KDS_BITMAP_VEC_LONGS; j++) {
+                x = (acc[j] & m8) + ((acc[j] >> 8) & m8);
+                weight += (x * h16) >> (BITS_PER_LONG - 16);
+            }
+            acc = (kds_bitmap_vec){};
+            batch = 0;
+        }
+    }
+    for (; i < words; i++)
+        weight += hweight_long(map[i]);
+    if (nbits % BITS_PER_LONG)
+        weight += hweight_long(map[words] & BITMAP_LAST_WORD_MASK(nbits));
+    return weight;
+}
+
+#endif /* _KDS_CORE_H */
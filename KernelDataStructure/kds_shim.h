@@ -0,0 +1,80 @@
+#ifndef _KDS_SHIM_H
+#define _KDS_SHIM_H
+
+// Userspace stand-ins for the kernel APIs used by kds_core.h and kds_bench.c.
+// The data structures themselves come from the kernel's tools/include headers and
+// tools/lib sources (see the "user" target in the Makefile); this file only maps
+// allocation, logging, timing and randomness onto libc.
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/rbtree.h>
+#include <linux/rbtree_augmented.h>
+#include <linux/hashtable.h>
+#include <linux/bitmap.h>
+
+#ifndef L1_CACHE_BYTES
+#define L1_CACHE_BYTES 64
+#endif
+
+#ifndef DIV_ROUND_UP
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#endif
+
+#ifndef PTR_ALIGN
+#define PTR_ALIGN(p, a) ((typeof(p))(((uintptr_t)(p) + (a) - 1) & ~((uintptr_t)(a) - 1)))
+#endif
+
+// Allocation
+#define GFP_KERNEL 0
+#define kmalloc(size, gfp) malloc(size)
+#define kzalloc(size, gfp) calloc(1, size)
+#define kmalloc_array(n, size, gfp) reallocarray(NULL, n, size)
+#define kvmalloc(size, gfp) malloc(size)
+#define kvmalloc_array(n, size, gfp) reallocarray(NULL, n, size)
+#define kvcalloc(n, size, gfp) calloc(n, size)
+#define kfree(ptr) free(ptr)
+#define kvfree(ptr) free(ptr)
+
+// Logging
+#define pr_info(fmt, ...) printf(fmt, ##__VA_ARGS__)
+#define pr_warn(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+#define pr_err(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+
+// Time
+static inline u64 ktime_get_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define div_u64(dividend, divisor) ((u64)(dividend) / (divisor))
+#define cond_resched() do { } while (0)
+
+// Randomness: a fixed-seed xorshift so every run benchmarks the same keys.
+static u64 kds_shim_random_state = 0x9e3779b97f4a7c15ULL;
+
+static inline u64 get_random_u64(void) {
+    u64 x = kds_shim_random_state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return kds_shim_random_state = x;
+}
+
+static inline u32 get_random_u32(void) {
+    return (u32)(get_random_u64() >> 32);
+}
+
+#endif /* _KDS_SHIM_H */
@@ -9,8 +9,10 @@
 #include <poll.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
+#include <stdint.h>
 
 #define PAGESIZE 4096  // Assuming page size is 4096 bytes
+#define MAX_INFLIGHT 32  // Requests that may be outstanding to the peer at once
 
 #ifndef __NR_userfaultfd
 #define __NR_userfaultfd 323
@@ -26,17 +28,336 @@ typedef enum {
 } MSIState;
 
 MSIState *msi_array;
+// Bumped whenever the peer invalidates a page, so a fetch or an invalidation that was in flight
+// meanwhile can tell its answer is stale.
+unsigned int *generation;
+// 1 while our invalidation of the page is in flight, 2 if we handed the peer a copy meanwhile,
+// which the invalidation did not cover, so the upgrade has to start over.
+unsigned char *upgrading;
+// Set once either side has written the page, after which its contents only ever come from a
+// copy, never from zeros.
+unsigned char *written;
+// Protects the arrays above, and keeps a page that is not INVALID mapped while held. Never
+// held while waiting for the peer.
+pthread_mutex_t msi_lock = PTHREAD_MUTEX_INITIALIZER;
+// When both sides try to take the same page to MODIFIED at once, the one with the lower port
+// wins and the other gives its copy up and retries.
+int leader;
 
 void *addr = NULL;
+int num_pages;
+
+// Protocol
+// Each process sends its requests on the connection it opened (client_fd) and reads the
+// replies back from it, and serves the peer's requests on the connection it accepted
+// (connection_fd), so serving never waits behind our own requests. Every message is a frame
+// header, followed by a page of data when len says so. A request carries the slot it
+// waits in, which the reply echoes, so several can be outstanding and replies are matched
+// to them as they arrive.
+enum {
+    MSG_FETCH = 1,       // Send me your copy of the page, and keep it only as SHARED.
+    MSG_FETCH_REPLY,     // len is PAGESIZE with the data, or 0 if the peer has no valid copy.
+    MSG_INVALIDATE,      // Drop your copy of the page, I am about to modify it.
+    MSG_INVALIDATE_ACK,
+    MSG_INVALIDATE_NACK, // Refused: the peer keeps its copy and we stay as we were.
+};
+
+struct frame {
+    uint32_t type;
+    uint32_t page;
+    uint32_t slot;
+    uint32_t len;
+};
+
+struct request {
+    int busy;
+    int done;
+    unsigned int generation;  // Of the page when the request was sent.
+    uint32_t type;            // Of the reply.
+    uint32_t len;
+    char data[PAGESIZE];
+};
+
+int client_fd, connection_fd;
+struct request requests[MAX_INFLIGHT];
+pthread_mutex_t request_lock = PTHREAD_MUTEX_INITIALIZER;  // Protects requests and client_fd writes
+pthread_cond_t request_cond = PTHREAD_COND_INITIALIZER;
+pthread_t reply_thread, server_thread;
+
+static void read_all(int fd, void *buf, size_t len) {
+    while (len) {
+        ssize_t n = read(fd, buf, len);
+        if (n <= 0) {
+            if (n == 0)
+                fprintf(stderr, "Peer closed the connection\n");
+            else
+                perror("read");
+            exit(EXIT_FAILURE);
+        }
+        buf = (char *)buf + n;
+        len -= n;
+    }
+}
+
+static void write_all(int fd, const void *buf, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+}
+
+// The header and page go out in one write: split in two, Nagle would hold the page back
+// until the peer acknowledged the header, which it delays.
+static void send_frame(int fd, uint32_t type, uint32_t page, uint32_t slot, const void *data) {
+    struct {
+        struct frame f;
+        char data[PAGESIZE];
+    } msg;
+
+    msg.f = (struct frame){
+        .type = htonl(type),
+        .page = htonl(page),
+        .slot = htonl(slot),
+        .len = htonl(data ? PAGESIZE : 0)
+    };
+    if (data)
+        memcpy(msg.data, data, PAGESIZE);
+    write_all(fd, &msg, sizeof(msg.f) + (data ? PAGESIZE : 0));
+}
+
+static void recv_frame(int fd, struct frame *f) {
+    read_all(fd, f, sizeof(*f));
+    f->type = ntohl(f->type);
+    f->page = ntohl(f->page);
+    f->slot = ntohl(f->slot);
+    f->len = ntohl(f->len);
+    if (f->page >= (uint32_t)num_pages || (f->len && f->len != PAGESIZE)) {
+        fprintf(stderr, "Bad frame from peer\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Sends a request for page and returns its slot, waiting for one to free up if all are busy.
+static int send_request(uint32_t type, int page, unsigned int gen) {
+    int slot;
+
+    pthread_mutex_lock(&request_lock);
+    for (;;) {
+        for (slot = 0; slot < MAX_INFLIGHT && requests[slot].busy; slot++)
+            ;
+        if (slot < MAX_INFLIGHT)
+            break;
+        pthread_cond_wait(&request_cond, &request_lock);
+    }
+    requests[slot].busy = 1;
+    requests[slot].done = 0;
+    requests[slot].generation = gen;
+    send_frame(client_fd, type, page, slot, NULL);
+    pthread_mutex_unlock(&request_lock);
+    return slot;
+}
+
+// Waits for the reply to the request in slot. The slot stays busy until release_request().
+static struct request *wait_request(int slot) {
+    pthread_mutex_lock(&request_lock);
+    while (!requests[slot].done)
+        pthread_cond_wait(&request_cond, &request_lock);
+    pthread_mutex_unlock(&request_lock);
+    return &requests[slot];
+}
+
+static void release_request(int slot) {
+    pthread_mutex_lock(&request_lock);
+    requests[slot].busy = 0;
+    pthread_cond_broadcast(&request_cond);
+    pthread_mutex_unlock(&request_lock);
+}
+
+// Completes requests as their replies come in, in whatever order that is.
+static void *reply_handler_thread(void *arg) {
+    struct frame f;
+
+    while (1) {
+        recv_frame(client_fd, &f);
+        pthread_mutex_lock(&request_lock);
+        if (f.slot >= MAX_INFLIGHT || !requests[f.slot].busy || requests[f.slot].done) {
+            fprintf(stderr, "Reply for no request from peer\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_unlock(&request_lock);
+        requests[f.slot].type = f.type;
+        requests[f.slot].len = f.len;
+        if (f.len)
+            read_all(client_fd, requests[f.slot].data, PAGESIZE);
+
+        pthread_mutex_lock(&request_lock);
+        requests[f.slot].done = 1;
+        pthread_cond_broadcast(&request_cond);
+        pthread_mutex_unlock(&request_lock);
+    }
+    return NULL;
+}
+
+// Answers the peer's requests from our copy of each page.
+static void *server_handler_thread(void *arg) {
+    char *page = malloc(PAGESIZE);
+    struct frame f;
 
-static void *fault_handler_thread(void *arg) {
-    struct uffd_msg msg;
-    char *page = (char *)malloc(PAGESIZE);
     if (!page) {
-        perror("Allocating page in fault handler");
+        perror("Allocating page in server");
+        exit(EXIT_FAILURE);
+    }
+
+    while (1) {
+        recv_frame(connection_fd, &f);
+        char *data = (char *)addr + (size_t)f.page * PAGESIZE;
+
+        if (f.type == MSG_FETCH) {
+            int valid;
+
+            pthread_mutex_lock(&msi_lock);
+            valid = msi_array[f.page] != INVALID;
+            if (valid) {
+                memcpy(page, data, PAGESIZE);
+                msi_array[f.page] = SHARED;  // M -> S: the peer now holds a copy too
+                if (upgrading[f.page])
+                    upgrading[f.page] = 2;
+            }
+            pthread_mutex_unlock(&msi_lock);
+            send_frame(connection_fd, MSG_FETCH_REPLY, f.page, f.slot, valid ? page : NULL);
+        } else if (f.type == MSG_INVALIDATE) {
+            uint32_t reply = MSG_INVALIDATE_ACK;
+
+            pthread_mutex_lock(&msi_lock);
+            // The peer only invalidates from SHARED, which it cannot be while we hold the page
+            // MODIFIED, so such a request crossed our own upgrade and is refused like one
+            // that races it.
+            if (msi_array[f.page] == MODIFIED || (upgrading[f.page] && leader)) {
+                reply = MSG_INVALIDATE_NACK;
+            } else {
+                generation[f.page]++;
+                written[f.page] = 1;
+                if (msi_array[f.page] != INVALID) {
+                    // Unmapped, so the next access faults and fetches the page again.
+                    if (madvise(data, PAGESIZE, MADV_DONTNEED) == -1) {
+                        perror("madvise");
+                        exit(EXIT_FAILURE);
+                    }
+                    msi_array[f.page] = INVALID;
+                }
+            }
+            pthread_mutex_unlock(&msi_lock);
+            send_frame(connection_fd, reply, f.page, f.slot, NULL);
+        } else {
+            fprintf(stderr, "Unexpected request %u from peer\n", f.type);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    free(page);
+    return NULL;
+}
+
+// Maps data (or zeros, if NULL) at page, which must not be mapped. Called with msi_lock held.
+static void install_page(int page_num, const char *data) {
+    struct uffdio_copy uffdio_copy;
+    static char zero_page[PAGESIZE];
+
+    uffdio_copy.src = (unsigned long)(data ? data : zero_page);
+    uffdio_copy.dst = (unsigned long)addr + (unsigned long)page_num * PAGESIZE;
+    uffdio_copy.len = PAGESIZE;
+    uffdio_copy.mode = 0;
+    uffdio_copy.copy = 0;
+
+    if (ioctl(uffd, UFFDIO_COPY, &uffdio_copy) == -1) {
+        perror("ioctl-UFFDIO_COPY");
         exit(EXIT_FAILURE);
     }
-    memset(page, 0, PAGESIZE);
+}
+
+// Sends type for every page in first..last that is in state from, keeping up to MAX_INFLIGHT
+// requests outstanding, and applies each reply as it is waited for:
+//   MSG_FETCH       INVALID -> SHARED, mapping the peer's copy, or zeros if it has none and
+//                   the page was never written
+//   MSG_INVALIDATE  SHARED -> MODIFIED, unless the peer refused or fetched the page meanwhile
+// A page the peer invalidated while its request was in flight is left as it is.
+static void pipeline(uint32_t type, MSIState from, int first, int last) {
+    int slots[MAX_INFLIGHT], pages[MAX_INFLIGHT];
+    int head = 0, count = 0, page_num = first;
+
+    while (page_num <= last || count) {
+        if (page_num <= last && count < MAX_INFLIGHT) {
+            pthread_mutex_lock(&msi_lock);
+            int wanted = msi_array[page_num] == from;
+            unsigned int gen = generation[page_num];
+            if (wanted && type == MSG_INVALIDATE)
+                upgrading[page_num] = 1;
+            pthread_mutex_unlock(&msi_lock);
+
+            if (wanted) {
+                int i = (head + count++) % MAX_INFLIGHT;
+                pages[i] = page_num;
+                slots[i] = send_request(type, page_num, gen);
+            }
+            page_num++;
+            continue;
+        }
+
+        struct request *req = wait_request(slots[head]);
+        int p = pages[head];
+
+        pthread_mutex_lock(&msi_lock);
+        int copied = upgrading[p] == 2;
+        if (type == MSG_INVALIDATE)
+            upgrading[p] = 0;
+        if (generation[p] == req->generation && msi_array[p] == from) {
+            if (type == MSG_FETCH && (req->len || !written[p])) {
+                install_page(p, req->len ? req->data : NULL);
+                msi_array[p] = SHARED;
+                written[p] |= req->len != 0;
+            } else if (type == MSG_INVALIDATE && req->type == MSG_INVALIDATE_ACK && !copied) {
+                msi_array[p] = MODIFIED;
+                written[p] = 1;
+            }
+        }
+        pthread_mutex_unlock(&msi_lock);
+        release_request(slots[head]);
+        head = (head + 1) % MAX_INFLIGHT;
+        count--;
+    }
+}
+
+void fetch_pages(int first, int last) {
+    pipeline(MSG_FETCH, INVALID, first, last);
+}
+
+void invalidate_pages(int first, int last) {
+    pipeline(MSG_INVALIDATE, SHARED, first, last);
+}
+
+// Returns with page in MODIFIED state and msi_lock held, so the page can be written without
+// the peer taking it away halfway.
+void acquire_page(int page_num) {
+    for (int tries = 0;; tries++) {
+        pthread_mutex_lock(&msi_lock);
+        if (msi_array[page_num] == MODIFIED)
+            return;
+        pthread_mutex_unlock(&msi_lock);
+        if (tries)
+            usleep(1000);  // Lost the page to the peer; let it finish its write first.
+        fetch_pages(page_num, page_num);
+        invalidate_pages(page_num, page_num);
+    }
+}
+
+// Pages are only ever missing while INVALID, so every fault is a fetch from the peer.
+static void *fault_handler_thread(void *arg) {
+    struct uffd_msg msg;
 
     while (1) {
         struct pollfd pollfd = {
@@ -67,28 +388,18 @@ static void *fault_handler_thread(void *arg) {
 
         printf(" [x] PAGEFAULT\n");
 
-        // Assuming you can determine the page number from the fault address
         int page_num = ((unsigned long)msg.arg.pagefault.address - (unsigned long)addr) / PAGESIZE;
-
-        if (msi_array[page_num] == INVALID) {
-            // Fetch page from other process (simulate for now)
-            msi_array[page_num] = SHARED;
-        }
-
-        struct uffdio_copy uffdio_copy;
-        uffdio_copy.src = (unsigned long)page;
-        uffdio_copy.dst = (unsigned long)msg.arg.pagefault.address & ~(PAGESIZE - 1);
-        uffdio_copy.len = PAGESIZE;
-        uffdio_copy.mode = 0;
-        uffdio_copy.copy = 0;
-
-        if (ioctl(uffd, UFFDIO_COPY, &uffdio_copy) == -1) {
-            perror("ioctl-UFFDIO_COPY");
-            exit(EXIT_FAILURE);
+        int missing = 1;
+
+        // Fetched again if the peer invalidated it while the first fetch was in flight.
+        while (missing) {
+            fetch_pages(page_num, page_num);
+            pthread_mutex_lock(&msi_lock);
+            missing = msi_array[page_num] == INVALID;
+            pthread_mutex_unlock(&msi_lock);
         }
     }
 
-    free(page);
     return NULL;
 }
 
@@ -108,6 +419,18 @@ void start_fault_handler_thread() {
         exit(EXIT_FAILURE);
     }
 
+    struct uffdio_register uffdio_register = {
+        .range = {
+            .start = (unsigned long)addr,
+            .len = (unsigned long)num_pages * PAGESIZE
+        },
+        .mode = UFFDIO_REGISTER_MODE_MISSING
+    };
+    if (ioctl(uffd, UFFDIO_REGISTER, &uffdio_register) == -1) {
+        perror("ioctl-UFFDIO_REGISTER");
+        exit(EXIT_FAILURE);
+    }
+
     if (pthread_create(&fault_thread, NULL, fault_handler_thread, NULL)) {
         perror("pthread_create");
         exit(EXIT_FAILURE);
@@ -163,8 +486,6 @@ int connect_to_remote(const char *ip, int port) {
 }
 
 int main(int argc, char *argv[]) {
-    int num_pages;
-    //void *addr = NULL;
 
     if (argc != 3) {
         fprintf(stderr, "Usage: %s <local port> <remote port>\n", argv[0]);
@@ -173,11 +494,12 @@ int main(int argc, char *argv[]) {
 
     int local_port = atoi(argv[1]);
     int remote_port = atoi(argv[2]);
+    leader = local_port < remote_port;
 
     int server_fd = establish_server(local_port);
-    int client_fd = connect_to_remote("127.0.0.1", remote_port);
+    client_fd = connect_to_remote("127.0.0.1", remote_port);
 
-    int connection_fd = accept(server_fd, NULL, NULL);
+    connection_fd = accept(server_fd, NULL, NULL);
     if (connection_fd == -1) {
         perror("Accept failed");
         exit(EXIT_FAILURE);
@@ -218,11 +540,23 @@ int main(int argc, char *argv[]) {
     }
 
     msi_array = (MSIState *)malloc(num_pages * sizeof(MSIState));
+    generation = (unsigned int *)calloc(num_pages, sizeof(unsigned int));
+    upgrading = (unsigned char *)calloc(num_pages, 1);
+    written = (unsigned char *)calloc(num_pages, 1);
+    if (!msi_array || !generation || !upgrading || !written) {
+        perror("Allocating MSI array");
+        exit(EXIT_FAILURE);
+    }
     for (int i = 0; i < num_pages; i++) {
         msi_array[i] = INVALID;
     }
 
     start_fault_handler_thread();
+    if (pthread_create(&reply_thread, NULL, reply_handler_thread, NULL) ||
+        pthread_create(&server_thread, NULL, server_handler_thread, NULL)) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
 
     while (1) {
         printf("> Which command should I run? (r:read, w:write, v:view msi array): ");
@@ -233,12 +567,16 @@ int main(int argc, char *argv[]) {
         int page_num;
         scanf("%d", &page_num);
 
+        if (page_num < -1 || page_num >= num_pages) {
+            printf("Invalid page!\n");
+            continue;
+        }
+
         if (cmd == 'r') {
-            if (msi_array[page_num] == INVALID) {
-                // Fetch page from other process (simulate for now)
-                msi_array[page_num] = SHARED;
-            }
+            // A single page is fetched by the fault its read takes. For all of them, the
+            // fetches go out together first instead of one fault and round trip at a time.
             if (page_num == -1) {
+                fetch_pages(0, num_pages - 1);
                 for (int i = 0; i < num_pages; i++) {
                     printf(" [*] Page %d:\n%s\n", i, (char *)addr + i * PAGESIZE);
                 }
@@ -249,18 +587,18 @@ int main(int argc, char *argv[]) {
             printf("> Type your new message: ");
             char message[PAGESIZE];
             scanf(" %1023[^\n]", message);
-            if (msi_array[page_num] == SHARED || msi_array[page_num] == INVALID) {
-                // Invalidate page in other process (simulate for now)
-            }
-            msi_array[page_num] = MODIFIED;
-            if (page_num == -1) {
-                for (int i = 0; i < num_pages; i++) {
-                    strncpy(addr + i * PAGESIZE, message, PAGESIZE - 1);
-                    printf(" [*] Page %d:\n%s\n", i, (char *)addr + i * PAGESIZE);
-                }
-            } else if (page_num >= 0 && page_num < num_pages) {
-                strncpy(addr + page_num * PAGESIZE, message, PAGESIZE - 1);
-                printf(" [*] Page %d:\n%s\n", page_num, (char *)addr + page_num * PAGESIZE);
+            int first = page_num == -1 ? 0 : page_num;
+            int last = page_num == -1 ? num_pages - 1 : page_num;
+
+            // Pages we lack are fetched and the peer's copies invalidated, all in flight
+            // together, before each page is written.
+            fetch_pages(first, last);
+            invalidate_pages(first, last);
+            for (int i = first; i <= last; i++) {
+                acquire_page(i);
+                strncpy(addr + i * PAGESIZE, message, PAGESIZE - 1);
+                printf(" [*] Page %d:\n%s\n", i, (char *)addr + i * PAGESIZE);
+                pthread_mutex_unlock(&msi_lock);
             }
         } else if (cmd == 'v') {
             for (int i = 0; i < num_pages; i++) {
@@ -3,58 +3,1092 @@
 #include <linux/init.h>
 #include <linux/slab.h>
 #include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/xarray.h>
+#include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
+#include <linux/sizes.h>
+#include <linux/workqueue.h>
+#include <linux/fs_context.h>
+#include <linux/fs_parser.h>
+#include <linux/seq_file.h>
+#include <linux/huge_mm.h>
+#include <linux/percpu_counter.h>
+#include <linux/statfs.h>
+#include <linux/namei.h>
+#include <linux/mount.h>
+#include <linux/cred.h>
+#include <linux/rcupdate.h>
+#include <linux/crc32.h>
+#include <linux/rmap.h>
+#include <linux/pagevec.h>
+#include <linux/crypto.h>
+#include <linux/percpu.h>
+#include <linux/refcount.h>
+#include <linux/rhashtable.h>
+#include <linux/xxhash.h>
+#include <linux/maple_tree.h>
+#include <linux/falloc.h>
+#include <linux/xattr.h>
+#include <linux/jhash.h>
+
+#include "s2fs.h"
 
 #define S2FS_MAGIC 0x19980122
 
 MODULE_LICENSE("GPL");
 
-static struct dentry *s2fs_mount(struct file_system_type *fs_type, int flags, const char *dev_name, void *data);
-static int s2fs_fill_super(struct super_block *sb, void *data, int silent);
+static int s2fs_init_fs_context(struct fs_context *fc);
+static int s2fs_parse_param(struct fs_context *fc, struct fs_parameter *param);
+static int s2fs_get_tree(struct fs_context *fc);
+static int s2fs_reconfigure(struct fs_context *fc);
+static void s2fs_free_fc(struct fs_context *fc);
+static int s2fs_fill_super(struct super_block *sb, struct fs_context *fc);
+static void s2fs_kill_sb(struct super_block *sb);
+static int s2fs_show_options(struct seq_file *m, struct dentry *root);
+static int s2fs_statfs(struct dentry *dentry, struct kstatfs *buf);
+static int s2fs_setattr(struct user_namespace *mnt_userns, struct dentry *dentry, struct iattr *attr);
+static ssize_t s2fs_listxattr(struct dentry *dentry, char *buffer, size_t size);
+static void s2fs_xattrs_free(struct inode *inode);
+static struct inode *s2fs_alloc_inode(struct super_block *sb);
+static void s2fs_free_inode(struct inode *inode);
+static int s2fs_load_image(struct super_block *sb, const char *path);
+static int s2fs_sync_fs(struct super_block *sb, int wait);
+static int s2fs_ckpt_open(struct super_block *sb, const char *path);
+static int s2fs_ckpt_restore(struct super_block *sb);
+static int s2fs_checkpoint(struct super_block *sb);
+static bool s2fs_ckpt_bloated(struct s2fs_sb_info *sbi);
+static int s2fs_ckpt_compact(struct super_block *sb);
+static void s2fs_ckpt_work(struct work_struct *work);
+static void s2fs_ckpt_mark(struct inode *inode);
+static void s2fs_ckpt_dirty(struct inode *inode, pgoff_t first, pgoff_t last);
+static void s2fs_ckpt_truncate(struct inode *inode, loff_t size);
+static int s2fs_ckpt_forget(struct inode *inode);
+static void s2fs_ckpt_unforget(struct inode *inode);
+static void s2fs_ckpt_clean(struct inode *inode);
+static void s2fs_ckpt_evict(struct inode *inode);
+static void s2fs_ckpt_punch(struct inode *inode, pgoff_t first, pgoff_t last);
+static int s2fs_zctx_init(struct super_block *sb, const char *alg, bool dedup);
+static void s2fs_zctx_free(struct s2fs_sb_info *sbi);
+static void s2fs_compress_work(struct work_struct *work);
+static int s2fs_launder_folio(struct folio *folio);
+static void s2fs_zmap_drop(struct inode *inode, pgoff_t first, pgoff_t last, bool uncharge);
+static int s2fs_unzip(struct inode *inode, struct folio *folio, long i);
 static struct inode *s2fs_make_inode(struct super_block *sb, int mode);
+static void s2fs_evict_inode(struct inode *inode);
 static struct dentry *s2fs_create_dir(struct super_block *sb, struct dentry *parent, const char *dir_name);
 static struct dentry *s2fs_create_file(struct super_block *sb, struct dentry *parent, const char *file_name);
+static struct dentry *s2fs_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags);
+static int s2fs_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl);
+static int s2fs_mkdir(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode);
+static int s2fs_unlink(struct inode *dir, struct dentry *dentry);
+static int s2fs_rmdir(struct inode *dir, struct dentry *dentry);
+static int s2fs_rename(struct user_namespace *mnt_userns, struct inode *old_dir, struct dentry *old_dentry,
+                       struct inode *new_dir, struct dentry *new_dentry, unsigned int flags);
+static int s2fs_readdir(struct file *filp, struct dir_context *ctx);
+static loff_t s2fs_dir_llseek(struct file *filp, loff_t offset, int whence);
 static int s2fs_open(struct inode *inode, struct file *filp);
-static ssize_t s2fs_read_file(struct file *filp, char __user *buf, size_t count, loff_t *offset);
-static ssize_t s2fs_write_file(struct file *filp, const char __user *buf, size_t count, loff_t *offset);
+static int s2fs_read_folio(struct file *filp, struct folio *folio);
+static ssize_t s2fs_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static loff_t s2fs_llseek(struct file *filp, loff_t offset, int whence);
+static long s2fs_fallocate(struct file *filp, int mode, loff_t offset, loff_t len);
+static int s2fs_write_begin(struct file *filp, struct address_space *mapping, loff_t pos, unsigned int len,
+                            struct page **pagep, void **fsdata);
+static int s2fs_write_end(struct file *filp, struct address_space *mapping, loff_t pos, unsigned int len,
+                          unsigned int copied, struct page *page, void *fsdata);
+static int s2fs_mmap(struct file *filp, struct vm_area_struct *vma);
+static vm_fault_t s2fs_page_mkwrite(struct vm_fault *vmf);
+static int s2fs_fill_file(struct inode *inode, const char *data, size_t len);
+static struct dentry *s2fs_stats_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags);
+static int s2fs_stats_readdir(struct file *filp, struct dir_context *ctx);
+static int s2fs_stats_revalidate(struct dentry *dentry, unsigned int flags);
+static int s2fs_stats_open(struct inode *inode, struct file *filp);
+static ssize_t s2fs_stats_read(struct kiocb *iocb, struct iov_iter *to);
+static loff_t s2fs_stats_llseek(struct file *filp, loff_t offset, int whence);
+static int s2fs_stats_release(struct inode *inode, struct file *filp);
+static void s2fs_entry_put(struct s2fs_entry *entry);
+static void s2fs_stats_ino_free(struct s2fs_sb_info *sbi);
+
+// Mount options
+// huge= works like tmpfs: never backs files with base pages only, always with PMD-sized
+// folios where they fit, within_size only where the file already reaches past the folio.
+// size= (bytes with k/m/g, or a percentage of RAM) and nr_inodes= limit what one mount may
+// hold; both default to the tmpfs defaults and 0 means unlimited. image= names a cpio
+// archive to populate the mount from (see s2fs_load_image()). ckpt= names a log file the
+// mount is checkpointed to every ckpt_interval= seconds and restored from at the next mount
+// (see s2fs_checkpoint()). compress= names a crypto compressor (lz4, zstd, ...) that pages
+// left unused for compress_age= seconds are compressed with (see s2fs_compress_inode()); dedup
+// makes those pages share one copy per distinct content.
+enum s2fs_huge {
+    S2FS_HUGE_NEVER,
+    S2FS_HUGE_ALWAYS,
+    S2FS_HUGE_WITHIN_SIZE,
+};
+
+enum {
+    Opt_huge,
+    Opt_size,
+    Opt_nr_inodes,
+    Opt_image,
+    Opt_ckpt,
+    Opt_ckpt_interval,
+    Opt_compress,
+    Opt_compress_age,
+    Opt_dedup,
+};
+
+static const struct constant_table s2fs_param_enums_huge[] = {
+    { "never", S2FS_HUGE_NEVER },
+    { "always", S2FS_HUGE_ALWAYS },
+    { "within_size", S2FS_HUGE_WITHIN_SIZE },
+    {}
+};
+
+static const struct fs_parameter_spec s2fs_fs_parameters[] = {
+    fsparam_enum("huge", Opt_huge, s2fs_param_enums_huge),
+    fsparam_string("size", Opt_size),
+    fsparam_string("nr_inodes", Opt_nr_inodes),
+    fsparam_string("image", Opt_image),
+    fsparam_string("ckpt", Opt_ckpt),
+    fsparam_u32("ckpt_interval", Opt_ckpt_interval),
+    fsparam_string("compress", Opt_compress),
+    fsparam_u32("compress_age", Opt_compress_age),
+    fsparam_flag("dedup", Opt_dedup),
+    {}
+};
+
+// Parsed options, copied into the superblock by fill_super or reconfigure.
+struct s2fs_options {
+    unsigned int seen; // Bit per option given, so a remount only changes those.
+    enum s2fs_huge huge;
+    unsigned long max_blocks;
+    unsigned long max_inodes;
+    char *image;
+    char *ckpt;
+    unsigned int ckpt_interval;
+    char *compress;
+    unsigned int compress_age;
+    bool dedup;
+};
+
+// Inode numbers a CPU may hand out without touching the superblock: next up to end.
+#define S2FS_INO_BATCH 1024
+
+struct s2fs_ino_batch {
+    unsigned long next;
+    unsigned long end;
+};
+
+// Per-superblock state, in sb->s_fs_info.
+// Pages are charged to used_blocks when they enter the page cache of one of our files and
+// uncharged when they leave it, which happens in batches (truncate, eviction), so a per-CPU
+// counter keeps concurrent writers off a shared cache line. Inodes are counted the same way,
+// and their numbers are handed out from per-CPU batches (see s2fs_next_ino()), so threads
+// creating and removing files touch nothing mount-wide but the dcache.
+struct s2fs_sb_info {
+    enum s2fs_huge huge;
+    unsigned long max_blocks;          // In pages, 0 for no limit.
+    struct percpu_counter used_blocks;
+    unsigned long max_inodes;          // 0 for no limit.
+    struct percpu_counter used_inodes;
+    spinlock_t stat_lock;              // Protects the limits.
+    atomic_long_t next_ino;            // Last number of the last batch handed to a CPU.
+    struct s2fs_ino_batch __percpu *ino_batch;
+    struct file *image;                // Backs file data loaded from image=, or NULL.
+    struct super_block *sb;
+    struct xarray stats_ino;           // Stats entry ID -> its inode number here.
+
+    // Checkpoints, all unused without ckpt=.
+    struct file *ckpt;                 // The log, which also backs file data restored from it.
+    char *ckpt_path;
+    struct path ckpt_dir;              // Where the log is, and its name there, for compaction.
+    char *ckpt_name;
+    const struct cred *ckpt_cred;      // Of the mounter, for truncating and replacing the log.
+    struct rw_semaphore ckpt_sem;      // Read around reads of restored data, written to swap logs.
+    unsigned int ckpt_interval;        // Seconds between checkpoints, 0 for syncfs and unmount only.
+    struct delayed_work ckpt_work;
+    struct mutex ckpt_mutex;           // Serializes checkpoints and protects the fields below.
+    loff_t ckpt_pos;                   // End of the last committed segment.
+    bool ckpt_ready;                   // Mounted successfully, so unmount may checkpoint.
+    u64 ckpt_seq;                      // Sequence number of the next segment.
+    bool ckpt_full;                    // The next checkpoint logs every inode and page.
+    loff_t ckpt_live;                  // Page data in the log after its restore or compaction.
+    spinlock_t ckpt_lock;              // Protects both inode lists.
+    struct list_head ckpt_dirty;       // Inodes changed since the last checkpoint.
+    struct list_head ckpt_batch;       // Inodes the checkpoint in progress has yet to log.
+    struct xarray ckpt_deleted;        // IDs of inodes removed since the last checkpoint.
+
+    // Compression and deduplication, unused without compress= or dedup.
+    char *compress;                    // Algorithm name, NULL with dedup alone.
+    struct s2fs_zctx __percpu *zctx;
+    unsigned int compress_age;         // Seconds a page stays unused before it is compressed.
+    struct delayed_work compress_work;
+    bool dedup;
+    struct rhashtable dedup_table;     // Shared copies by hash.
+};
+
+static inline struct s2fs_sb_info *S2FS_SB(struct super_block *sb) {
+    return sb->s_fs_info;
+}
+
+// Per-inode state
+// A file loaded from the image reads its first image_len bytes from the image, starting at
+// image_off, until the pages are in the page cache; nothing is copied at mount time. A file
+// restored from a checkpoint does the same for its first ckpt_len bytes, page by page from
+// wherever ckpt_map says the latest copy of each page sits in the log. Holes punched into
+// either are kept as page ranges in holes, which read as zeros.
+struct s2fs_inode_info {
+    loff_t image_off;
+    loff_t image_len;
+    unsigned long ckpt_id;       // Names the inode in the log, 0 for inodes never logged.
+    unsigned long ckpt_flags;
+    struct list_head ckpt_dirty; // On the superblock's dirty list or the batch being logged.
+    struct xarray ckpt_pages;    // Indices of pages written since the last checkpoint.
+    loff_t ckpt_trunc;           // Smallest size since the last checkpoint, under i_lock.
+    loff_t ckpt_len;             // Bytes restored from the log, under i_lock.
+    struct xarray ckpt_map;      // Page index -> log page, for restored data.
+    struct list_head ckpt_holes; // Holes punched since the last checkpoint, under i_lock.
+    struct maple_tree holes;     // Page ranges punched out of image or log data.
+    struct s2fs_xattrs __rcu *xattrs; // NULL until the first attribute is set.
+    size_t xattr_bytes;          // Charged for user.* attributes, under the inode lock.
+    struct xarray zmap;          // Page index -> copy, for pages not in the page cache.
+    atomic_long_t zpages;        // Entries in zmap.
+    struct inode vfs_inode;
+};
+
+#define S2FS_CKPT_ALL 0 // ckpt_flags: log every cached page, not just ckpt_pages.
+#define S2FS_HOLE xa_mk_value(1) // Entry of the holes tree.
+
+static struct kmem_cache *s2fs_inode_cachep;
+
+static inline struct s2fs_inode_info *S2FS_I(struct inode *inode) {
+    return container_of(inode, struct s2fs_inode_info, vfs_inode);
+}
+
+// Page index was punched out of the image or log data of the inode.
+static inline bool s2fs_punched(struct s2fs_inode_info *info, pgoff_t index) {
+    return !mtree_empty(&info->holes) && mtree_load(&info->holes, index);
+}
+
+static const struct fs_context_operations s2fs_context_ops = {
+    .parse_param = s2fs_parse_param,
+    .get_tree = s2fs_get_tree,
+    .reconfigure = s2fs_reconfigure,
+    .free = s2fs_free_fc,
+};
 
 static struct super_operations s2fs_super_ops = {
-    .statfs = simple_statfs,
+    .alloc_inode = s2fs_alloc_inode,
+    .free_inode = s2fs_free_inode,
+    .statfs = s2fs_statfs,
+    .sync_fs = s2fs_sync_fs,
     .drop_inode = generic_delete_inode,
+    .evict_inode = s2fs_evict_inode,
+    .show_options = s2fs_show_options,
 };
 
 static struct file_system_type s2fs_type = {
     .owner = THIS_MODULE,
     .name = "s2fs",
-    .mount = s2fs_mount,
-    .kill_sb = kill_litter_super,
+    .init_fs_context = s2fs_init_fs_context,
+    .parameters = s2fs_fs_parameters,
+    .kill_sb = s2fs_kill_sb,
     .fs_flags = FS_USERNS_MOUNT,
 };
 
+// Reads and writes go through the generic page cache paths, which gives vectored I/O,
+// splice/sendfile and async (io_uring) reads and writes without copies of our own. Reads
+// only step around it for holes (see s2fs_read_iter()).
 static struct file_operations s2fs_fops = {
     .open = s2fs_open,
-    .read = s2fs_read_file,
-    .write = s2fs_write_file,
+    .llseek = s2fs_llseek,
+    .read_iter = s2fs_read_iter,
+    .write_iter = generic_file_write_iter,
+    .splice_read = generic_file_splice_read,
+    .splice_write = iter_file_splice_write,
+    .mmap = s2fs_mmap,
+    .get_unmapped_area = thp_get_unmapped_area, // PMD-aligned, so huge folios map with one entry
+    .fsync = noop_fsync,
+    .fallocate = s2fs_fallocate,
+};
+
+// Faults are served from the page cache. Private mappings get copy-on-write from the core
+// mm; shared ones take a write fault on the first store to each page so it can be dirtied.
+static const struct vm_operations_struct s2fs_vm_ops = {
+    .fault = filemap_fault,
+    .map_pages = filemap_map_pages,
+    .page_mkwrite = s2fs_page_mkwrite,
 };
 
-static struct dentry *s2fs_mount(struct file_system_type *fs_type, int flags, const char *dev_name, void *data) {
-    struct dentry *ret;
+// Directories
+// Names are looked up through the dcache hash; every entry lives there as a pinned dentry,
+// and names looked up but not found stay there as negative dentries (see s2fs_lookup()).
+// Each directory also indexes its children by a cookie, handed out when the entry is added
+// and kept until it is removed. readdir walks the index in cookie order and the file
+// position is simply the next cookie, so resuming a listing or seekdir is a tree lookup
+// rather than a walk of the child list, and entries added or removed meanwhile never shift
+// the position of the others.
+#define S2FS_DIR_COOKIE_MIN 2 // 0 and 1 are "." and ".."
+
+struct s2fs_dir {
+    struct xarray children; // Cookie -> child dentry.
+    u32 next_cookie;
+};
+
+static const struct inode_operations s2fs_dir_inode_ops = {
+    .lookup = s2fs_lookup,
+    .create = s2fs_create,
+    .mkdir = s2fs_mkdir,
+    .unlink = s2fs_unlink,
+    .rmdir = s2fs_rmdir,
+    .rename = s2fs_rename,
+    .setattr = s2fs_setattr, // So chmod, chown and utimes are checkpointed.
+    .listxattr = s2fs_listxattr,
+};
+
+static const struct file_operations s2fs_dir_ops = {
+    .llseek = s2fs_dir_llseek,
+    .read = generic_read_dir,
+    .iterate_shared = s2fs_readdir,
+    .fsync = noop_fsync,
+};
+
+// Stats
+// The stats directory lists the registered entries rather than dentries of its own, like
+// /proc: lookup makes an inode for a registered name on demand, and a dentry stays valid
+// only while its entry is registered. Entries are shared by every mount, but each mount
+// numbers their inodes from its own counter, so they never collide with its files.
+#define S2FS_STATS_MIN_ID 2       // 0 and 1 are "." and ".."
+#define S2FS_STATS_MAX_SIZE SZ_16M // Largest rendered file
+
+struct s2fs_snapshot {
+    struct kref ref;
+    unsigned long generation;
+    size_t len;
+    char data[];
+};
+
+struct s2fs_entry {
+    struct kref ref;
+    u32 id;
+    unsigned long serial;           // Unlike id, never reused.
+    const char *name;
+    s2fs_render_t render;
+    void *priv;
+    atomic_long_t generation;
+    struct mutex lock;              // Serializes rendering and unregistering.
+    bool dead;
+    struct s2fs_snapshot *snapshot; // Latest rendered copy, under lock.
+    size_t size_hint;               // Length of the last render.
+};
+
+static DEFINE_XARRAY_ALLOC(s2fs_entries);  // ID -> entry, in registration order.
+static DEFINE_MUTEX(s2fs_entries_lock);    // Registered entries stay alive while held.
+static atomic_long_t s2fs_entries_serial;
+
+// The inode number of an entry in one mount, in s2fs_sb_info->stats_ino under
+// s2fs_entries_lock. An ID freed and registered again gets a new number.
+struct s2fs_stats_ino {
+    unsigned long serial;
+    unsigned long ino;
+};
+
+static const struct inode_operations s2fs_stats_dir_inode_ops = {
+    .lookup = s2fs_stats_lookup,
+};
+
+static const struct file_operations s2fs_stats_dir_ops = {
+    .llseek = s2fs_dir_llseek,
+    .read = generic_read_dir,
+    .iterate_shared = s2fs_stats_readdir,
+};
+
+static const struct dentry_operations s2fs_stats_dentry_ops = {
+    .d_revalidate = s2fs_stats_revalidate,
+    .d_delete = always_delete_dentry,
+};
+
+static const struct file_operations s2fs_stats_fops = {
+    .open = s2fs_stats_open,
+    .llseek = s2fs_stats_llseek,
+    .read_iter = s2fs_stats_read,
+    .release = s2fs_stats_release,
+};
+
+static const struct inode_operations s2fs_file_inode_ops = {
+    .setattr = s2fs_setattr,
+    .getattr = simple_getattr,
+    .listxattr = s2fs_listxattr,
+};
+
+// File data lives only in the page cache, like ramfs: pages are kept uptodate and dirty,
+// never written back and never reclaimed. Folios may be larger than a page (huge=).
+static const struct address_space_operations s2fs_aops = {
+    .read_folio = s2fs_read_folio,
+    .write_begin = s2fs_write_begin,
+    .write_end = s2fs_write_end,
+    .dirty_folio = noop_dirty_folio,
+    .launder_folio = s2fs_launder_folio,
+};
+
+// Mounting
+static int s2fs_init_fs_context(struct fs_context *fc) {
+    struct s2fs_options *opts = kzalloc(sizeof(*opts), GFP_KERNEL);
+
+    if (!opts)
+        return -ENOMEM;
+    opts->huge = S2FS_HUGE_NEVER;
+    opts->max_blocks = totalram_pages() / 2;
+    opts->max_inodes = min(totalram_pages() - totalhigh_pages(), totalram_pages() / 2);
+    opts->ckpt_interval = 30;
+    opts->compress_age = 60;
+    fc->fs_private = opts;
+    fc->ops = &s2fs_context_ops;
+    return 0;
+}
+
+static int s2fs_parse_param(struct fs_context *fc, struct fs_parameter *param) {
+    struct s2fs_options *opts = fc->fs_private;
+    struct fs_parse_result result;
+    unsigned long long size;
+    char *rest;
+    int opt;
 
-    ret = mount_nodev(fs_type, flags, data, s2fs_fill_super);
+    opt = fs_parse(fc, s2fs_fs_parameters, param, &result);
+    if (opt < 0)
+        return opt;
 
-    if (IS_ERR(ret))
+    switch (opt) {
+    case Opt_huge:
+        if (result.uint_32 != S2FS_HUGE_NEVER && !IS_ENABLED(CONFIG_TRANSPARENT_HUGEPAGE))
+            return invalfc(fc, "huge= needs CONFIG_TRANSPARENT_HUGEPAGE");
+        opts->huge = result.uint_32;
+        break;
+    case Opt_size:
+        size = memparse(param->string, &rest);
+        if (*rest == '%') {
+            size <<= PAGE_SHIFT;
+            size *= totalram_pages();
+            do_div(size, 100);
+            rest++;
+        }
+        if (*rest)
+            return invalfc(fc, "Bad value for size");
+        opts->max_blocks = DIV_ROUND_UP(size, PAGE_SIZE);
+        break;
+    case Opt_nr_inodes:
+        opts->max_inodes = memparse(param->string, &rest);
+        if (*rest)
+            return invalfc(fc, "Bad value for nr_inodes");
+        break;
+    case Opt_image:
+        if (fc->purpose == FS_CONTEXT_FOR_RECONFIGURE)
+            return invalfc(fc, "image= can only be given at mount");
+        kfree(opts->image);
+        opts->image = param->string;
+        param->string = NULL;
+        break;
+    case Opt_ckpt:
+        kfree(opts->ckpt);
+        opts->ckpt = param->string;
+        param->string = NULL;
+        break;
+    case Opt_ckpt_interval:
+        if (result.uint_32 > INT_MAX / HZ)
+            return invalfc(fc, "Bad value for ckpt_interval");
+        opts->ckpt_interval = result.uint_32;
+        break;
+    case Opt_compress:
+        if (strcmp(param->string, "none") && !crypto_has_comp(param->string, 0, 0))
+            return invalfc(fc, "Unknown compressor %s", param->string);
+        kfree(opts->compress);
+        opts->compress = strcmp(param->string, "none") ? param->string : NULL;
+        if (opts->compress)
+            param->string = NULL;
+        break;
+    case Opt_compress_age:
+        if (!result.uint_32 || result.uint_32 > INT_MAX / HZ)
+            return invalfc(fc, "Bad value for compress_age");
+        opts->compress_age = result.uint_32;
+        break;
+    case Opt_dedup:
+        opts->dedup = true;
+        break;
+    }
+    opts->seen |= 1 << opt;
+    return 0;
+}
+
+static int s2fs_get_tree(struct fs_context *fc) {
+    int ret = get_tree_nodev(fc, s2fs_fill_super);
+
+    if (ret)
         printk(KERN_ERR "s2fs: Error mounting file system\n");
+    return ret;
+}
+
+// Limits can be changed on remount, but not below what the mount already holds. ckpt=,
+// compress= and dedup may be repeated, as mount(8) does with what show_options printed, but
+// not changed.
+static int s2fs_reconfigure(struct fs_context *fc) {
+    struct s2fs_sb_info *sbi = S2FS_SB(fc->root->d_sb);
+    struct s2fs_options *opts = fc->fs_private;
+    const char *err = NULL;
+
+    if ((opts->seen & (1 << Opt_ckpt)) && (!sbi->ckpt_path || strcmp(opts->ckpt, sbi->ckpt_path)))
+        return invalfc(fc, "Cannot change ckpt= on remount");
+    if ((opts->seen & (1 << Opt_compress)) &&
+        (!opts->compress != !sbi->compress || (opts->compress && strcmp(opts->compress, sbi->compress))))
+        return invalfc(fc, "Cannot change compress= on remount");
+    if ((opts->seen & (1 << Opt_dedup)) && !sbi->dedup)
+        return invalfc(fc, "Cannot enable dedup on remount");
+
+    spin_lock(&sbi->stat_lock);
+    if ((opts->seen & (1 << Opt_size)) && opts->max_blocks &&
+        percpu_counter_compare(&sbi->used_blocks, opts->max_blocks) > 0)
+        err = "Too small a size for current use";
+    else if ((opts->seen & (1 << Opt_nr_inodes)) && opts->max_inodes &&
+             percpu_counter_compare(&sbi->used_inodes, opts->max_inodes) > 0)
+        err = "Too few inodes for current use";
+
+    if (!err) {
+        if (opts->seen & (1 << Opt_huge))
+            sbi->huge = opts->huge;
+        if (opts->seen & (1 << Opt_size))
+            sbi->max_blocks = opts->max_blocks;
+        if (opts->seen & (1 << Opt_nr_inodes))
+            sbi->max_inodes = opts->max_inodes;
+    }
+    spin_unlock(&sbi->stat_lock);
+
+    if (!err && sbi->ckpt && (opts->seen & (1 << Opt_ckpt_interval))) {
+        WRITE_ONCE(sbi->ckpt_interval, opts->ckpt_interval);
+        if (opts->ckpt_interval)
+            mod_delayed_work(system_long_wq, &sbi->ckpt_work, opts->ckpt_interval * HZ);
+        else
+            cancel_delayed_work(&sbi->ckpt_work);
+    }
+    if (!err && sbi->zctx && (opts->seen & (1 << Opt_compress_age))) {
+        WRITE_ONCE(sbi->compress_age, opts->compress_age);
+        mod_delayed_work(system_unbound_wq, &sbi->compress_work, opts->compress_age * HZ);
+    }
+
+    return err ? invalfc(fc, "%s", err) : 0;
+}
+
+static void s2fs_free_fc(struct fs_context *fc) {
+    struct s2fs_options *opts = fc->fs_private;
+
+    if (opts) {
+        kfree(opts->image);
+        kfree(opts->ckpt);
+        kfree(opts->compress);
+    }
+    kfree(opts);
+}
+
+static int s2fs_show_options(struct seq_file *m, struct dentry *root) {
+    struct s2fs_sb_info *sbi = S2FS_SB(root->d_sb);
+
+    if (sbi->max_blocks)
+        seq_printf(m, ",size=%luk", sbi->max_blocks << (PAGE_SHIFT - 10));
+    if (sbi->max_inodes)
+        seq_printf(m, ",nr_inodes=%lu", sbi->max_inodes);
+    if (sbi->huge != S2FS_HUGE_NEVER)
+        seq_printf(m, ",huge=%s", s2fs_param_enums_huge[sbi->huge].name);
+    if (sbi->ckpt) {
+        seq_show_option(m, "ckpt", sbi->ckpt_path);
+        seq_printf(m, ",ckpt_interval=%u", sbi->ckpt_interval);
+    }
+    if (sbi->compress)
+        seq_printf(m, ",compress=%s", sbi->compress);
+    if (sbi->dedup)
+        seq_puts(m, ",dedup");
+    if (sbi->zctx)
+        seq_printf(m, ",compress_age=%u", sbi->compress_age);
+    return 0;
+}
+
+// The last checkpoint is taken before the dcache is torn down, while every name can still
+// be logged.
+static void s2fs_kill_sb(struct super_block *sb) {
+    struct s2fs_sb_info *sbi = S2FS_SB(sb);
+
+    if (sbi && sbi->zctx)
+        cancel_delayed_work_sync(&sbi->compress_work);
+    if (sbi && sbi->ckpt) {
+        cancel_delayed_work_sync(&sbi->ckpt_work);
+        // A mount that failed partway may hold half a restore, which must not be logged.
+        if (sbi->ckpt_ready)
+            s2fs_checkpoint(sb);
+    }
+    kill_litter_super(sb);
+    if (sbi) {
+        percpu_counter_destroy(&sbi->used_blocks);
+        percpu_counter_destroy(&sbi->used_inodes);
+        free_percpu(sbi->ino_batch);
+        if (sbi->image)
+            fput(sbi->image);
+        if (sbi->ckpt)
+            fput(sbi->ckpt);
+        kfree(sbi->ckpt_path);
+        path_put(&sbi->ckpt_dir);
+        kfree(sbi->ckpt_name);
+        if (sbi->ckpt_cred)
+            put_cred(sbi->ckpt_cred);
+        xa_destroy(&sbi->ckpt_deleted);
+        s2fs_stats_ino_free(sbi);
+        s2fs_zctx_free(sbi);
+    }
+    kfree(sbi);
+}
+
+// syncfs(2) takes a checkpoint right away.
+static int s2fs_sync_fs(struct super_block *sb, int wait) {
+    if (!wait || !S2FS_SB(sb)->ckpt)
+        return 0;
+    return s2fs_checkpoint(sb);
+}
+
+// Accounting
+static int s2fs_statfs(struct dentry *dentry, struct kstatfs *buf) {
+    struct s2fs_sb_info *sbi = S2FS_SB(dentry->d_sb);
+
+    buf->f_type = S2FS_MAGIC;
+    buf->f_bsize = PAGE_SIZE;
+    buf->f_namelen = NAME_MAX;
+    if (sbi->max_blocks) {
+        buf->f_blocks = sbi->max_blocks;
+        buf->f_bavail = buf->f_bfree = sbi->max_blocks - min_t(s64, sbi->max_blocks,
+                                                                percpu_counter_sum_positive(&sbi->used_blocks));
+    }
+    if (sbi->max_inodes) {
+        buf->f_files = sbi->max_inodes;
+        buf->f_ffree = sbi->max_inodes - min_t(s64, sbi->max_inodes,
+                                               percpu_counter_sum_positive(&sbi->used_inodes));
+    }
+    return 0;
+}
+
+// The check is exact near the limit, but creators that pass it together all go on to take an
+// inode, so nr_inodes= can be overshot by up to the number of concurrent creators.
+static int s2fs_reserve_inode(struct super_block *sb) {
+    struct s2fs_sb_info *sbi = S2FS_SB(sb);
+
+    if (sbi->max_inodes && percpu_counter_compare(&sbi->used_inodes, sbi->max_inodes) >= 0)
+        return -ENOSPC;
+    percpu_counter_inc(&sbi->used_inodes);
+    return 0;
+}
+
+static void s2fs_release_inode(struct super_block *sb) {
+    percpu_counter_dec(&S2FS_SB(sb)->used_inodes);
+}
+
+// A new inode number, which is also the ID the inode is logged under. Each CPU takes
+// S2FS_INO_BATCH numbers at a time from next_ino, so the numbers of one mount are unique but
+// not dense. The first one goes to the root, which is always 1.
+static unsigned long s2fs_next_ino(struct s2fs_sb_info *sbi) {
+    struct s2fs_ino_batch *batch = get_cpu_ptr(sbi->ino_batch);
+    unsigned long ino;
+
+    if (batch->next == batch->end) {
+        batch->end = atomic_long_add_return(S2FS_INO_BATCH, &sbi->next_ino) + 1;
+        batch->next = batch->end - S2FS_INO_BATCH;
+    }
+    ino = batch->next++;
+    put_cpu_ptr(sbi->ino_batch);
+    return ino;
+}
+
+// Makes every number handed out from now on larger than ino. CPUs drop what is left of
+// their batches, so this may only run while nothing else makes inodes (restoring at mount).
+static void s2fs_skip_ino(struct s2fs_sb_info *sbi, unsigned long ino) {
+    int cpu;
+
+    if (ino > atomic_long_read(&sbi->next_ino))
+        atomic_long_set(&sbi->next_ino, ino);
+    for_each_possible_cpu(cpu) {
+        struct s2fs_ino_batch *batch = per_cpu_ptr(sbi->ino_batch, cpu);
+
+        batch->next = batch->end = 0;
+    }
+}
+
+// Charges pages about to enter the inode's page cache, to the mount and to i_blocks.
+// Chargers that pass the check together can overshoot the limit by what they charge
+// between them, as in tmpfs.
+static int s2fs_charge(struct inode *inode, long pages) {
+    struct s2fs_sb_info *sbi = S2FS_SB(inode->i_sb);
+
+    if (sbi->max_blocks && percpu_counter_compare(&sbi->used_blocks, (s64)sbi->max_blocks - pages) > 0)
+        return -ENOSPC;
+    percpu_counter_add(&sbi->used_blocks, pages);
+
+    spin_lock(&inode->i_lock);
+    inode->i_blocks += pages << (PAGE_SHIFT - 9);
+    spin_unlock(&inode->i_lock);
+    return 0;
+}
+
+static void s2fs_uncharge(struct inode *inode, long pages) {
+    spin_lock(&inode->i_lock);
+    inode->i_blocks -= pages << (PAGE_SHIFT - 9);
+    spin_unlock(&inode->i_lock);
+    percpu_counter_sub(&S2FS_SB(inode->i_sb)->used_blocks, pages);
+}
+
+// Uncharges whatever pages left the page cache since the last call, after truncation.
+// Compressed pages stay charged. Writes charge under the inode lock that callers hold, but
+// read_folio and faults do not, so a folio charged there and not yet in the page cache is
+// taken for freed and uncharged early. The mount then undercounts it until it leaves the
+// page cache, where it is not uncharged again.
+static void s2fs_recalc_inode(struct inode *inode) {
+    long freed = (inode->i_blocks >> (PAGE_SHIFT - 9)) - READ_ONCE(inode->i_mapping->nrpages) -
+                 atomic_long_read(&S2FS_I(inode)->zpages);
+
+    if (freed > 0)
+        s2fs_uncharge(inode, freed);
+}
+
+static int s2fs_setattr(struct user_namespace *mnt_userns, struct dentry *dentry, struct iattr *attr) {
+    struct inode *inode = d_inode(dentry);
+    struct s2fs_inode_info *info = S2FS_I(inode);
+    loff_t old_size = i_size_read(inode);
+    bool shrink = (attr->ia_valid & ATTR_SIZE) && attr->ia_size < old_size;
+    struct folio *folio;
+    int ret;
+
+    // A compressed page the new size falls in is brought back, so truncation zeroes its tail.
+    if (shrink && offset_in_page(attr->ia_size) && xa_load(&info->zmap, attr->ia_size >> PAGE_SHIFT)) {
+        folio = read_mapping_folio(inode->i_mapping, attr->ia_size >> PAGE_SHIFT, NULL);
+        if (IS_ERR(folio))
+            return PTR_ERR(folio);
+        folio_put(folio);
+    }
+
+    ret = simple_setattr(mnt_userns, dentry, attr);
+    if (ret)
+        return ret;
+    if (shrink) {
+        // Data cut off by the truncate must not come back from the image or the log if the
+        // file grows.
+        info->image_len = min(info->image_len, attr->ia_size);
+        s2fs_ckpt_truncate(inode, attr->ia_size);
+        s2fs_zmap_drop(inode, DIV_ROUND_UP(attr->ia_size, PAGE_SIZE), ULONG_MAX, false);
+    }
+    if (attr->ia_valid & ATTR_SIZE)
+        s2fs_recalc_inode(inode);
+    s2fs_ckpt_mark(inode);
+    return 0;
+}
+
+// Extended attributes
+// An inode keeps its attributes in a hash table keyed by full name ("user.foo"), so looking
+// one up costs the same however many the inode has, and on a list in the order they were
+// set, for listxattr. The table is only allocated with the first attribute. Readers run
+// under RCU: a value is never changed in place, as setting an attribute again swaps in a new
+// entry and frees the old one after a grace period. Writers are serialized by the inode
+// lock, which the VFS holds around setxattr and removexattr. Attributes are not logged by
+// checkpoints.
+//
+// Anyone who may write a file may set user.* attributes on it, so those count against size=
+// like data, in whole pages for each inode's total. Each is charged its entry plus a share of
+// the hash table's buckets: rhashtable allocates those itself, without __GFP_ACCOUNT, so
+// size= is what bounds them.
+#define S2FS_XATTR_BUCKET_SHARE (3 * sizeof(void *)) // At most 8/3 buckets per entry.
+
+struct s2fs_xattr {
+    struct rhash_head node;
+    struct list_head list;
+    struct rcu_head rcu;
+    const char *name; // Stored after the value.
+    size_t size;
+    char value[];
+};
+
+struct s2fs_xattrs {
+    struct rhashtable table;
+    struct list_head list;
+};
+
+static u32 s2fs_xattr_hashfn(const void *data, u32 len, u32 seed) {
+    const char *name = data;
+
+    return jhash(name, strlen(name), seed);
+}
+
+static u32 s2fs_xattr_obj_hashfn(const void *data, u32 len, u32 seed) {
+    const struct s2fs_xattr *x = data;
+
+    return jhash(x->name, strlen(x->name), seed);
+}
+
+static int s2fs_xattr_obj_cmpfn(struct rhashtable_compare_arg *arg, const void *obj) {
+    const struct s2fs_xattr *x = obj;
+
+    return strcmp(x->name, arg->key);
+}
+
+static const struct rhashtable_params s2fs_xattr_params = {
+    .head_offset = offsetof(struct s2fs_xattr, node),
+    .hashfn = s2fs_xattr_hashfn,
+    .obj_hashfn = s2fs_xattr_obj_hashfn,
+    .obj_cmpfn = s2fs_xattr_obj_cmpfn,
+    .automatic_shrinking = true,
+};
+
+static void s2fs_xattr_free(void *ptr, void *arg) {
+    kvfree(ptr);
+}
+
+static size_t s2fs_xattr_cost(const struct s2fs_xattr *x) {
+    if (!x)
+        return 0;
+    return struct_size(x, value, x->size) + strlen(x->name) + 1 + S2FS_XATTR_BUCKET_SHARE;
+}
+
+// Charges delta bytes more of user.* attributes to inode, or uncharges them if negative,
+// which never fails.
+static int s2fs_xattr_charge(struct inode *inode, ssize_t delta) {
+    struct s2fs_sb_info *sbi = S2FS_SB(inode->i_sb);
+    struct s2fs_inode_info *info = S2FS_I(inode);
+    long pages = (long)DIV_ROUND_UP(info->xattr_bytes + delta, PAGE_SIZE) -
+                 (long)DIV_ROUND_UP(info->xattr_bytes, PAGE_SIZE);
+
+    if (pages > 0 && sbi->max_blocks &&
+        percpu_counter_compare(&sbi->used_blocks, (s64)sbi->max_blocks - pages) > 0)
+        return -ENOSPC;
+    percpu_counter_add(&sbi->used_blocks, pages);
+    info->xattr_bytes += delta;
+    return 0;
+}
+
+// Called at eviction, when nobody can look the attributes up any more.
+static void s2fs_xattrs_free(struct inode *inode) {
+    struct s2fs_inode_info *info = S2FS_I(inode);
+    struct s2fs_xattrs *xattrs = rcu_dereference_protected(info->xattrs, true);
+
+    if (!xattrs)
+        return;
+    rhashtable_free_and_destroy(&xattrs->table, s2fs_xattr_free, NULL);
+    kfree(xattrs);
+    RCU_INIT_POINTER(info->xattrs, NULL);
+    s2fs_xattr_charge(inode, -(ssize_t)info->xattr_bytes);
+}
+
+static int s2fs_xattr_get(const struct xattr_handler *handler, struct dentry *unused, struct inode *inode,
+                          const char *name, void *buffer, size_t size) {
+    struct s2fs_xattrs *xattrs;
+    struct s2fs_xattr *x;
+    int ret = -ENODATA;
+
+    name = xattr_full_name(handler, name);
+    rcu_read_lock();
+    xattrs = rcu_dereference(S2FS_I(inode)->xattrs);
+    x = xattrs ? rhashtable_lookup(&xattrs->table, name, s2fs_xattr_params) : NULL;
+    if (x) {
+        ret = x->size;
+        if (size && size < x->size)
+            ret = -ERANGE;
+        else if (size)
+            memcpy(buffer, x->value, x->size);
+    }
+    rcu_read_unlock();
+    return ret;
+}
+
+// Sets name to value, or removes it if value is NULL.
+static int s2fs_xattr_set(const struct xattr_handler *handler, struct user_namespace *mnt_userns,
+                          struct dentry *unused, struct inode *inode, const char *name, const void *value,
+                          size_t size, int flags) {
+    struct s2fs_inode_info *info = S2FS_I(inode);
+    struct s2fs_xattrs *xattrs = rcu_dereference_protected(info->xattrs, inode_is_locked(inode));
+    struct s2fs_xattr *old, *new = NULL;
+    bool user = !strcmp(handler->prefix, XATTR_USER_PREFIX);
+    ssize_t delta = 0;
+    size_t namelen;
+    int ret;
+
+    name = xattr_full_name(handler, name);
+    namelen = strlen(name);
+    if (!xattrs) {
+        if (flags & XATTR_REPLACE)
+            return -ENODATA;
+        if (!value)
+            return 0;
+        xattrs = kmalloc(sizeof(*xattrs), GFP_KERNEL_ACCOUNT);
+        if (!xattrs)
+            return -ENOMEM;
+        ret = rhashtable_init(&xattrs->table, &s2fs_xattr_params);
+        if (ret) {
+            kfree(xattrs);
+            return ret;
+        }
+        INIT_LIST_HEAD(&xattrs->list);
+        rcu_assign_pointer(info->xattrs, xattrs);
+    }
+
+    if (value) {
+        new = kvmalloc(struct_size(new, value, size) + namelen + 1, GFP_KERNEL_ACCOUNT);
+        if (!new)
+            return -ENOMEM;
+        new->size = size;
+        memcpy(new->value, value, size);
+        new->name = memcpy(new->value + size, name, namelen + 1);
+    }
+
+    old = rhashtable_lookup_fast(&xattrs->table, name, s2fs_xattr_params);
+    if (user)
+        delta = s2fs_xattr_cost(new) - s2fs_xattr_cost(old);
+    if (old && (flags & XATTR_CREATE))
+        ret = -EEXIST;
+    else if (!old && (flags & XATTR_REPLACE))
+        ret = -ENODATA;
+    else
+        ret = s2fs_xattr_charge(inode, delta);
+    if (ret) {
+        kvfree(new);
+        return ret;
+    }
+
+    if (old && new)
+        ret = rhashtable_replace_fast(&xattrs->table, &old->node, &new->node, s2fs_xattr_params);
+    else if (old)
+        ret = rhashtable_remove_fast(&xattrs->table, &old->node, s2fs_xattr_params);
+    else if (new)
+        ret = rhashtable_insert_fast(&xattrs->table, &new->node, s2fs_xattr_params);
+    if (ret) {
+        s2fs_xattr_charge(inode, -delta);
+        kvfree(new);
+        return ret;
+    }
+
+    if (old && new)
+        list_replace_rcu(&old->list, &new->list);
+    else if (old)
+        list_del_rcu(&old->list);
+    else if (new)
+        list_add_tail_rcu(&new->list, &xattrs->list);
+    if (old)
+        kvfree_rcu(old, rcu);
+    inode->i_ctime = current_time(inode);
+    return 0;
+}
+
+static const struct xattr_handler s2fs_xattr_user_handler = {
+    .prefix = XATTR_USER_PREFIX,
+    .get = s2fs_xattr_get,
+    .set = s2fs_xattr_set,
+};
+
+static const struct xattr_handler s2fs_xattr_trusted_handler = {
+    .prefix = XATTR_TRUSTED_PREFIX,
+    .get = s2fs_xattr_get,
+    .set = s2fs_xattr_set,
+};
 
+static const struct xattr_handler s2fs_xattr_security_handler = {
+    .prefix = XATTR_SECURITY_PREFIX,
+    .get = s2fs_xattr_get,
+    .set = s2fs_xattr_set,
+};
+
+static const struct xattr_handler *s2fs_xattr_handlers[] = {
+    &s2fs_xattr_user_handler,
+    &s2fs_xattr_trusted_handler,
+    &s2fs_xattr_security_handler,
+    NULL
+};
+
+// Trusted attributes are only listed for CAP_SYS_ADMIN, as the VFS only lets it read them.
+// Checked without auditing, like simple_xattr_list(), as a listing is not a denied access.
+static ssize_t s2fs_listxattr(struct dentry *dentry, char *buffer, size_t size) {
+    bool trusted = ns_capable_noaudit(&init_user_ns, CAP_SYS_ADMIN);
+    struct s2fs_xattrs *xattrs;
+    struct s2fs_xattr *x;
+    ssize_t ret = 0;
+    size_t len;
+
+    rcu_read_lock();
+    xattrs = rcu_dereference(S2FS_I(d_inode(dentry))->xattrs);
+    if (xattrs) {
+        list_for_each_entry_rcu(x, &xattrs->list, list) {
+            if (!trusted && !strncmp(x->name, XATTR_TRUSTED_PREFIX, XATTR_TRUSTED_PREFIX_LEN))
+                continue;
+            len = strlen(x->name) + 1;
+            if (buffer) {
+                if (size - ret < len) {
+                    ret = -ERANGE;
+                    break;
+                }
+                memcpy(buffer + ret, x->name, len);
+            }
+            ret += len;
+        }
+    }
+    rcu_read_unlock();
     return ret;
 }
 
-static int s2fs_fill_super(struct super_block *sb, void *data, int silent) {
+static int s2fs_fill_super(struct super_block *sb, struct fs_context *fc) {
+    struct s2fs_options *opts = fc->fs_private;
+    struct s2fs_sb_info *sbi;
     struct inode *root_inode;
-    struct dentry *root_dentry, *foo_dir, *bar_file;
+    struct dentry *root_dentry, *foo_dir, *bar_file, *stats_dir;
+    int restored = 0, ret;
+
+    if (opts->image && opts->ckpt)
+        return invalfc(fc, "image= and ckpt= cannot be combined");
+
+    sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
+    if (!sbi)
+        return -ENOMEM;
+    sb->s_fs_info = sbi;
+    sbi->sb = sb;
+    sbi->huge = opts->huge;
+    sbi->max_blocks = opts->max_blocks;
+    sbi->max_inodes = opts->max_inodes;
+    spin_lock_init(&sbi->stat_lock);
+    sbi->ckpt_interval = opts->ckpt_interval;
+    INIT_DELAYED_WORK(&sbi->ckpt_work, s2fs_ckpt_work);
+    mutex_init(&sbi->ckpt_mutex);
+    init_rwsem(&sbi->ckpt_sem);
+    spin_lock_init(&sbi->ckpt_lock);
+    INIT_LIST_HEAD(&sbi->ckpt_dirty);
+    INIT_LIST_HEAD(&sbi->ckpt_batch);
+    xa_init(&sbi->ckpt_deleted);
+    xa_init(&sbi->stats_ino);
+    sbi->compress_age = opts->compress_age;
+    INIT_DELAYED_WORK(&sbi->compress_work, s2fs_compress_work);
+    if (percpu_counter_init(&sbi->used_blocks, 0, GFP_KERNEL) ||
+        percpu_counter_init(&sbi->used_inodes, 0, GFP_KERNEL))
+        return -ENOMEM;
+    sbi->ino_batch = alloc_percpu(struct s2fs_ino_batch);
+    if (!sbi->ino_batch)
+        return -ENOMEM;
+
+    if (opts->compress || opts->dedup) {
+        ret = s2fs_zctx_init(sb, opts->compress, opts->dedup);
+        if (ret)
+            return ret;
+    }
+
+    // Opened first, so every inode made from here on is tracked for the first checkpoint.
+    if (opts->ckpt) {
+        ret = s2fs_ckpt_open(sb, opts->ckpt);
+        if (ret)
+            return ret;
+    }
 
     sb->s_magic = S2FS_MAGIC;
     sb->s_blocksize = PAGE_SIZE;
     sb->s_blocksize_bits = PAGE_SHIFT;
+    sb->s_maxbytes = MAX_LFS_FILESIZE;
     sb->s_op = &s2fs_super_ops;
+    sb->s_xattr = s2fs_xattr_handlers;
 
     root_inode = s2fs_make_inode(sb, S_IFDIR | 0755);
     if (!root_inode) {
@@ -62,10 +1096,6 @@ static int s2fs_fill_super(struct super_block *sb, void *data, int silent) {
         return -ENOMEM;
     }
 
-    root_inode->i_op = &simple_dir_inode_operations;
-    root_inode->i_fop = &simple_dir_operations;
-    root_inode->i_atime = root_inode->i_mtime = root_inode->i_ctime = current_time(root_inode);
-
     root_dentry = d_make_root(root_inode);
     if (!root_dentry) {
         printk(KERN_ERR "s2fs: Error creating root dentry\n");
@@ -74,117 +1104,3337 @@ static int s2fs_fill_super(struct super_block *sb, void *data, int silent) {
 
     sb->s_root = root_dentry;
 
-    foo_dir = s2fs_create_dir(sb, root_dentry, "foo");
-    if (!foo_dir) {
-        printk(KERN_ERR "s2fs: Error creating foo directory\n");
-        return -ENOMEM;
+    if (sbi->ckpt) {
+        restored = s2fs_ckpt_restore(sb);
+        if (restored < 0)
+            return restored;
+    }
+
+    // A restored mount has whatever foo and bar became when it was checkpointed, and an
+    // image= mount has what its archive holds, which may well be an earlier foo/bar.
+    if (!restored && !opts->image) {
+        foo_dir = s2fs_create_dir(sb, root_dentry, "foo");
+        if (!foo_dir) {
+            printk(KERN_ERR "s2fs: Error creating foo directory\n");
+            return -ENOMEM;
+        }
+
+        bar_file = s2fs_create_file(sb, foo_dir, "bar");
+        if (!bar_file) {
+            printk(KERN_ERR "s2fs: Error creating bar file\n");
+            return -ENOMEM;
+        }
+
+        if (s2fs_fill_file(d_inode(bar_file), "Hello World!\n", 13)) {
+            printk(KERN_ERR "s2fs: Error writing bar file\n");
+            return -ENOMEM;
+        }
     }
 
-    bar_file = s2fs_create_file(sb, foo_dir, "bar");
-    if (!bar_file) {
-        printk(KERN_ERR "s2fs: Error creating bar file\n");
+    stats_dir = s2fs_create_dir(sb, root_dentry, "stats");
+    if (!stats_dir) {
+        printk(KERN_ERR "s2fs: Error creating stats directory\n");
         return -ENOMEM;
     }
+    d_inode(stats_dir)->i_op = &s2fs_stats_dir_inode_ops;
+    d_inode(stats_dir)->i_fop = &s2fs_stats_dir_ops;
+    // Generated on demand, so never logged.
+    s2fs_ckpt_clean(d_inode(stats_dir));
+    S2FS_I(d_inode(stats_dir))->ckpt_id = 0;
+
+    if (opts->image) {
+        ret = s2fs_load_image(sb, opts->image);
+        if (ret)
+            return ret;
+    }
 
+    sbi->ckpt_ready = true;
+    if (sbi->ckpt && sbi->ckpt_interval)
+        queue_delayed_work(system_long_wq, &sbi->ckpt_work, sbi->ckpt_interval * HZ);
+    if (sbi->zctx)
+        queue_delayed_work(system_unbound_wq, &sbi->compress_work, sbi->compress_age * HZ);
     return 0;
 }
 
+static struct inode *s2fs_alloc_inode(struct super_block *sb) {
+    struct s2fs_inode_info *info = alloc_inode_sb(sb, s2fs_inode_cachep, GFP_KERNEL);
+
+    if (!info)
+        return NULL;
+    info->image_off = 0;
+    info->image_len = 0;
+    info->ckpt_id = 0;
+    info->ckpt_flags = 0;
+    info->ckpt_trunc = LLONG_MAX;
+    info->ckpt_len = 0;
+    RCU_INIT_POINTER(info->xattrs, NULL);
+    info->xattr_bytes = 0;
+    return &info->vfs_inode;
+}
+
+static void s2fs_free_inode(struct inode *inode) {
+    kmem_cache_free(s2fs_inode_cachep, S2FS_I(inode));
+}
+
+// The lists and xarrays are left empty whenever an inode is freed.
+static void s2fs_inode_init_once(void *ptr) {
+    struct s2fs_inode_info *info = ptr;
+
+    INIT_LIST_HEAD(&info->ckpt_dirty);
+    xa_init(&info->ckpt_pages);
+    xa_init(&info->ckpt_map);
+    INIT_LIST_HEAD(&info->ckpt_holes);
+    mt_init(&info->holes);
+    xa_init(&info->zmap);
+    atomic_long_set(&info->zpages, 0);
+    inode_init_once(&info->vfs_inode);
+}
+
 static struct inode *s2fs_make_inode(struct super_block *sb, int mode) {
-    struct inode *ret = new_inode(sb);
+    struct inode *ret;
+    struct s2fs_dir *dir;
+
+    if (s2fs_reserve_inode(sb))
+        return NULL;
+    ret = new_inode(sb);
+    if (!ret)
+        s2fs_release_inode(sb);
 
     if (ret) {
-        ret->i_ino = get_next_ino();
+        ret->i_ino = s2fs_next_ino(S2FS_SB(sb));
         ret->i_mode = mode;
         ret->i_uid.val = ret->i_gid.val = 0;
         ret->i_blocks = 0;
         ret->i_atime = ret->i_mtime = ret->i_ctime = current_time(ret);
+        S2FS_I(ret)->ckpt_id = ret->i_ino;
+
+        if (S_ISDIR(mode)) {
+            dir = kmalloc(sizeof(*dir), GFP_KERNEL);
+            if (!dir) {
+                iput(ret);
+                return NULL;
+            }
+            xa_init_flags(&dir->children, XA_FLAGS_ALLOC);
+            dir->next_cookie = S2FS_DIR_COOKIE_MIN;
+            ret->i_private = dir;
+            ret->i_op = &s2fs_dir_inode_ops;
+            ret->i_fop = &s2fs_dir_ops;
+            inc_nlink(ret); // For "."
+        } else {
+            ret->i_op = &s2fs_file_inode_ops;
+            ret->i_fop = &s2fs_fops;
+            ret->i_mapping->a_ops = &s2fs_aops;
+            mapping_set_gfp_mask(ret->i_mapping, GFP_HIGHUSER);
+            mapping_set_unevictable(ret->i_mapping);
+            if (S2FS_SB(sb)->huge != S2FS_HUGE_NEVER)
+                mapping_set_large_folios(ret->i_mapping);
+        }
+        s2fs_ckpt_mark(ret);
     }
     return ret;
 }
 
-static struct dentry *s2fs_create_dir(struct super_block *sb, struct dentry *parent, const char *dir_name) {
+static void s2fs_evict_inode(struct inode *inode) {
+    struct s2fs_dir *dir = inode->i_private;
+
+    truncate_inode_pages_final(&inode->i_data);
+    clear_inode(inode);
+    s2fs_xattrs_free(inode);
+    if (inode->i_fop == &s2fs_stats_fops) {
+        s2fs_entry_put(inode->i_private);
+        return;
+    }
+
+    s2fs_ckpt_evict(inode);
+    s2fs_zmap_drop(inode, 0, ULONG_MAX, false);
+    mtree_destroy(&S2FS_I(inode)->holes);
+    s2fs_recalc_inode(inode);
+    s2fs_release_inode(inode->i_sb);
+    if (S_ISDIR(inode->i_mode) && dir) {
+        xa_destroy(&dir->children);
+        kfree(dir);
+    }
+}
+
+// Calls fn on every live inode of sb, holding a reference but no locks, so fn may sleep.
+// Stops at the first error fn returns.
+static int s2fs_for_each_inode(struct super_block *sb, int (*fn)(struct inode *inode, void *arg), void *arg) {
+    struct inode *inode, *toput = NULL;
+    int ret = 0;
+
+    spin_lock(&sb->s_inode_list_lock);
+    list_for_each_entry(inode, &sb->s_inodes, i_sb_list) {
+        spin_lock(&inode->i_lock);
+        if (inode->i_state & (I_FREEING | I_WILL_FREE | I_NEW)) {
+            spin_unlock(&inode->i_lock);
+            continue;
+        }
+        __iget(inode);
+        spin_unlock(&inode->i_lock);
+        spin_unlock(&sb->s_inode_list_lock);
+
+        ret = fn(inode, arg);
+        // Dropped only now, so the inode stays on the list while the walk continues from it.
+        iput(toput);
+        toput = inode;
+        if (ret)
+            break;
+        cond_resched();
+        spin_lock(&sb->s_inode_list_lock);
+    }
+    if (!ret)
+        spin_unlock(&sb->s_inode_list_lock);
+    iput(toput);
+    return ret;
+}
+
+// Directory index
+static inline struct s2fs_dir *s2fs_dir(struct inode *inode) {
+    return inode->i_private;
+}
+
+static inline unsigned long s2fs_dentry_cookie(struct dentry *dentry) {
+    return (unsigned long)dentry->d_fsdata;
+}
+
+static int s2fs_dir_add(struct inode *inode, struct dentry *dentry) {
+    struct s2fs_dir *dir = s2fs_dir(inode);
+    u32 cookie;
+    int ret;
+
+    ret = xa_alloc_cyclic(&dir->children, &cookie, dentry, XA_LIMIT(S2FS_DIR_COOKIE_MIN, INT_MAX),
+                          &dir->next_cookie, GFP_KERNEL);
+    if (ret < 0)
+        return ret;
+    dentry->d_fsdata = (void *)(unsigned long)cookie;
+    return 0;
+}
+
+static void s2fs_dir_remove(struct inode *inode, struct dentry *dentry) {
+    xa_erase(&s2fs_dir(inode)->children, s2fs_dentry_cookie(dentry));
+    dentry->d_fsdata = NULL;
+}
+
+static bool s2fs_dir_empty(struct inode *inode) {
+    return xa_empty(&s2fs_dir(inode)->children);
+}
+
+// Entries made at mount time.
+static struct dentry *s2fs_create_entry(struct super_block *sb, struct dentry *parent, const char *name, int mode) {
     struct dentry *dentry;
     struct inode *inode;
     struct qstr qname;
 
-    qname.name = dir_name;
-    qname.len = strlen(dir_name);
-    qname.hash = full_name_hash(parent, dir_name, qname.len);
+    qname.name = name;
+    qname.len = strlen(name);
+    qname.hash = full_name_hash(parent, name, qname.len);
 
     dentry = d_alloc(parent, &qname);
     if (!dentry)
         return NULL;
 
-    inode = s2fs_make_inode(sb, S_IFDIR | 0755);
+    inode = s2fs_make_inode(sb, mode);
     if (!inode) {
         dput(dentry);
         return NULL;
     }
 
-    inode->i_op = &simple_dir_inode_operations;
-    inode->i_fop = &simple_dir_operations;
-
-    d_add(dentry, inode);
+    if (s2fs_dir_add(d_inode(parent), dentry)) {
+        iput(inode);
+        dput(dentry);
+        return NULL;
+    }
+    if (S_ISDIR(mode))
+        inc_nlink(d_inode(parent));
+
+    d_add(dentry, inode);
     return dentry;
 }
 
-static struct dentry *s2fs_create_file(struct super_block *sb, struct dentry *parent, const char *file_name) {
-    struct dentry *dentry;
+static struct dentry *s2fs_create_dir(struct super_block *sb, struct dentry *parent, const char *dir_name) {
+    return s2fs_create_entry(sb, parent, dir_name, S_IFDIR | 0755);
+}
+
+static struct dentry *s2fs_create_file(struct super_block *sb, struct dentry *parent, const char *file_name) {
+    return s2fs_create_entry(sb, parent, file_name, S_IFREG | 0644);
+}
+
+// Directory operations
+// Only called for names missing from the dcache, as every entry is there. Unlike
+// simple_lookup(), the miss is cached as a negative dentry that lives until reclaimed, so
+// asking again for a name that does not exist (stat before create, searching $PATH) is
+// answered by the lockless dcache walk. Otherwise every miss would take the directory lock
+// shared and queue behind creates and unlinks holding it exclusively, which is what
+// serializes threads working in one directory.
+static struct dentry *s2fs_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags) {
+    if (dentry->d_name.len > NAME_MAX)
+        return ERR_PTR(-ENAMETOOLONG);
+    d_add(dentry, NULL);
+    return NULL;
+}
+
+// Like ramfs, the new dentry keeps an extra reference so it stays in the dcache until it
+// is unlinked or the filesystem is unmounted.
+static int s2fs_mknod(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode) {
+    struct inode *inode = s2fs_make_inode(dir->i_sb, mode);
+    int ret;
+
+    if (!inode)
+        return -ENOSPC;
+    inode_init_owner(mnt_userns, inode, dir, mode);
+
+    ret = s2fs_dir_add(dir, dentry);
+    if (ret) {
+        iput(inode);
+        return ret;
+    }
+
+    d_instantiate(dentry, inode);
+    dget(dentry);
+    dir->i_mtime = dir->i_ctime = current_time(dir);
+    s2fs_ckpt_mark(dir);
+    return 0;
+}
+
+static int s2fs_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl) {
+    return s2fs_mknod(mnt_userns, dir, dentry, mode | S_IFREG);
+}
+
+static int s2fs_mkdir(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode) {
+    int ret = s2fs_mknod(mnt_userns, dir, dentry, mode | S_IFDIR);
+
+    if (!ret)
+        inc_nlink(dir);
+    return ret;
+}
+
+static int s2fs_unlink(struct inode *dir, struct dentry *dentry) {
+    int ret = s2fs_ckpt_forget(d_inode(dentry));
+
+    if (ret)
+        return ret;
+    s2fs_dir_remove(dir, dentry);
+    s2fs_ckpt_mark(dir);
+    return simple_unlink(dir, dentry);
+}
+
+static int s2fs_rmdir(struct inode *dir, struct dentry *dentry) {
+    int ret;
+
+    // Always looks empty, as its entries are not dentries.
+    if (d_inode(dentry)->i_op == &s2fs_stats_dir_inode_ops)
+        return -EBUSY;
+    if (!s2fs_dir_empty(d_inode(dentry)))
+        return -ENOTEMPTY;
+    ret = s2fs_ckpt_forget(d_inode(dentry));
+    if (ret)
+        return ret;
+
+    s2fs_dir_remove(dir, dentry);
+    s2fs_ckpt_mark(dir);
+    drop_nlink(d_inode(dentry));
+    simple_unlink(dir, dentry);
+    drop_nlink(dir);
+    return 0;
+}
+
+// The moved entry gets a new cookie in its new directory, allocated first so that running
+// out of memory leaves both directories untouched. An exchange swaps the two cookies.
+static int s2fs_rename(struct user_namespace *mnt_userns, struct inode *old_dir, struct dentry *old_dentry,
+                       struct inode *new_dir, struct dentry *new_dentry, unsigned int flags) {
+    unsigned long old_cookie = s2fs_dentry_cookie(old_dentry);
+    struct s2fs_dir *dir = s2fs_dir(new_dir);
+    bool replace = d_really_is_positive(new_dentry);
+    u32 cookie;
+    int ret;
+
+    if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE))
+        return -EINVAL;
+    // Stays where fill_super put it, and cannot be replaced, as in s2fs_rmdir().
+    if (d_inode(old_dentry)->i_op == &s2fs_stats_dir_inode_ops ||
+        (replace && d_inode(new_dentry)->i_op == &s2fs_stats_dir_inode_ops))
+        return -EBUSY;
+
+    if (flags & RENAME_EXCHANGE) {
+        ret = simple_rename(mnt_userns, old_dir, old_dentry, new_dir, new_dentry, flags);
+        if (ret)
+            return ret;
+        xa_store(&s2fs_dir(old_dir)->children, old_cookie, new_dentry, GFP_KERNEL);
+        xa_store(&dir->children, s2fs_dentry_cookie(new_dentry), old_dentry, GFP_KERNEL);
+        old_dentry->d_fsdata = new_dentry->d_fsdata;
+        new_dentry->d_fsdata = (void *)old_cookie;
+        s2fs_ckpt_mark(d_inode(new_dentry));
+        goto out;
+    }
+
+    if (replace && d_is_dir(new_dentry) && !s2fs_dir_empty(d_inode(new_dentry)))
+        return -ENOTEMPTY;
+
+    ret = xa_alloc_cyclic(&dir->children, &cookie, old_dentry, XA_LIMIT(S2FS_DIR_COOKIE_MIN, INT_MAX),
+                          &dir->next_cookie, GFP_KERNEL);
+    if (ret < 0)
+        return ret;
+    if (replace) {
+        ret = s2fs_ckpt_forget(d_inode(new_dentry));
+        if (ret) {
+            xa_erase(&dir->children, cookie);
+            return ret;
+        }
+    }
+
+    ret = simple_rename(mnt_userns, old_dir, old_dentry, new_dir, new_dentry, flags);
+    if (ret) {
+        if (replace)
+            s2fs_ckpt_unforget(d_inode(new_dentry));
+        xa_erase(&dir->children, cookie);
+        return ret;
+    }
+
+    if (replace)
+        s2fs_dir_remove(new_dir, new_dentry);
+    s2fs_dir_remove(old_dir, old_dentry);
+    old_dentry->d_fsdata = (void *)(unsigned long)cookie;
+out:
+    // The moved inode is logged under its new name and parent.
+    s2fs_ckpt_mark(d_inode(old_dentry));
+    s2fs_ckpt_mark(old_dir);
+    s2fs_ckpt_mark(new_dir);
+    return 0;
+}
+
+// The position is the cookie of the next entry to return.
+static int s2fs_readdir(struct file *filp, struct dir_context *ctx) {
+    struct s2fs_dir *dir = s2fs_dir(file_inode(filp));
+    struct dentry *child;
+    unsigned long index;
+
+    if (!dir_emit_dots(filp, ctx))
+        return 0;
+
+    xa_for_each_start(&dir->children, index, child, ctx->pos) {
+        struct inode *inode = d_inode(child);
+
+        ctx->pos = index;
+        if (!dir_emit(ctx, child->d_name.name, child->d_name.len, inode->i_ino,
+                      fs_umode_to_dtype(inode->i_mode)))
+            return 0;
+    }
+    ctx->pos = (loff_t)INT_MAX + 1;
+    return 0;
+}
+
+static loff_t s2fs_dir_llseek(struct file *filp, loff_t offset, int whence) {
+    switch (whence) {
+    case SEEK_CUR:
+        offset += filp->f_pos;
+        fallthrough;
+    case SEEK_SET:
+        if (offset >= 0)
+            break;
+        fallthrough;
+    default:
+        return -EINVAL;
+    }
+    return vfs_setpos(filp, offset, (loff_t)INT_MAX + 1);
+}
+
+// Image
+// image= populates the mount from a cpio archive in the "newc" format (what
+// `find . | cpio -o -H newc` writes and the kernel unpacks as initramfs) in a single pass
+// over its headers. Directories and regular files are created directly as dentries and
+// inodes, and file data is not read: each file only records where its data sits in the
+// archive, and pages are read from there on first access. The archive must not change while
+// it is mounted. The names of a hard-linked file become links to one inode. Symlinks and
+// device nodes are skipped, and so is stats/, which the mount generates itself.
+#define S2FS_CPIO_HDR_LEN 110
+#define S2FS_CPIO_BUF_SIZE SZ_64K
+
+struct s2fs_image_reader {
+    struct file *file;
+    char *buf;
+    loff_t buf_pos; // Archive offset of buf[0].
+    size_t buf_len; // Valid bytes in buf.
+};
+
+// Bytes [pos, pos + len) of the archive, len at most S2FS_CPIO_BUF_SIZE.
+static const char *s2fs_image_peek(struct s2fs_image_reader *r, loff_t pos, size_t len) {
+    loff_t read_pos = pos;
+    ssize_t n;
+
+    if (pos >= r->buf_pos && pos + len <= r->buf_pos + r->buf_len)
+        return r->buf + (pos - r->buf_pos);
+
+    n = kernel_read(r->file, r->buf, S2FS_CPIO_BUF_SIZE, &read_pos);
+    if (n < 0)
+        return ERR_PTR(n);
+    r->buf_pos = pos;
+    r->buf_len = n;
+    if (n < len)
+        return ERR_PTR(-EINVAL);
+    return r->buf;
+}
+
+static int s2fs_cpio_field(const char *hdr, int i, unsigned long *val) {
+    char field[9];
+
+    memcpy(field, hdr + 6 + i * 8, 8);
+    field[8] = '\0';
+    return kstrtoul(field, 16, val);
+}
+
+// A hard-linked file created from an earlier member, by its cpio inode number. newc gives
+// the data to one of its names only, usually the last.
+struct s2fs_image_link {
+    unsigned long major, minor;   // Of the device it was archived from.
+    struct inode *inode;
+    struct s2fs_image_link *next; // Same inode number, other device.
+};
+
+static void s2fs_image_links_free(struct xarray *links) {
+    struct s2fs_image_link *link, *next;
+    unsigned long ino;
+
+    xa_for_each(links, ino, link) {
+        for (; link; link = next) {
+            next = link->next;
+            kfree(link);
+        }
+    }
+    xa_destroy(links);
+}
+
+// Another name in parent for inode, a regular file.
+static struct dentry *s2fs_image_link(struct dentry *parent, const char *name, struct inode *inode) {
+    struct qstr qname = QSTR_INIT(name, strlen(name));
+    struct dentry *dentry;
+
+    qname.hash = full_name_hash(parent, name, qname.len);
+    dentry = d_alloc(parent, &qname);
+    if (!dentry)
+        return ERR_PTR(-ENOMEM);
+    if (s2fs_dir_add(d_inode(parent), dentry)) {
+        dput(dentry);
+        return ERR_PTR(-ENOMEM);
+    }
+    ihold(inode);
+    inc_nlink(inode);
+    d_add(dentry, inode);
+    return dentry;
+}
+
+// The child of parent called name, as a new directory if it does not exist yet.
+static struct dentry *s2fs_image_dir(struct super_block *sb, struct dentry *parent, const char *name, int len) {
+    struct qstr qname = QSTR_INIT(name, len);
+    struct dentry *dentry;
+    char *copy;
+
+    dentry = d_hash_and_lookup(parent, &qname);
+    if (IS_ERR(dentry))
+        return dentry;
+    if (dentry) {
+        dput(dentry); // Pinned by its creation reference.
+        return d_is_dir(dentry) ? dentry : ERR_PTR(-ENOTDIR);
+    }
+
+    copy = kstrndup(name, len, GFP_KERNEL);
+    if (!copy)
+        return ERR_PTR(-ENOMEM);
+    dentry = s2fs_create_dir(sb, parent, copy);
+    kfree(copy);
+    return dentry ? dentry : ERR_PTR(-ENOSPC);
+}
+
+// Creates one archive member. Consecutive members usually share a parent, so the last
+// parent path and its dentry are kept and the path is only walked when it changes.
+static int s2fs_image_add(struct super_block *sb, char *path, const char *hdr, loff_t data_off,
+                          char *last_dir, struct dentry **last_parent, struct xarray *links) {
+    unsigned long mode, uid, gid, nlink, mtime, size, ino, major, minor;
+    struct dentry *parent = sb->s_root, *dentry;
+    struct s2fs_image_link *link = NULL, *first = NULL;
+    struct inode *inode;
+    char *name, *slash, *p;
+
+    if (s2fs_cpio_field(hdr, 0, &ino) || s2fs_cpio_field(hdr, 1, &mode) || s2fs_cpio_field(hdr, 2, &uid) ||
+        s2fs_cpio_field(hdr, 3, &gid) || s2fs_cpio_field(hdr, 4, &nlink) || s2fs_cpio_field(hdr, 5, &mtime) ||
+        s2fs_cpio_field(hdr, 6, &size) || s2fs_cpio_field(hdr, 7, &major) || s2fs_cpio_field(hdr, 8, &minor))
+        return -EINVAL;
+
+    while (!strncmp(path, "./", 2))
+        path += 2;
+    while (*path == '/')
+        path++;
+    if (!*path || !strcmp(path, "."))
+        return 0;
+    if (!S_ISDIR(mode) && !S_ISREG(mode))
+        return 0;
+    // Say the archive was made from an s2fs mount: its stats are generated anew here.
+    if (!strcmp(path, "stats") || !strncmp(path, "stats/", 6))
+        return 0;
+
+    slash = strrchr(path, '/');
+    name = slash ? slash + 1 : path;
+    if (slash) {
+        *slash = '\0';
+        if (*last_parent && !strcmp(path, last_dir)) {
+            parent = *last_parent;
+        } else {
+            for (p = path; *p; ) {
+                int len = strchrnul(p, '/') - p;
+
+                if (!len || (p[0] == '.' && (len == 1 || (len == 2 && p[1] == '.'))))
+                    return -EINVAL;
+                parent = s2fs_image_dir(sb, parent, p, len);
+                if (IS_ERR(parent))
+                    return PTR_ERR(parent);
+                p += len + (p[len] == '/');
+            }
+            strscpy(last_dir, path, PATH_MAX);
+            *last_parent = parent;
+        }
+    }
+    if (!*name || !strcmp(name, ".") || !strcmp(name, ".."))
+        return -EINVAL;
+
+    if (S_ISDIR(mode)) {
+        dentry = s2fs_image_dir(sb, parent, name, strlen(name));
+        if (IS_ERR(dentry))
+            return PTR_ERR(dentry);
+    } else {
+        struct qstr qname = QSTR_INIT(name, strlen(name));
+
+        dentry = d_hash_and_lookup(parent, &qname);
+        if (dentry) {
+            if (!IS_ERR(dentry))
+                dput(dentry);
+            return -EEXIST;
+        }
+        if (nlink > 1) {
+            first = xa_load(links, ino);
+            for (link = first; link && (link->major != major || link->minor != minor); link = link->next)
+                ;
+        }
+        if (link) {
+            dentry = s2fs_image_link(parent, name, link->inode);
+            if (IS_ERR(dentry))
+                return PTR_ERR(dentry);
+        } else {
+            dentry = s2fs_create_file(sb, parent, name);
+            if (!dentry)
+                return -ENOSPC;
+        }
+        if (nlink > 1 && !link) {
+            link = kmalloc(sizeof(*link), GFP_KERNEL);
+            if (!link)
+                return -ENOMEM;
+            *link = (struct s2fs_image_link){ major, minor, d_inode(dentry), first };
+            if (xa_is_err(xa_store(links, ino, link, GFP_KERNEL))) {
+                kfree(link);
+                return -ENOMEM;
+            }
+        }
+    }
+
+    inode = d_inode(dentry);
+    inode->i_mode = (inode->i_mode & S_IFMT) | (mode & ~S_IFMT);
+    inode->i_uid = make_kuid(sb->s_user_ns, uid);
+    inode->i_gid = make_kgid(sb->s_user_ns, gid);
+    inode->i_mtime = inode->i_ctime = (struct timespec64){ .tv_sec = mtime };
+    // Only one name of a hard-linked file has the data, and it may come first or last.
+    if (S_ISREG(mode) && size) {
+        S2FS_I(inode)->image_off = data_off;
+        S2FS_I(inode)->image_len = size;
+        i_size_write(inode, size);
+    }
+    return 0;
+}
+
+static int s2fs_load_image(struct super_block *sb, const char *path) {
+    struct s2fs_image_reader r = {};
+    struct dentry *last_parent = NULL;
+    struct xarray links;
+    unsigned long namesize, filesize;
+    char *last_dir = NULL, *name = NULL;
+    unsigned long files = 0;
+    const char *hdr, *p;
+    loff_t pos = 0;
+    int ret;
+
+    xa_init(&links);
+    r.file = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+    if (IS_ERR(r.file)) {
+        printk(KERN_ERR "s2fs: Cannot open image %s\n", path);
+        return PTR_ERR(r.file);
+    }
+    if (!S_ISREG(file_inode(r.file)->i_mode)) {
+        fput(r.file);
+        return -EINVAL;
+    }
+    S2FS_SB(sb)->image = r.file; // Dropped in kill_sb.
+
+    r.buf = kvmalloc(S2FS_CPIO_BUF_SIZE, GFP_KERNEL);
+    name = kmalloc(PATH_MAX, GFP_KERNEL);
+    last_dir = kmalloc(PATH_MAX, GFP_KERNEL);
+    ret = -ENOMEM;
+    if (!r.buf || !name || !last_dir)
+        goto out;
+
+    for (;;) {
+        hdr = s2fs_image_peek(&r, pos, S2FS_CPIO_HDR_LEN);
+        ret = PTR_ERR_OR_ZERO(hdr);
+        if (ret)
+            break;
+        ret = -EINVAL;
+        if (memcmp(hdr, "070701", 6) && memcmp(hdr, "070702", 6))
+            break;
+        if (s2fs_cpio_field(hdr, 11, &namesize) || s2fs_cpio_field(hdr, 6, &filesize) ||
+            !namesize || namesize > PATH_MAX)
+            break;
+
+        // Header and name together, so the header stays valid if the buffer is refilled.
+        hdr = s2fs_image_peek(&r, pos, S2FS_CPIO_HDR_LEN + namesize);
+        ret = PTR_ERR_OR_ZERO(hdr);
+        if (ret)
+            break;
+        p = hdr + S2FS_CPIO_HDR_LEN;
+        ret = -EINVAL;
+        if (p[namesize - 1] != '\0')
+            break;
+        if (!strcmp(p, "TRAILER!!!")) {
+            ret = 0;
+            break;
+        }
+        memcpy(name, p, namesize);
+
+        pos = ALIGN(pos + S2FS_CPIO_HDR_LEN + namesize, 4);
+        ret = s2fs_image_add(sb, name, hdr, pos, last_dir, &last_parent, &links);
+        if (ret)
+            break;
+        pos = ALIGN(pos + filesize, 4);
+        files++;
+        cond_resched();
+    }
+
+    if (ret)
+        printk(KERN_ERR "s2fs: Bad image %s at offset %lld (%d)\n", path, pos, ret);
+    else
+        printk(KERN_INFO "s2fs: Loaded %lu entries from %s\n", files, path);
+out:
+    s2fs_image_links_free(&links);
+    kfree(last_dir);
+    kfree(name);
+    kvfree(r.buf);
+    return ret;
+}
+
+// Checkpoints
+// ckpt= keeps the mount in a log file across unmounts and reboots. The log is a sequence of
+// segments, each written by one checkpoint: a begin record, records for the inodes that
+// changed since the last checkpoint and for their changed pages, records for the inodes
+// removed meanwhile, and a commit record. The commit record is only written once everything
+// before it is on disk, and carries a CRC of the segment's records (page data aside), so a
+// torn segment is recognised and dropped at the next mount along with everything after it.
+//
+// Each inode has an ID that names it in the log, and a record gives its parent's ID and its
+// name, so renaming a directory logs only that directory. Page data sits page-aligned in the
+// log: restoring replays the records into a table, builds the tree from it and points each
+// file page at its latest copy in the log, to be read on first access like image data.
+//
+// Changes are tracked per page, as a write or the first store through a mapping dirties it.
+// A checkpoint runs in a worker and never holds a lock writers wait for longer than it
+// takes to copy one page: it locks the folio, write-protects it in every mapping so the next
+// store faults and marks the page again, copies it aside and unlocks it before writing.
+// The log grows by what changed in each checkpoint, until it is compacted (see
+// s2fs_ckpt_compact()).
+//
+// A punched hole is logged as a range, which makes earlier copies of its pages stale.
+#define S2FS_CKPT_MAGIC 0x53324350 // "S2CP"
+#define S2FS_CKPT_VERSION 2        // Version 2 added hole records; version 1 logs still replay.
+#define S2FS_CKPT_BUF_SIZE SZ_64K
+
+enum {
+    S2FS_CKPT_BEGIN = 1,
+    S2FS_CKPT_INODE,
+    S2FS_CKPT_PAGE,
+    S2FS_CKPT_DELETE,
+    S2FS_CKPT_COMMIT,
+    S2FS_CKPT_HOLE,
+};
+
+// Every record starts with this header; len covers the whole record and is a multiple of 8.
+struct s2fs_ckpt_rec {
+    __le32 type;
+    __le32 len;
+};
+
+struct s2fs_ckpt_begin {
+    __le32 magic;
+    __le32 version;
+    __le64 seq;
+};
+
+// Followed by the name. Pages from trunc on, logged by earlier segments, are stale; the
+// pages logged after this record in the same segment are not.
+struct s2fs_ckpt_inode {
+    __le64 id;
+    __le64 parent; // 0 for the root
+    __le64 size;
+    __le64 trunc;
+    __le64 mtime;
+    __le64 ctime;
+    __le32 mtime_nsec;
+    __le32 ctime_nsec;
+    __le32 mode;
+    __le32 uid;
+    __le32 gid;
+    __le32 namelen;
+    char name[];
+};
+
+// The page's data starts at the next page boundary of the log and ends the record.
+struct s2fs_ckpt_page {
+    __le64 id;
+    __le64 index;
+};
+
+struct s2fs_ckpt_delete {
+    __le64 id;
+};
+
+// Pages first..last, logged by earlier segments, are stale; the pages logged after this
+// record in the same segment are not.
+struct s2fs_ckpt_hole {
+    __le64 id;
+    __le64 first;
+    __le64 last;
+};
+
+struct s2fs_ckpt_commit {
+    __le64 seq;
+    __le32 crc;
+    __le32 records;
+};
+
+// Tracking
+static inline bool s2fs_ckpt_tracked(struct inode *inode) {
+    return S2FS_SB(inode->i_sb)->ckpt && S2FS_I(inode)->ckpt_id;
+}
+
+// Queues inode for the next checkpoint. Writers usually find it queued already, so that case
+// is checked without the lock; a checkpoint that takes the inode off the list just before
+// still sees the change, since it looks at the inode only after.
+static void s2fs_ckpt_mark(struct inode *inode) {
+    struct s2fs_sb_info *sbi = S2FS_SB(inode->i_sb);
+    struct s2fs_inode_info *info = S2FS_I(inode);
+
+    if (!s2fs_ckpt_tracked(inode))
+        return;
+    smp_mb();
+    if (!list_empty(&info->ckpt_dirty))
+        return;
+
+    spin_lock(&sbi->ckpt_lock);
+    if (list_empty(&info->ckpt_dirty))
+        list_add_tail(&info->ckpt_dirty, &sbi->ckpt_dirty);
+    spin_unlock(&sbi->ckpt_lock);
+}
+
+// Pages first..last of inode changed. If there is no memory to track them, the next
+// checkpoint logs every cached page of the inode instead.
+static void s2fs_ckpt_dirty(struct inode *inode, pgoff_t first, pgoff_t last) {
+    struct s2fs_inode_info *info = S2FS_I(inode);
+
+    if (!s2fs_ckpt_tracked(inode))
+        return;
+    for (; first <= last; first++) {
+        if (xa_load(&info->ckpt_pages, first))
+            continue;
+        if (xa_is_err(xa_store(&info->ckpt_pages, first, xa_mk_value(0), GFP_NOFS))) {
+            set_bit(S2FS_CKPT_ALL, &info->ckpt_flags);
+            break;
+        }
+    }
+    s2fs_ckpt_mark(inode);
+}
+
+// The file shrank to size. Earlier copies of the pages past it become stale, and the page
+// size falls in is logged again with its tail zeroed.
+static void s2fs_ckpt_truncate(struct inode *inode, loff_t size) {
+    struct s2fs_inode_info *info = S2FS_I(inode);
+
+    spin_lock(&inode->i_lock);
+    info->ckpt_trunc = min(info->ckpt_trunc, size);
+    info->ckpt_len = min(info->ckpt_len, size);
+    spin_unlock(&inode->i_lock);
+    if (offset_in_page(size))
+        s2fs_ckpt_dirty(inode, size >> PAGE_SHIFT, size >> PAGE_SHIFT);
+}
+
+// inode is about to be removed, so the next checkpoint logs its deletion. Recorded up front,
+// where the removal can still fail for lack of memory.
+static int s2fs_ckpt_forget(struct inode *inode) {
+    if (!s2fs_ckpt_tracked(inode))
+        return 0;
+    return xa_insert(&S2FS_SB(inode->i_sb)->ckpt_deleted, S2FS_I(inode)->ckpt_id, xa_mk_value(0), GFP_KERNEL);
+}
+
+static void s2fs_ckpt_unforget(struct inode *inode) {
+    if (s2fs_ckpt_tracked(inode))
+        xa_erase(&S2FS_SB(inode->i_sb)->ckpt_deleted, S2FS_I(inode)->ckpt_id);
+}
+
+// Takes inode off whichever list it is on.
+static void s2fs_ckpt_clean(struct inode *inode) {
+    struct s2fs_sb_info *sbi = S2FS_SB(inode->i_sb);
+    struct s2fs_inode_info *info = S2FS_I(inode);
+
+    if (list_empty_careful(&info->ckpt_dirty))
+        return;
+    spin_lock(&sbi->ckpt_lock);
+    list_del_init(&info->ckpt_dirty);
+    spin_unlock(&sbi->ckpt_lock);
+}
+
+// A hole punched since the last checkpoint, on the inode's ckpt_holes.
+struct s2fs_hole {
+    struct list_head list;
+    pgoff_t first;
+    pgoff_t last;
+};
+
+// Pages first..last of inode were punched out. Their copies in the log become stale, and
+// the next checkpoint records that; if there is no memory to remember the range, it logs
+// every hole and cached page of the inode instead.
+static void s2fs_ckpt_punch(struct inode *inode, pgoff_t first, pgoff_t last) {
+    struct s2fs_inode_info *info = S2FS_I(inode);
+    struct s2fs_hole *hole;
+    unsigned long index;
+    void *entry;
+
+    if (!s2fs_ckpt_tracked(inode))
+        return;
+    xa_for_each_range(&info->ckpt_map, index, entry, first, last)
+        xa_erase(&info->ckpt_map, index);
+    xa_for_each_range(&info->ckpt_pages, index, entry, first, last)
+        xa_erase(&info->ckpt_pages, index);
+
+    hole = kmalloc(sizeof(*hole), GFP_KERNEL);
+    if (hole) {
+        hole->first = first;
+        hole->last = last;
+        spin_lock(&inode->i_lock);
+        list_add_tail(&hole->list, &info->ckpt_holes);
+        spin_unlock(&inode->i_lock);
+    } else {
+        set_bit(S2FS_CKPT_ALL, &info->ckpt_flags);
+    }
+    s2fs_ckpt_mark(inode);
+}
+
+static void s2fs_ckpt_free_holes(struct list_head *holes) {
+    struct s2fs_hole *hole, *tmp;
+
+    list_for_each_entry_safe(hole, tmp, holes, list)
+        kfree(hole);
+    INIT_LIST_HEAD(holes);
+}
+
+static void s2fs_ckpt_evict(struct inode *inode) {
+    s2fs_ckpt_clean(inode);
+    s2fs_ckpt_free_holes(&S2FS_I(inode)->ckpt_holes);
+    xa_destroy(&S2FS_I(inode)->ckpt_pages);
+    xa_destroy(&S2FS_I(inode)->ckpt_map);
+}
+
+// Queues every tracked inode to have all its cached pages logged, after a failed checkpoint
+// left the log behind what was already taken off the lists.
+static int s2fs_ckpt_mark_one(struct inode *inode, void *arg) {
+    if (!S2FS_I(inode)->ckpt_id)
+        return 0;
+    set_bit(S2FS_CKPT_ALL, &S2FS_I(inode)->ckpt_flags);
+    s2fs_ckpt_mark(inode);
+    return 0;
+}
+
+static void s2fs_ckpt_mark_all(struct super_block *sb) {
+    s2fs_for_each_inode(sb, s2fs_ckpt_mark_one, NULL);
+}
+
+// Adds every cached page of inode to its changed pages, and every page held compressed or
+// shared, plus the page its restored data ends in, which the logged size makes stale.
+static int s2fs_ckpt_dirty_cached(struct inode *inode) {
+    struct s2fs_inode_info *info = S2FS_I(inode);
+    struct folio_batch fbatch;
+    pgoff_t index = 0;
+    unsigned int i;
+    void *entry;
+
+    folio_batch_init(&fbatch);
+    while (filemap_get_folios(inode->i_mapping, &index, ULONG_MAX, &fbatch)) {
+        for (i = 0; i < folio_batch_count(&fbatch); i++) {
+            struct folio *folio = fbatch.folios[i];
+
+            s2fs_ckpt_dirty(inode, folio->index, folio->index + folio_nr_pages(folio) - 1);
+        }
+        folio_batch_release(&fbatch);
+        cond_resched();
+    }
+    // Compressed pages have left the page cache, so the walk above does not see them.
+    xa_for_each(&info->zmap, index, entry)
+        s2fs_ckpt_dirty(inode, index, index);
+    if (offset_in_page(info->ckpt_len))
+        s2fs_ckpt_dirty(inode, info->ckpt_len >> PAGE_SHIFT, info->ckpt_len >> PAGE_SHIFT);
+    return test_and_clear_bit(S2FS_CKPT_ALL, &info->ckpt_flags) ? -ENOMEM : 0;
+}
+
+// Writing
+// Records are staged in buf and written out when it fills. crc covers what the commit
+// record vouches for.
+struct s2fs_ckpt_writer {
+    struct file *file;
+    loff_t pos;      // Log offset of buf[0].
+    char *buf;
+    size_t len;
+    void *page;      // Copy of the page being logged.
+    u32 crc;
+    u32 records;
+};
+
+static inline loff_t s2fs_ckpt_tell(struct s2fs_ckpt_writer *w) {
+    return w->pos + w->len;
+}
+
+static int s2fs_ckpt_flush(struct s2fs_ckpt_writer *w) {
+    loff_t pos = w->pos;
+    ssize_t n;
+
+    if (!w->len)
+        return 0;
+    n = kernel_write(w->file, w->buf, w->len, &pos);
+    if (n != w->len)
+        return n < 0 ? n : -EIO;
+    w->pos += w->len;
+    w->len = 0;
+    return 0;
+}
+
+// Appends len bytes of data, or of zeros if data is NULL.
+static int s2fs_ckpt_append(struct s2fs_ckpt_writer *w, const void *data, size_t len, bool crc) {
+    int ret;
+
+    while (len) {
+        size_t n = min(len, S2FS_CKPT_BUF_SIZE - w->len);
+
+        if (data)
+            memcpy(w->buf + w->len, data, n);
+        else
+            memset(w->buf + w->len, 0, n);
+        if (crc)
+            w->crc = crc32_le(w->crc, w->buf + w->len, n);
+        w->len += n;
+        len -= n;
+        if (data)
+            data += n;
+        if (w->len == S2FS_CKPT_BUF_SIZE) {
+            ret = s2fs_ckpt_flush(w);
+            if (ret)
+                return ret;
+        }
+    }
+    return 0;
+}
+
+static int s2fs_ckpt_record(struct s2fs_ckpt_writer *w, u32 type, const void *body, size_t body_len,
+                            const void *name, size_t name_len) {
+    size_t len = sizeof(struct s2fs_ckpt_rec) + body_len + name_len;
+    struct s2fs_ckpt_rec hdr = {
+        .type = cpu_to_le32(type),
+        .len = cpu_to_le32(ALIGN(len, 8)),
+    };
+    int ret;
+
+    ret = s2fs_ckpt_append(w, &hdr, sizeof(hdr), true);
+    if (!ret)
+        ret = s2fs_ckpt_append(w, body, body_len, true);
+    if (!ret)
+        ret = s2fs_ckpt_append(w, name, name_len, true);
+    if (!ret)
+        ret = s2fs_ckpt_append(w, NULL, ALIGN(len, 8) - len, true);
+    w->records++;
+    return ret;
+}
+
+// Copies page index of inode to buf from the log, if it is restored data that was never read
+// in. Returns 1 if it is not.
+static int s2fs_ckpt_copy_restored(struct inode *inode, pgoff_t index, void *buf) {
+    struct s2fs_inode_info *info = S2FS_I(inode);
+    loff_t pos = (loff_t)index << PAGE_SHIFT, ckpt_len = READ_ONCE(info->ckpt_len), log_pos;
+    void *entry = xa_load(&info->ckpt_map, index);
+    ssize_t n;
+
+    if (!entry || pos >= ckpt_len || xa_load(&info->zmap, index))
+        return 1;
+    log_pos = (loff_t)xa_to_value(entry) << PAGE_SHIFT;
+    n = kernel_read(S2FS_SB(inode->i_sb)->ckpt, buf, min_t(loff_t, PAGE_SIZE, ckpt_len - pos), &log_pos);
+    if (n < 0)
+        return n;
+    memset(buf + n, 0, PAGE_SIZE - n);
+    return 0;
+}
+
+// Logs page index of inode. A page that is not cached is copied from the log if it is
+// restored data, and read in otherwise.
+static int s2fs_ckpt_page(struct s2fs_ckpt_writer *w, struct inode *inode, pgoff_t index) {
+    struct address_space *mapping = inode->i_mapping;
+    struct s2fs_ckpt_page rec = {
+        .id = cpu_to_le64(S2FS_I(inode)->ckpt_id),
+        .index = cpu_to_le64(index),
+    };
+    size_t head = sizeof(struct s2fs_ckpt_rec) + sizeof(rec);
+    loff_t start = s2fs_ckpt_tell(w);
+    loff_t data = ALIGN(start + head, PAGE_SIZE);
+    struct s2fs_ckpt_rec hdr = {
+        .type = cpu_to_le32(S2FS_CKPT_PAGE),
+        .len = cpu_to_le32(data + PAGE_SIZE - start),
+    };
+    struct folio *folio;
+    void *kaddr;
+    int ret;
+
+    folio = filemap_lock_folio(mapping, index);
+    if (!folio) {
+        ret = s2fs_ckpt_copy_restored(inode, index, w->page);
+        if (ret < 0)
+            return ret;
+        if (!ret)
+            goto copied;
+        folio = read_mapping_folio(mapping, index, NULL);
+        if (IS_ERR(folio))
+            return PTR_ERR(folio);
+        folio_lock(folio);
+        if (folio->mapping != mapping) {
+            folio_unlock(folio);
+            folio_put(folio);
+            return 0;
+        }
+    }
+    folio_mkclean(folio);
+    kaddr = kmap_local_folio(folio, (index - folio->index) * PAGE_SIZE);
+    memcpy(w->page, kaddr, PAGE_SIZE);
+    kunmap_local(kaddr);
+    folio_unlock(folio);
+    folio_put(folio);
+
+copied:
+    ret = s2fs_ckpt_append(w, &hdr, sizeof(hdr), true);
+    if (!ret)
+        ret = s2fs_ckpt_append(w, &rec, sizeof(rec), true);
+    if (!ret)
+        ret = s2fs_ckpt_append(w, NULL, data - start - head, false);
+    if (!ret)
+        ret = s2fs_ckpt_append(w, w->page, PAGE_SIZE, false);
+    w->records++;
+    return ret;
+}
+
+static int s2fs_ckpt_hole(struct s2fs_ckpt_writer *w, struct inode *inode, pgoff_t first, pgoff_t last) {
+    struct s2fs_ckpt_hole rec = {
+        .id = cpu_to_le64(S2FS_I(inode)->ckpt_id),
+        .first = cpu_to_le64(first),
+        .last = cpu_to_le64(last),
+    };
+
+    return s2fs_ckpt_record(w, S2FS_CKPT_HOLE, &rec, sizeof(rec), NULL, 0);
+}
+
+// Logs the holes punched in inode since the last checkpoint. With all, the punches that went
+// with a failed checkpoint may be missing from those, so every hole below trunc is logged
+// instead: earlier segments may still hold copies of those pages, and none past trunc.
+static int s2fs_ckpt_holes(struct s2fs_ckpt_writer *w, struct inode *inode, bool all, loff_t trunc) {
+    struct s2fs_inode_info *info = S2FS_I(inode);
+    unsigned long index = 0, end = DIV_ROUND_UP(trunc, PAGE_SIZE);
+    struct s2fs_hole *hole;
+    LIST_HEAD(holes);
+    int ret = 0;
+
+    spin_lock(&inode->i_lock);
+    list_splice_init(&info->ckpt_holes, &holes);
+    spin_unlock(&inode->i_lock);
+
+    if (!all) {
+        list_for_each_entry(hole, &holes, list) {
+            ret = s2fs_ckpt_hole(w, inode, hole->first, hole->last);
+            if (ret)
+                break;
+        }
+    }
+    while (all && !ret && index < end) {
+        MA_STATE(mas, &info->holes, index, index);
+        unsigned long first, last;
+        void *entry;
+
+        rcu_read_lock();
+        entry = mas_find(&mas, end - 1);
+        first = mas.index;
+        last = mas.last;
+        rcu_read_unlock();
+        if (!entry)
+            break;
+        ret = s2fs_ckpt_hole(w, inode, max(first, index), min(last, end - 1));
+        if (last >= end - 1)
+            break;
+        index = last + 1;
+    }
+    s2fs_ckpt_free_holes(&holes);
+    return ret;
+}
+
+// Fills in the parent of inode in rec, and its name. Both are read together under the dentry
+// lock, which a rename holds while changing both. Returns the length of the name, or
+// -ENOENT for an inode with no name left.
+static int s2fs_ckpt_name(struct inode *inode, struct s2fs_ckpt_inode *rec, char *name) {
+    struct dentry *dentry;
+    u32 namelen = 0;
+
+    // An unlinked inode is logged only as deleted, however long it stays open.
+    if (!inode->i_nlink)
+        return -ENOENT;
+    dentry = d_find_alias(inode);
+    if (!dentry)
+        return -ENOENT;
+    spin_lock(&dentry->d_lock);
+    if (!IS_ROOT(dentry)) {
+        rec->parent = cpu_to_le64(S2FS_I(d_inode(dentry->d_parent))->ckpt_id);
+        namelen = dentry->d_name.len;
+        memcpy(name, dentry->d_name.name, namelen);
+    }
+    spin_unlock(&dentry->d_lock);
+    dput(dentry);
+    return namelen;
+}
+
+// Fills in the rest of rec but trunc.
+static void s2fs_ckpt_attrs(struct inode *inode, struct s2fs_ckpt_inode *rec, u32 namelen) {
+    struct super_block *sb = inode->i_sb;
+
+    rec->id = cpu_to_le64(S2FS_I(inode)->ckpt_id);
+    rec->size = cpu_to_le64(i_size_read(inode));
+    rec->mtime = cpu_to_le64(inode->i_mtime.tv_sec);
+    rec->mtime_nsec = cpu_to_le32(inode->i_mtime.tv_nsec);
+    rec->ctime = cpu_to_le64(inode->i_ctime.tv_sec);
+    rec->ctime_nsec = cpu_to_le32(inode->i_ctime.tv_nsec);
+    rec->mode = cpu_to_le32(inode->i_mode);
+    rec->uid = cpu_to_le32(from_kuid(sb->s_user_ns, inode->i_uid));
+    rec->gid = cpu_to_le32(from_kgid(sb->s_user_ns, inode->i_gid));
+    rec->namelen = cpu_to_le32(namelen);
+}
+
+// Logs inode, its holes and its changed pages.
+static int s2fs_ckpt_inode(struct s2fs_ckpt_writer *w, struct inode *inode) {
+    struct s2fs_inode_info *info = S2FS_I(inode);
+    struct s2fs_ckpt_inode rec = {};
+    char name[NAME_MAX];
+    unsigned long index;
+    int namelen, ret;
+    loff_t trunc;
+    void *entry;
+    bool all;
+
+    namelen = s2fs_ckpt_name(inode, &rec, name);
+    if (namelen < 0)
+        return 0;
+
+    // Logging every page makes every earlier copy stale, apart from restored data not cached.
+    all = test_and_clear_bit(S2FS_CKPT_ALL, &info->ckpt_flags);
+    if (all) {
+        ret = s2fs_ckpt_dirty_cached(inode);
+        if (ret)
+            return ret;
+    }
+    spin_lock(&inode->i_lock);
+    trunc = all ? min(info->ckpt_trunc, info->ckpt_len) : info->ckpt_trunc;
+    info->ckpt_trunc = LLONG_MAX;
+    spin_unlock(&inode->i_lock);
+
+    s2fs_ckpt_attrs(inode, &rec, namelen);
+    rec.trunc = cpu_to_le64(trunc);
+    ret = s2fs_ckpt_record(w, S2FS_CKPT_INODE, &rec, sizeof(rec), name, namelen);
+    if (!ret)
+        ret = s2fs_ckpt_holes(w, inode, all, trunc);
+    if (ret)
+        return ret;
+
+    // A page written again from here on is marked again and logged next time as well.
+    xa_for_each(&info->ckpt_pages, index, entry) {
+        xa_erase(&info->ckpt_pages, index);
+        if ((loff_t)index << PAGE_SHIFT >= i_size_read(inode))
+            continue;
+        ret = s2fs_ckpt_page(w, inode, index);
+        if (ret)
+            return ret;
+        cond_resched();
+    }
+    return 0;
+}
+
+// The next inode of the batch, with a reference. Inodes being evicted are skipped; eviction
+// takes them off the batch itself.
+static struct inode *s2fs_ckpt_next(struct s2fs_sb_info *sbi) {
+    struct s2fs_inode_info *info;
+    struct inode *inode = NULL;
+
+    spin_lock(&sbi->ckpt_lock);
+    while (!inode && !list_empty(&sbi->ckpt_batch)) {
+        info = list_first_entry(&sbi->ckpt_batch, struct s2fs_inode_info, ckpt_dirty);
+        list_del_init(&info->ckpt_dirty);
+        inode = igrab(&info->vfs_inode);
+    }
+    spin_unlock(&sbi->ckpt_lock);
+    return inode;
+}
+
+static int s2fs_ckpt_begin(struct s2fs_ckpt_writer *w, u64 seq) {
+    struct s2fs_ckpt_begin begin = {
+        .magic = cpu_to_le32(S2FS_CKPT_MAGIC),
+        .version = cpu_to_le32(S2FS_CKPT_VERSION),
+        .seq = cpu_to_le64(seq),
+    };
+
+    return s2fs_ckpt_record(w, S2FS_CKPT_BEGIN, &begin, sizeof(begin), NULL, 0);
+}
+
+// Ends the segment numbered seq. The commit record goes to disk strictly after what it
+// vouches for.
+static int s2fs_ckpt_commit(struct s2fs_ckpt_writer *w, u64 seq) {
+    struct s2fs_ckpt_commit commit;
+    struct s2fs_ckpt_rec hdr;
+    int ret;
+
+    ret = s2fs_ckpt_flush(w);
+    if (!ret)
+        ret = vfs_fsync(w->file, 0);
+    if (ret)
+        return ret;
+    commit.seq = cpu_to_le64(seq);
+    commit.crc = cpu_to_le32(w->crc);
+    commit.records = cpu_to_le32(w->records);
+    hdr.type = cpu_to_le32(S2FS_CKPT_COMMIT);
+    hdr.len = cpu_to_le32(sizeof(hdr) + sizeof(commit));
+    ret = s2fs_ckpt_append(w, &hdr, sizeof(hdr), false);
+    if (!ret)
+        ret = s2fs_ckpt_append(w, &commit, sizeof(commit), false);
+    if (!ret)
+        ret = s2fs_ckpt_flush(w);
+    if (!ret)
+        ret = vfs_fsync(w->file, 0);
+    return ret;
+}
+
+// Appends one segment with everything that changed since the last one, then compacts the
+// log if it has grown too large. After a failure the segment is cut off again and the next
+// checkpoint logs everything. The log is truncated as the mounter, not as whoever called
+// syncfs or unmounted.
+static int s2fs_checkpoint(struct super_block *sb) {
+    struct s2fs_sb_info *sbi = S2FS_SB(sb);
+    struct s2fs_ckpt_writer w = { .file = sbi->ckpt, .crc = ~0 };
+    struct s2fs_ckpt_delete del;
+    const struct cred *cred;
+    struct inode *inode;
+    unsigned long id;
+    void *entry;
+    bool empty;
+    int ret, err;
+
+    mutex_lock(&sbi->ckpt_mutex);
+    if (sbi->ckpt_full) {
+        s2fs_ckpt_mark_all(sb);
+        sbi->ckpt_full = false;
+    }
+    spin_lock(&sbi->ckpt_lock);
+    empty = list_empty(&sbi->ckpt_dirty) && xa_empty(&sbi->ckpt_deleted);
+    list_splice_init(&sbi->ckpt_dirty, &sbi->ckpt_batch);
+    spin_unlock(&sbi->ckpt_lock);
+    ret = 0;
+    if (empty)
+        goto out;
+
+    w.pos = sbi->ckpt_pos;
+    w.buf = kvmalloc(S2FS_CKPT_BUF_SIZE, GFP_KERNEL);
+    w.page = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    ret = -ENOMEM;
+    if (!w.buf || !w.page)
+        goto fail;
+
+    ret = s2fs_ckpt_begin(&w, sbi->ckpt_seq);
+    if (ret)
+        goto fail;
+
+    while ((inode = s2fs_ckpt_next(sbi))) {
+        ret = s2fs_ckpt_inode(&w, inode);
+        iput(inode);
+        if (ret)
+            goto fail;
+    }
+
+    // Deletions are marked as they are logged, so ones that come in meanwhile stay queued.
+    xa_for_each(&sbi->ckpt_deleted, id, entry) {
+        del.id = cpu_to_le64(id);
+        ret = s2fs_ckpt_record(&w, S2FS_CKPT_DELETE, &del, sizeof(del), NULL, 0);
+        if (ret)
+            goto fail;
+        xa_set_mark(&sbi->ckpt_deleted, id, XA_MARK_0);
+    }
+
+    ret = s2fs_ckpt_commit(&w, sbi->ckpt_seq);
+    if (ret)
+        goto fail;
+
+    sbi->ckpt_pos = w.pos;
+    sbi->ckpt_seq++;
+    xa_for_each_marked(&sbi->ckpt_deleted, id, entry, XA_MARK_0)
+        xa_erase(&sbi->ckpt_deleted, id);
+
+    if (s2fs_ckpt_bloated(sbi)) {
+        err = s2fs_ckpt_compact(sb);
+        if (err) {
+            printk(KERN_ERR "s2fs: Compacting %s failed (%d)\n", sbi->ckpt_path, err);
+            // Not tried again until the log has grown as much once more.
+            sbi->ckpt_live = sbi->ckpt_pos;
+        }
+    }
+    goto out;
+
+fail:
+    printk(KERN_ERR "s2fs: Checkpoint %llu to %s failed (%d)\n", sbi->ckpt_seq, sbi->ckpt_path, ret);
+    spin_lock(&sbi->ckpt_lock);
+    list_splice_init(&sbi->ckpt_batch, &sbi->ckpt_dirty);
+    spin_unlock(&sbi->ckpt_lock);
+    sbi->ckpt_full = true;
+    // Should this fail as well, the next segment still starts at ckpt_pos. Whatever of the
+    // torn one it leaves behind has no begin record, so a restore stops at it.
+    cred = override_creds(sbi->ckpt_cred);
+    err = vfs_truncate(&sbi->ckpt->f_path, sbi->ckpt_pos);
+    revert_creds(cred);
+    if (err)
+        printk(KERN_ERR "s2fs: Cannot cut %s back to %lld (%d)\n", sbi->ckpt_path, sbi->ckpt_pos, err);
+out:
+    mutex_unlock(&sbi->ckpt_mutex);
+    kfree(w.page);
+    kvfree(w.buf);
+    return ret;
+}
+
+static void s2fs_ckpt_work(struct work_struct *work) {
+    struct s2fs_sb_info *sbi = container_of(to_delayed_work(work), struct s2fs_sb_info, ckpt_work);
+    unsigned int interval;
+
+    s2fs_checkpoint(sbi->sb);
+    interval = READ_ONCE(sbi->ckpt_interval);
+    if (interval)
+        queue_delayed_work(system_long_wq, &sbi->ckpt_work, interval * HZ);
+}
+
+// Restoring
+// Replaying the records of the log builds one node per live inode: its latest attributes,
+// name and parent, and where the latest copy of each of its pages is.
+struct s2fs_ckpt_node {
+    unsigned long id;
+    unsigned long parent;
+    char *name;
+    umode_t mode;
+    u32 uid;
+    u32 gid;
+    loff_t size;
+    struct timespec64 mtime;
+    struct timespec64 ctime;
+    struct xarray pages;   // Page index -> log page.
+    struct dentry *dentry; // Once created.
+};
+
+static void s2fs_ckpt_free_node(struct s2fs_ckpt_node *node) {
+    xa_destroy(&node->pages);
+    kfree(node->name);
+    kfree(node);
+}
+
+static int s2fs_ckpt_replay_inode(struct xarray *nodes, const struct s2fs_ckpt_inode *rec, size_t len) {
+    unsigned long id = le64_to_cpu(rec->id), index;
+    u32 namelen = le32_to_cpu(rec->namelen);
+    struct s2fs_ckpt_node *node;
+    void *entry;
+    char *name;
+
+    if (!id || namelen > NAME_MAX || sizeof(*rec) + namelen > len)
+        return -EINVAL;
+    node = xa_load(nodes, id);
+    if (!node) {
+        node = kzalloc(sizeof(*node), GFP_KERNEL);
+        if (!node)
+            return -ENOMEM;
+        node->id = id;
+        xa_init(&node->pages);
+        if (xa_is_err(xa_store(nodes, id, node, GFP_KERNEL))) {
+            kfree(node);
+            return -ENOMEM;
+        }
+    }
+    name = kmemdup_nul(rec->name, namelen, GFP_KERNEL);
+    if (!name)
+        return -ENOMEM;
+    kfree(node->name);
+    node->name = name;
+    node->parent = le64_to_cpu(rec->parent);
+    node->mode = le32_to_cpu(rec->mode);
+    node->uid = le32_to_cpu(rec->uid);
+    node->gid = le32_to_cpu(rec->gid);
+    node->size = le64_to_cpu(rec->size);
+    node->mtime.tv_sec = le64_to_cpu(rec->mtime);
+    node->mtime.tv_nsec = le32_to_cpu(rec->mtime_nsec);
+    node->ctime.tv_sec = le64_to_cpu(rec->ctime);
+    node->ctime.tv_nsec = le32_to_cpu(rec->ctime_nsec);
+
+    xa_for_each_start(&node->pages, index, entry, le64_to_cpu(rec->trunc) >> PAGE_SHIFT)
+        xa_erase(&node->pages, index);
+    return 0;
+}
+
+static int s2fs_ckpt_replay_page(struct xarray *nodes, const struct s2fs_ckpt_page *rec, loff_t data) {
+    struct s2fs_ckpt_node *node = xa_load(nodes, le64_to_cpu(rec->id));
+
+    if (!node)
+        return -EINVAL;
+    return xa_err(xa_store(&node->pages, le64_to_cpu(rec->index), xa_mk_value(data >> PAGE_SHIFT), GFP_KERNEL));
+}
+
+static int s2fs_ckpt_replay_hole(struct xarray *nodes, const struct s2fs_ckpt_hole *rec) {
+    struct s2fs_ckpt_node *node = xa_load(nodes, le64_to_cpu(rec->id));
+    unsigned long index;
+    void *entry;
+
+    if (!node)
+        return -EINVAL;
+    xa_for_each_range(&node->pages, index, entry, le64_to_cpu(rec->first), le64_to_cpu(rec->last))
+        xa_erase(&node->pages, index);
+    return 0;
+}
+
+static void s2fs_ckpt_replay_delete(struct xarray *nodes, const struct s2fs_ckpt_delete *rec) {
+    struct s2fs_ckpt_node *node = xa_erase(nodes, le64_to_cpu(rec->id));
+
+    if (node)
+        s2fs_ckpt_free_node(node);
+}
+
+// Reads the segment at pos, which must be numbered seq, and returns the offset just past
+// it. Only checks it if nodes is NULL, and replays it into nodes otherwise. The log is read
+// through the same buffered reader as an image.
+static loff_t s2fs_ckpt_segment(struct s2fs_image_reader *r, loff_t pos, loff_t end, u64 seq, struct xarray *nodes) {
+    const struct s2fs_ckpt_commit *commit;
+    const struct s2fs_ckpt_begin *begin;
+    const struct s2fs_ckpt_rec *hdr;
+    u32 crc = ~0, records = 0, type, len;
+    size_t head;
+    int ret;
+
+    for (;;) {
+        if (end - pos < sizeof(*hdr))
+            return -EINVAL;
+        hdr = (const void *)s2fs_image_peek(r, pos, sizeof(*hdr));
+        if (IS_ERR(hdr))
+            return PTR_ERR(hdr);
+        type = le32_to_cpu(hdr->type);
+        len = le32_to_cpu(hdr->len);
+        if (len < sizeof(*hdr) || len % 8 || len > end - pos)
+            return -EINVAL;
+        if ((type == S2FS_CKPT_BEGIN) != !records)
+            return -EINVAL;
+
+        // Everything but page data is covered by the CRC, and read in one piece.
+        head = type == S2FS_CKPT_PAGE ? sizeof(*hdr) + sizeof(struct s2fs_ckpt_page) : len;
+        if (head > len || head > S2FS_CPIO_BUF_SIZE)
+            return -EINVAL;
+        hdr = (const void *)s2fs_image_peek(r, pos, head);
+        if (IS_ERR(hdr))
+            return PTR_ERR(hdr);
+
+        if (type == S2FS_CKPT_COMMIT) {
+            commit = (const void *)(hdr + 1);
+            if (len < sizeof(*hdr) + sizeof(*commit) || le64_to_cpu(commit->seq) != seq ||
+                le32_to_cpu(commit->crc) != crc || le32_to_cpu(commit->records) != records)
+                return -EINVAL;
+            return pos + len;
+        }
+        crc = crc32_le(crc, (const void *)hdr, head);
+        records++;
+
+        ret = 0;
+        switch (type) {
+        case S2FS_CKPT_BEGIN:
+            begin = (const void *)(hdr + 1);
+            if (len < sizeof(*hdr) + sizeof(*begin) || le32_to_cpu(begin->magic) != S2FS_CKPT_MAGIC ||
+                !le32_to_cpu(begin->version) || le32_to_cpu(begin->version) > S2FS_CKPT_VERSION ||
+                le64_to_cpu(begin->seq) != seq)
+                return -EINVAL;
+            break;
+        case S2FS_CKPT_INODE:
+            if (nodes)
+                ret = s2fs_ckpt_replay_inode(nodes, (const void *)(hdr + 1), len - sizeof(*hdr));
+            break;
+        case S2FS_CKPT_PAGE:
+            if (len != ALIGN(pos + head, PAGE_SIZE) + PAGE_SIZE - pos)
+                return -EINVAL;
+            if (nodes)
+                ret = s2fs_ckpt_replay_page(nodes, (const void *)(hdr + 1), pos + len - PAGE_SIZE);
+            break;
+        case S2FS_CKPT_DELETE:
+            if (len < sizeof(*hdr) + sizeof(struct s2fs_ckpt_delete))
+                return -EINVAL;
+            if (nodes)
+                s2fs_ckpt_replay_delete(nodes, (const void *)(hdr + 1));
+            break;
+        case S2FS_CKPT_HOLE:
+            if (len < sizeof(*hdr) + sizeof(struct s2fs_ckpt_hole))
+                return -EINVAL;
+            if (nodes)
+                ret = s2fs_ckpt_replay_hole(nodes, (const void *)(hdr + 1));
+            break;
+        default:
+            return -EINVAL;
+        }
+        if (ret)
+            return ret;
+        pos += len;
+    }
+}
+
+// Creates the inode of node under parent, with the attributes and data it was logged with.
+static int s2fs_ckpt_make(struct super_block *sb, struct dentry *parent, struct s2fs_ckpt_node *node) {
+    struct qstr qname = QSTR_INIT(node->name, strlen(node->name));
+    struct s2fs_inode_info *info;
+    struct dentry *dentry;
+    struct inode *inode;
+    unsigned long index;
+    void *entry;
+
+    if (!d_is_dir(parent) || !qname.len || !(S_ISDIR(node->mode) || S_ISREG(node->mode)))
+        return -EINVAL;
+    dentry = d_hash_and_lookup(parent, &qname);
+    if (dentry) {
+        if (!IS_ERR(dentry))
+            dput(dentry);
+        return -EEXIST;
+    }
+    dentry = s2fs_create_entry(sb, parent, node->name, node->mode & S_IFMT);
+    if (!dentry)
+        return -ENOSPC;
+
+    inode = d_inode(dentry);
+    info = S2FS_I(inode);
+    s2fs_ckpt_clean(inode);
+    info->ckpt_id = node->id;
+    inode->i_ino = node->id; // Numbers stay the same across remounts.
+    inode->i_mode = node->mode;
+    inode->i_uid = make_kuid(sb->s_user_ns, node->uid);
+    inode->i_gid = make_kgid(sb->s_user_ns, node->gid);
+    inode->i_mtime = node->mtime;
+    inode->i_ctime = node->ctime;
+    if (S_ISREG(node->mode)) {
+        xa_for_each(&node->pages, index, entry) {
+            if (xa_is_err(xa_store(&info->ckpt_map, index, entry, GFP_KERNEL)))
+                return -ENOMEM;
+            S2FS_SB(sb)->ckpt_live += PAGE_SIZE;
+        }
+        info->ckpt_len = node->size;
+        i_size_write(inode, node->size);
+    }
+    node->dentry = dentry;
+    return 0;
+}
+
+// Creates node along with whichever of its ancestors do not exist yet, topmost first.
+static int s2fs_ckpt_build(struct super_block *sb, struct xarray *nodes, struct s2fs_ckpt_node *node) {
+    struct s2fs_ckpt_node *top, *parent;
+    int depth, ret;
+
+    while (!node->dentry) {
+        for (top = node, depth = 0; ; top = parent) {
+            parent = xa_load(nodes, top->parent);
+            if (!parent || ++depth > PATH_MAX / 2) // Orphaned, or a loop.
+                return -EINVAL;
+            if (parent->dentry)
+                break;
+        }
+        ret = s2fs_ckpt_make(sb, parent->dentry, top);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+static int s2fs_ckpt_open(struct super_block *sb, const char *path) {
+    struct s2fs_sb_info *sbi = S2FS_SB(sb);
+    struct name_snapshot name;
+    struct file *file;
+
+    file = filp_open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+    if (IS_ERR(file)) {
+        printk(KERN_ERR "s2fs: Cannot open checkpoint log %s\n", path);
+        return PTR_ERR(file);
+    }
+    if (!S_ISREG(file_inode(file)->i_mode)) {
+        fput(file);
+        return -EINVAL;
+    }
+    sbi->ckpt = file; // Dropped in kill_sb, like everything below.
+    sbi->ckpt_path = kstrdup(path, GFP_KERNEL);
+    sbi->ckpt_dir.mnt = mntget(file->f_path.mnt);
+    sbi->ckpt_dir.dentry = dget_parent(file->f_path.dentry);
+    take_dentry_name_snapshot(&name, file->f_path.dentry);
+    sbi->ckpt_name = kstrdup(name.name.name, GFP_KERNEL);
+    release_dentry_name_snapshot(&name);
+    sbi->ckpt_cred = get_current_cred();
+    sbi->ckpt_seq = 1;
+    return sbi->ckpt_path && sbi->ckpt_name ? 0 : -ENOMEM;
+}
+
+// Replays every committed segment of the log onto the new mount, then cuts off whatever
+// follows the last one. Returns the number of segments replayed.
+static int s2fs_ckpt_restore(struct super_block *sb) {
+    struct s2fs_sb_info *sbi = S2FS_SB(sb);
+    struct s2fs_image_reader r = { .file = sbi->ckpt };
+    loff_t end = i_size_read(file_inode(sbi->ckpt)), pos = 0, next;
+    struct s2fs_ckpt_node *node, *root;
+    struct inode *root_inode = d_inode(sb->s_root);
+    unsigned long id, max_id = 1, skipped = 0;
+    int segments = 0, ret = 0;
+    DEFINE_XARRAY(nodes);
+
+    r.buf = kvmalloc(S2FS_CPIO_BUF_SIZE, GFP_KERNEL);
+    if (!r.buf)
+        return -ENOMEM;
+
+    while (pos < end) {
+        next = s2fs_ckpt_segment(&r, pos, end, sbi->ckpt_seq, NULL);
+        if (next < 0)
+            break;
+        next = s2fs_ckpt_segment(&r, pos, end, sbi->ckpt_seq, &nodes);
+        if (next < 0) {
+            ret = next;
+            goto out;
+        }
+        pos = next;
+        sbi->ckpt_pos = pos; // Kept current, so nothing is ever appended over a replayed segment.
+        sbi->ckpt_seq++;
+        segments++;
+        cond_resched();
+    }
+    if (pos < end) {
+        printk(KERN_WARNING "s2fs: Dropping %lld bytes of incomplete checkpoint from %s\n", end - pos, sbi->ckpt_path);
+        ret = vfs_truncate(&sbi->ckpt->f_path, pos);
+        if (ret)
+            goto out;
+    }
+
+    // The root was made with ID 1 and gets only its attributes back.
+    root = xa_load(&nodes, 1);
+    if (root) {
+        root->dentry = sb->s_root;
+        root_inode->i_mode = S_IFDIR | (root->mode & ~S_IFMT);
+        root_inode->i_uid = make_kuid(sb->s_user_ns, root->uid);
+        root_inode->i_gid = make_kgid(sb->s_user_ns, root->gid);
+        root_inode->i_mtime = root->mtime;
+        root_inode->i_ctime = root->ctime;
+        s2fs_ckpt_clean(root_inode);
+    }
+    xa_for_each(&nodes, id, node) {
+        max_id = max(max_id, id);
+        if (node->dentry)
+            continue;
+        ret = s2fs_ckpt_build(sb, &nodes, node);
+        if (ret == -ENOMEM || ret == -ENOSPC)
+            goto out;
+        if (ret)
+            skipped++;
+        ret = 0;
+        cond_resched();
+    }
+    if (skipped)
+        printk(KERN_WARNING "s2fs: Skipped %lu inconsistent entries in %s\n", skipped, sbi->ckpt_path);
+    if (segments)
+        printk(KERN_INFO "s2fs: Restored %d checkpoints from %s\n", segments, sbi->ckpt_path);
+    s2fs_skip_ino(sbi, max_id);
+out:
+    xa_for_each(&nodes, id, node)
+        s2fs_ckpt_free_node(node);
+    xa_destroy(&nodes);
+    kvfree(r.buf);
+    return ret ? ret : segments;
+}
+
+// Compaction
+// Once the log is S2FS_CKPT_COMPACT_RATIO times the size of the data it describes, the
+// checkpoint that notices rewrites it as one segment holding every inode and page, to a new
+// file next to the log that is then renamed over it. Restored data that was never read in
+// is copied over from the old log, not read into the page cache. The incremental state is
+// left alone, so changes made meanwhile go into the next segment, appended to the new log.
+// The new log is read back like at mount, which checks it and tells where each page went;
+// restored pages are then pointed there, and the old log dropped, under ckpt_sem. Files that
+// are unlinked but still open have no place in the new log, so their restored data is read
+// in first. Everything runs as the mounter.
+#define S2FS_CKPT_COMPACT_RATIO 4
+#define S2FS_CKPT_COMPACT_MIN SZ_16M // Smaller logs are left as they are.
+
+// Called with ckpt_mutex held. What is live is estimated as the larger of what the mount
+// holds in memory and what the log held after its restore or last compaction, since
+// restored data only counts in memory once read in.
+static bool s2fs_ckpt_bloated(struct s2fs_sb_info *sbi) {
+    loff_t live = (loff_t)percpu_counter_sum_positive(&sbi->used_blocks) << PAGE_SHIFT;
+
+    live = max(live, sbi->ckpt_live);
+    return sbi->ckpt_pos >= S2FS_CKPT_COMPACT_MIN && sbi->ckpt_pos / S2FS_CKPT_COMPACT_RATIO > live;
+}
+
+// Reads the restored data of inode, which is unlinked, into the page cache. The pages are
+// dirty like written ones, so they are never dropped to be read from the log again.
+static int s2fs_ckpt_detach(struct inode *inode) {
+    struct s2fs_inode_info *info = S2FS_I(inode);
+    struct folio *folio;
+    unsigned long index;
+    void *entry;
+
+    xa_for_each(&info->ckpt_map, index, entry) {
+        if ((loff_t)index << PAGE_SHIFT >= READ_ONCE(info->ckpt_len))
+            break;
+        folio = read_mapping_folio(inode->i_mapping, index, NULL);
+        if (IS_ERR(folio))
+            return PTR_ERR(folio);
+        folio_lock(folio);
+        folio_mark_dirty(folio);
+        folio_unlock(folio);
+        folio_put(folio);
+        cond_resched();
+    }
+    return 0;
+}
+
+// Logs inode and every page of it that holds data: cached, compressed or shared, or
+// restored and not read in yet.
+static int s2fs_ckpt_snap_inode(struct inode *inode, void *arg) {
+    struct s2fs_inode_info *info = S2FS_I(inode);
+    struct s2fs_ckpt_writer *w = arg;
+    struct s2fs_ckpt_inode rec = {};
+    loff_t ckpt_len = READ_ONCE(info->ckpt_len);
+    struct folio_batch fbatch;
+    char name[NAME_MAX];
+    unsigned long index = 0, j;
+    DEFINE_XARRAY(pages);
+    unsigned int i;
+    int namelen, ret;
+    void *entry;
+
+    if (!info->ckpt_id)
+        return 0;
+    if (!inode->i_nlink)
+        return s2fs_ckpt_detach(inode);
+    namelen = s2fs_ckpt_name(inode, &rec, name);
+    if (namelen < 0)
+        return 0;
+    s2fs_ckpt_attrs(inode, &rec, namelen);
+    ret = s2fs_ckpt_record(w, S2FS_CKPT_INODE, &rec, sizeof(rec), name, namelen);
+    if (ret || !S_ISREG(inode->i_mode))
+        return ret;
+
+    folio_batch_init(&fbatch);
+    while (!ret && filemap_get_folios(inode->i_mapping, &index, ULONG_MAX, &fbatch)) {
+        for (i = 0; !ret && i < folio_batch_count(&fbatch); i++) {
+            struct folio *folio = fbatch.folios[i];
+
+            for (j = folio->index; !ret && j < folio->index + folio_nr_pages(folio); j++)
+                ret = xa_err(xa_store(&pages, j, xa_mk_value(0), GFP_KERNEL));
+        }
+        folio_batch_release(&fbatch);
+        cond_resched();
+    }
+    xa_for_each(&info->zmap, index, entry) {
+        if (ret)
+            break;
+        ret = xa_err(xa_store(&pages, index, xa_mk_value(0), GFP_KERNEL));
+    }
+    // Restored pages past ckpt_len hold nothing the file still has.
+    xa_for_each(&info->ckpt_map, index, entry) {
+        if (ret || (loff_t)index << PAGE_SHIFT >= ckpt_len)
+            break;
+        ret = xa_err(xa_store(&pages, index, xa_mk_value(0), GFP_KERNEL));
+    }
+
+    xa_for_each(&pages, index, entry) {
+        if (ret || (loff_t)index << PAGE_SHIFT >= i_size_read(inode))
+            break;
+        ret = s2fs_ckpt_page(w, inode, index);
+        cond_resched();
+    }
+    xa_destroy(&pages);
+    return ret;
+}
+
+// Points the restored pages of inode at their copies in the new log, whose inodes are in
+// nodes. A page that moved or was punched meanwhile is left alone, and a page the new log
+// has no copy of was past the end of the file.
+static int s2fs_ckpt_remap(struct inode *inode, void *arg) {
+    struct s2fs_inode_info *info = S2FS_I(inode);
+    struct s2fs_ckpt_node *node = info->ckpt_id ? xa_load(arg, info->ckpt_id) : NULL;
+    unsigned long index;
+    void *entry, *moved;
+
+    // Replacing an entry does not allocate.
+    xa_for_each(&info->ckpt_map, index, entry) {
+        moved = node ? xa_load(&node->pages, index) : NULL;
+        xa_cmpxchg(&info->ckpt_map, index, entry, moved, GFP_NOWAIT);
+    }
+    return 0;
+}
+
+// Renames dentry, in the log's directory, over the log, and syncs the directory so the
+// rename outlives a crash. The rename is what counts; a failed sync is only reported.
+static int s2fs_ckpt_replace(struct s2fs_sb_info *sbi, struct dentry *dentry) {
+    struct dentry *dir = sbi->ckpt_dir.dentry, *target;
+    struct renamedata rd = {};
+    struct file *file;
+    int ret;
+
+    ret = mnt_want_write(sbi->ckpt_dir.mnt);
+    if (ret)
+        return ret;
+    lock_rename(dir, dir);
+    target = lookup_one_len(sbi->ckpt_name, dir, strlen(sbi->ckpt_name));
+    ret = PTR_ERR_OR_ZERO(target);
+    if (!ret && dentry->d_parent != dir)
+        ret = -ENOENT;
+    if (!ret) {
+        rd.old_mnt_userns = rd.new_mnt_userns = mnt_user_ns(sbi->ckpt_dir.mnt);
+        rd.old_dir = rd.new_dir = d_inode(dir);
+        rd.old_dentry = dentry;
+        rd.new_dentry = target;
+        ret = vfs_rename(&rd);
+    }
+    if (!IS_ERR(target))
+        dput(target);
+    unlock_rename(dir, dir);
+    mnt_drop_write(sbi->ckpt_dir.mnt);
+    if (ret)
+        return ret;
+
+    file = dentry_open(&sbi->ckpt_dir, O_RDONLY | O_DIRECTORY, current_cred());
+    if (!IS_ERR(file)) {
+        if (vfs_fsync(file, 0))
+            printk(KERN_WARNING "s2fs: Cannot sync the directory of %s\n", sbi->ckpt_path);
+        fput(file);
+    }
+    return 0;
+}
+
+// Removes dentry, a new log that did not make it, from the log's directory.
+static void s2fs_ckpt_discard(struct s2fs_sb_info *sbi, struct dentry *dentry) {
+    struct dentry *dir = sbi->ckpt_dir.dentry;
+
+    if (mnt_want_write(sbi->ckpt_dir.mnt))
+        return;
+    inode_lock_nested(d_inode(dir), I_MUTEX_PARENT);
+    if (dentry->d_parent == dir && d_is_positive(dentry))
+        vfs_unlink(mnt_user_ns(sbi->ckpt_dir.mnt), d_inode(dir), dentry, NULL);
+    inode_unlock(d_inode(dir));
+    mnt_drop_write(sbi->ckpt_dir.mnt);
+}
+
+// Called with ckpt_mutex held, right after a checkpoint.
+static int s2fs_ckpt_compact(struct super_block *sb) {
+    struct s2fs_sb_info *sbi = S2FS_SB(sb);
+    struct s2fs_ckpt_writer w = { .crc = ~0 };
+    struct s2fs_image_reader r = {};
+    struct s2fs_ckpt_node *node;
+    const struct cred *cred;
+    loff_t end = 0;
+    DEFINE_XARRAY(nodes);
+    struct file *old;
+    unsigned long id;
+    char *name;
+    int ret;
+
+    name = kasprintf(GFP_KERNEL, "%s.compact", sbi->ckpt_name);
+    w.buf = kvmalloc(S2FS_CKPT_BUF_SIZE, GFP_KERNEL);
+    w.page = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    r.buf = kvmalloc(S2FS_CPIO_BUF_SIZE, GFP_KERNEL);
+    ret = -ENOMEM;
+    if (!name || !w.buf || !w.page || !r.buf)
+        goto out;
+
+    cred = override_creds(sbi->ckpt_cred);
+    w.file = file_open_root(&sbi->ckpt_dir, name, O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW | O_LARGEFILE, 0600);
+    if (IS_ERR(w.file)) {
+        ret = PTR_ERR(w.file);
+        w.file = NULL;
+        revert_creds(cred);
+        goto out;
+    }
+
+    ret = s2fs_ckpt_begin(&w, 1);
+    if (!ret)
+        ret = s2fs_for_each_inode(sb, s2fs_ckpt_snap_inode, &w);
+    if (!ret)
+        ret = s2fs_ckpt_commit(&w, 1);
+    if (!ret) {
+        r.file = w.file;
+        end = s2fs_ckpt_segment(&r, 0, s2fs_ckpt_tell(&w), 1, &nodes);
+        ret = end < 0 ? end : 0;
+    }
+    if (!ret)
+        ret = s2fs_ckpt_replace(sbi, w.file->f_path.dentry);
+    if (ret)
+        s2fs_ckpt_discard(sbi, w.file->f_path.dentry);
+    revert_creds(cred);
+    if (ret)
+        goto out;
+
+    down_write(&sbi->ckpt_sem);
+    s2fs_for_each_inode(sb, s2fs_ckpt_remap, &nodes);
+    old = sbi->ckpt;
+    sbi->ckpt = w.file;
+    up_write(&sbi->ckpt_sem);
+    printk(KERN_INFO "s2fs: Compacted %s from %lld to %lld bytes\n", sbi->ckpt_path, sbi->ckpt_pos, end);
+    w.file = old;
+    sbi->ckpt_pos = end;
+    sbi->ckpt_seq = 2;
+    sbi->ckpt_live = end;
+out:
+    if (w.file)
+        fput(w.file);
+    xa_for_each(&nodes, id, node)
+        s2fs_ckpt_free_node(node);
+    xa_destroy(&nodes);
+    kvfree(r.buf);
+    kfree(w.page);
+    kvfree(w.buf);
+    kfree(name);
+    return ret;
+}
+
+// Compression
+// compress= keeps pages that went unused for compress_age= seconds compressed, and puts them
+// back in the page cache when they are next read, written or faulted. A pass over every file
+// runs once per age. A folio that was not read or written since the previous pass (its
+// referenced flag is still clear) is taken out of the page cache through the invalidation
+// path, whose launder_folio step compresses it. A clean folio is dropped without that, since
+// filling it again gives the same data. Folios that are mapped, large, due for a checkpoint
+// or that did not compress last time are left alone. Compressed copies are kmalloc'ed at
+// their compressed size and stay charged to the mount like the pages they replace.
+//
+// dedup makes the same pass share copies: pages with the same contents, in any files of the
+// mount, point at one refcounted copy found through a table keyed by the hash of the page,
+// and all-zero pages take no copy at all. Pages that do not compress are then kept as they
+// are, as they may still be shared. Sharing ends when a page is next used: it goes back into
+// the page cache of its own file as a private folio and drops its reference, so a write
+// never touches the shared copy.
+#define S2FS_ZMAX (PAGE_SIZE * 3 / 4) // Larger results are not worth keeping.
+#define S2FS_ZERO xa_mk_value(0)      // zmap entry of an all-zero page.
+
+struct s2fs_zpage {
+    refcount_t ref;         // Held by each zmap entry pointing here and each read in progress.
+    unsigned int len;       // PAGE_SIZE for a page kept uncompressed.
+    u8 *data;
+    u64 hash;               // Of the uncompressed page, with dedup.
+    bool hashed;            // In the dedup table, which only holds one copy per hash.
+    struct rhash_head node;
+    struct rcu_head rcu;    // Lookups run under RCU and may still see a copy being freed.
+};
+
+static const struct rhashtable_params s2fs_dedup_params = {
+    .key_len = sizeof(u64),
+    .key_offset = offsetof(struct s2fs_zpage, hash),
+    .head_offset = offsetof(struct s2fs_zpage, node),
+    .automatic_shrinking = true,
+};
+
+// One transform per CPU, as a compressor keeps scratch state in it.
+struct s2fs_zctx {
+    struct mutex lock;
+    struct crypto_comp *tfm; // NULL with dedup alone.
+    u8 *buf;                 // Compression output, which may exceed a page.
+};
+
+// Totals over all mounts, for the compress and dedup stats files.
+static struct {
+    atomic_long_t pages;          // Held out of the page cache now.
+    atomic_long_t zero;           // Of those, all-zero pages, which take no copy.
+    atomic_long_t copies;         // Copies the others point at.
+    atomic_long_t bytes;          // Their size.
+    atomic_long_t compressed;     // Pages compressed so far.
+    atomic_long_t incompressible; // Pages left uncompressed so far.
+    atomic_long_t duplicates;     // Pages that found an existing copy so far.
+    atomic_long_t decompressed;   // Pages decompressed so far.
+    atomic64_t decompress_ns;
+    atomic64_t decompress_max_ns;
+} s2fs_zstats;
+
+// alg may be NULL for dedup without compression.
+static int s2fs_zctx_init(struct super_block *sb, const char *alg, bool dedup) {
+    struct s2fs_sb_info *sbi = S2FS_SB(sb);
+    struct s2fs_zctx *ctx;
+    int cpu, ret;
+
+    if (dedup) {
+        ret = rhashtable_init(&sbi->dedup_table, &s2fs_dedup_params);
+        if (ret)
+            return ret;
+        sbi->dedup = true;
+    }
+    if (alg) {
+        sbi->compress = kstrdup(alg, GFP_KERNEL);
+        if (!sbi->compress)
+            return -ENOMEM;
+    }
+    sbi->zctx = alloc_percpu(struct s2fs_zctx);
+    if (!sbi->zctx)
+        return -ENOMEM;
+
+    for_each_possible_cpu(cpu) {
+        ctx = per_cpu_ptr(sbi->zctx, cpu);
+        mutex_init(&ctx->lock);
+        if (alg) {
+            ctx->tfm = crypto_alloc_comp(alg, 0, 0);
+            if (IS_ERR(ctx->tfm)) {
+                ret = PTR_ERR(ctx->tfm);
+                ctx->tfm = NULL;
+                printk(KERN_ERR "s2fs: Cannot allocate compressor %s\n", alg);
+                return ret;
+            }
+        }
+        ctx->buf = kmalloc_node(PAGE_SIZE * 2, GFP_KERNEL, cpu_to_node(cpu));
+        if (!ctx->buf)
+            return -ENOMEM;
+    }
+    return 0;
+}
+
+// Every copy is gone by now, as evicting the inodes dropped them.
+static void s2fs_zctx_free(struct s2fs_sb_info *sbi) {
+    struct s2fs_zctx *ctx;
+    int cpu;
+
+    if (sbi->zctx) {
+        for_each_possible_cpu(cpu) {
+            ctx = per_cpu_ptr(sbi->zctx, cpu);
+            if (ctx->tfm)
+                crypto_free_comp(ctx->tfm);
+            kfree(ctx->buf);
+        }
+        free_percpu(sbi->zctx);
+    }
+    if (sbi->dedup)
+        rhashtable_destroy(&sbi->dedup_table);
+    kfree(sbi->compress);
+}
+
+// A new copy of len bytes of data, with one reference. With dedup it is hashed unless a copy
+// with the same hash is there already, in which case it stays unshared.
+static struct s2fs_zpage *s2fs_zpage_new(struct s2fs_sb_info *sbi, u64 hash, const void *data, unsigned int len) {
+    struct s2fs_zpage *z = kmalloc(sizeof(*z), GFP_NOFS | __GFP_NOWARN);
+
+    if (!z)
+        return NULL;
+    z->data = kmalloc(len, GFP_NOFS | __GFP_NOWARN);
+    if (!z->data) {
+        kfree(z);
+        return NULL;
+    }
+    refcount_set(&z->ref, 1);
+    z->len = len;
+    z->hash = hash;
+    memcpy(z->data, data, len);
+    z->hashed = sbi->dedup &&
+                !rhashtable_lookup_insert_fast(&sbi->dedup_table, &z->node, s2fs_dedup_params);
+    atomic_long_inc(&s2fs_zstats.copies);
+    atomic_long_add(len, &s2fs_zstats.bytes);
+    return z;
+}
+
+static void s2fs_zpage_put(struct s2fs_sb_info *sbi, struct s2fs_zpage *z) {
+    if (!refcount_dec_and_test(&z->ref))
+        return;
+    if (z->hashed)
+        rhashtable_remove_fast(&sbi->dedup_table, &z->node, s2fs_dedup_params);
+    atomic_long_dec(&s2fs_zstats.copies);
+    atomic_long_sub(z->len, &s2fs_zstats.bytes);
+    kfree(z->data);
+    kfree_rcu(z, rcu);
+}
+
+// The copy of the mount holding the same len bytes of data, with a reference, or NULL. The
+// hash only picks the candidate; the data decides. A compressor gives the same output for
+// the same page, so compressed copies compare as well as plain ones.
+static struct s2fs_zpage *s2fs_dedup_find(struct s2fs_sb_info *sbi, u64 hash, const void *data, unsigned int len) {
+    struct s2fs_zpage *z;
+
+    rcu_read_lock();
+    z = rhashtable_lookup(&sbi->dedup_table, &hash, s2fs_dedup_params);
+    if (z && !refcount_inc_not_zero(&z->ref))
+        z = NULL;
+    rcu_read_unlock();
+    if (z && (z->len != len || memcmp(z->data, data, len))) {
+        s2fs_zpage_put(sbi, z);
+        z = NULL;
+    }
+    return z;
+}
+
+// Drops the copies of pages first..last. With uncharge they are uncharged right away;
+// otherwise the caller leaves that to s2fs_recalc_inode().
+static void s2fs_zmap_drop(struct inode *inode, pgoff_t first, pgoff_t last, bool uncharge) {
+    struct s2fs_sb_info *sbi = S2FS_SB(inode->i_sb);
+    struct s2fs_inode_info *info = S2FS_I(inode);
+    unsigned long index;
+    void *entry;
+    long n = 0;
+
+    if (!atomic_long_read(&info->zpages))
+        return;
+    xa_for_each_range(&info->zmap, index, entry, first, last) {
+        entry = xa_erase(&info->zmap, index);
+        if (!entry)
+            continue;
+        if (entry == S2FS_ZERO)
+            atomic_long_dec(&s2fs_zstats.zero);
+        else
+            s2fs_zpage_put(sbi, entry);
+        n++;
+    }
+    atomic_long_sub(n, &info->zpages);
+    atomic_long_sub(n, &s2fs_zstats.pages);
+    if (uncharge && n)
+        s2fs_uncharge(inode, n);
+}
+
+// Fills page i of folio from its copy, if it has one. Returns 1 if it did. The copy is left
+// in place for the caller to drop, as the folio may lose the race to enter the page cache.
+static int s2fs_unzip(struct inode *inode, struct folio *folio, long i) {
+    struct s2fs_sb_info *sbi = S2FS_SB(inode->i_sb);
+    struct s2fs_inode_info *info = S2FS_I(inode);
+    unsigned int dlen = PAGE_SIZE;
+    struct s2fs_zctx *ctx;
+    struct s2fs_zpage *z;
+    s64 start, ns, max;
+    void *kaddr, *entry;
+    int ret;
+
+    if (!sbi->zctx || !atomic_long_read(&info->zpages))
+        return 0;
+    xa_lock(&info->zmap);
+    entry = xa_load(&info->zmap, folio->index + i);
+    if (entry && entry != S2FS_ZERO)
+        refcount_inc(&((struct s2fs_zpage *)entry)->ref);
+    xa_unlock(&info->zmap);
+    if (!entry)
+        return 0;
+
+    if (entry == S2FS_ZERO || ((struct s2fs_zpage *)entry)->len == PAGE_SIZE) {
+        kaddr = kmap_local_folio(folio, i * PAGE_SIZE);
+        if (entry == S2FS_ZERO) {
+            memset(kaddr, 0, PAGE_SIZE);
+        } else {
+            memcpy(kaddr, ((struct s2fs_zpage *)entry)->data, PAGE_SIZE);
+            s2fs_zpage_put(sbi, entry);
+        }
+        kunmap_local(kaddr);
+        return 1;
+    }
+    z = entry;
+
+    start = ktime_get_ns();
+    ctx = raw_cpu_ptr(sbi->zctx);
+    mutex_lock(&ctx->lock);
+    kaddr = kmap_local_folio(folio, i * PAGE_SIZE);
+    ret = crypto_comp_decompress(ctx->tfm, z->data, z->len, kaddr, &dlen);
+    kunmap_local(kaddr);
+    mutex_unlock(&ctx->lock);
+    s2fs_zpage_put(sbi, z);
+    if (ret || dlen != PAGE_SIZE)
+        return ret ? ret : -EIO;
+
+    ns = ktime_get_ns() - start;
+    atomic_long_inc(&s2fs_zstats.decompressed);
+    atomic64_add(ns, &s2fs_zstats.decompress_ns);
+    max = atomic64_read(&s2fs_zstats.decompress_max_ns);
+    while (ns > max && !atomic64_try_cmpxchg(&s2fs_zstats.decompress_max_ns, &max, ns))
+        ;
+    return 1;
+}
+
+// Last step before the pass takes a dirty folio out of the page cache: keep a copy and clean
+// the folio. A folio left dirty stays cached; one that does not compress well is flagged so
+// later passes skip it until it is written again, unless it may still be shared.
+static int s2fs_launder_folio(struct folio *folio) {
+    struct inode *inode = folio->mapping->host;
+    struct s2fs_sb_info *sbi = S2FS_SB(inode->i_sb);
+    struct s2fs_inode_info *info = S2FS_I(inode);
+    unsigned int dlen = PAGE_SIZE * 2;
+    bool zero = false, packed = false, dup = false;
+    struct s2fs_zpage *z = NULL;
+    struct s2fs_zctx *ctx;
+    void *kaddr;
+    u64 hash = 0;
+    int ret;
+
+    if (!sbi->zctx || folio_test_large(folio))
+        return 0;
+
+    ctx = raw_cpu_ptr(sbi->zctx);
+    mutex_lock(&ctx->lock);
+    kaddr = kmap_local_folio(folio, 0);
+    if (sbi->dedup) {
+        zero = !memchr_inv(kaddr, 0, PAGE_SIZE);
+        hash = xxh64(kaddr, PAGE_SIZE, 0);
+    }
+    if (!zero && ctx->tfm) {
+        ret = crypto_comp_compress(ctx->tfm, kaddr, PAGE_SIZE, ctx->buf, &dlen);
+        packed = !ret && dlen <= S2FS_ZMAX;
+        if (!packed)
+            atomic_long_inc(&s2fs_zstats.incompressible);
+    }
+    if (!zero && !packed && sbi->dedup) {
+        memcpy(ctx->buf, kaddr, PAGE_SIZE);
+        dlen = PAGE_SIZE;
+    }
+    kunmap_local(kaddr);
+    if (!zero && (packed || sbi->dedup)) {
+        z = sbi->dedup ? s2fs_dedup_find(sbi, hash, ctx->buf, dlen) : NULL;
+        dup = z;
+        if (!z)
+            z = s2fs_zpage_new(sbi, hash, ctx->buf, dlen);
+    }
+    mutex_unlock(&ctx->lock);
+
+    if (!zero && !z) {
+        if (!packed && !sbi->dedup)
+            folio_set_checked(folio);
+        return 0;
+    }
+
+    // Counted first, so a reader that sees the copy also sees the count.
+    atomic_long_inc(&info->zpages);
+    if (xa_is_err(xa_store(&info->zmap, folio->index, zero ? S2FS_ZERO : z, GFP_NOFS))) {
+        atomic_long_dec(&info->zpages);
+        if (z)
+            s2fs_zpage_put(sbi, z);
+        return 0;
+    }
+    atomic_long_inc(&s2fs_zstats.pages);
+    if (zero)
+        atomic_long_inc(&s2fs_zstats.zero);
+    if (packed)
+        atomic_long_inc(&s2fs_zstats.compressed);
+    if (dup)
+        atomic_long_inc(&s2fs_zstats.duplicates);
+    folio_clear_dirty_for_io(folio);
+    return 0;
+}
+
+// Compresses the pages of inode that went unused since the last pass. Runs under the inode
+// lock, so no write or truncate runs meanwhile; reads and faults bring pages back as usual.
+static int s2fs_compress_inode(struct inode *inode, void *arg) {
+    struct s2fs_inode_info *info = S2FS_I(inode);
+    struct address_space *mapping = inode->i_mapping;
+    pgoff_t cold[PAGEVEC_SIZE];
+    struct folio_batch fbatch;
+    pgoff_t index = 0;
+    unsigned int i, n;
+
+    if (mapping->a_ops != &s2fs_aops || !mapping->nrpages || !inode_trylock(inode))
+        return 0;
+
+    folio_batch_init(&fbatch);
+    while (filemap_get_folios(mapping, &index, ULONG_MAX, &fbatch)) {
+        for (i = 0, n = 0; i < folio_batch_count(&fbatch); i++) {
+            struct folio *folio = fbatch.folios[i];
+
+            if (folio_test_large(folio) || folio_mapped(folio) || folio_test_checked(folio) ||
+                xa_load(&info->ckpt_pages, folio->index))
+                continue;
+            if (!folio_test_clear_referenced(folio))
+                cold[n++] = folio->index;
+        }
+        folio_batch_release(&fbatch);
+
+        for (i = 0; i < n; i++)
+            invalidate_inode_pages2_range(mapping, cold[i], cold[i]);
+        cond_resched();
+    }
+    s2fs_recalc_inode(inode);
+    inode_unlock(inode);
+    return 0;
+}
+
+static void s2fs_compress_work(struct work_struct *work) {
+    struct s2fs_sb_info *sbi = container_of(to_delayed_work(work), struct s2fs_sb_info, compress_work);
+
+    s2fs_for_each_inode(sbi->sb, s2fs_compress_inode, NULL);
+    queue_delayed_work(system_unbound_wq, &sbi->compress_work, READ_ONCE(sbi->compress_age) * HZ);
+}
+
+// Stats
+static void s2fs_snapshot_release(struct kref *ref) {
+    kvfree(container_of(ref, struct s2fs_snapshot, ref));
+}
+
+static void s2fs_snapshot_put(struct s2fs_snapshot *snapshot) {
+    kref_put(&snapshot->ref, s2fs_snapshot_release);
+}
+
+static void s2fs_entry_release(struct kref *ref) {
+    struct s2fs_entry *entry = container_of(ref, struct s2fs_entry, ref);
+
+    if (entry->snapshot)
+        s2fs_snapshot_put(entry->snapshot);
+    kfree(entry->name);
+    kfree(entry);
+}
+
+static void s2fs_entry_put(struct s2fs_entry *entry) {
+    kref_put(&entry->ref, s2fs_entry_release);
+}
+
+// Called with s2fs_entries_lock held. Registries are small, so a scan is enough.
+static struct s2fs_entry *s2fs_entry_find(const char *name, unsigned int len) {
+    struct s2fs_entry *entry;
+    unsigned long id;
+
+    xa_for_each(&s2fs_entries, id, entry) {
+        if (strlen(entry->name) == len && !memcmp(entry->name, name, len))
+            return entry;
+    }
+    return NULL;
+}
+
+struct s2fs_entry *s2fs_register(const char *name, s2fs_render_t render, void *priv) {
+    struct s2fs_entry *entry;
+    int ret;
+
+    if (!*name || strchr(name, '/') || strlen(name) > NAME_MAX || !strcmp(name, ".") || !strcmp(name, ".."))
+        return ERR_PTR(-EINVAL);
+
+    entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+    if (!entry)
+        return ERR_PTR(-ENOMEM);
+    entry->name = kstrdup(name, GFP_KERNEL);
+    if (!entry->name) {
+        kfree(entry);
+        return ERR_PTR(-ENOMEM);
+    }
+    kref_init(&entry->ref);
+    mutex_init(&entry->lock);
+    entry->serial = atomic_long_inc_return(&s2fs_entries_serial);
+    entry->render = render;
+    entry->priv = priv;
+
+    mutex_lock(&s2fs_entries_lock);
+    if (s2fs_entry_find(name, strlen(name)))
+        ret = -EEXIST;
+    else
+        ret = xa_alloc(&s2fs_entries, &entry->id, entry, XA_LIMIT(S2FS_STATS_MIN_ID, INT_MAX), GFP_KERNEL);
+    mutex_unlock(&s2fs_entries_lock);
+
+    if (ret) {
+        s2fs_entry_put(entry);
+        return ERR_PTR(ret);
+    }
+    return entry;
+}
+EXPORT_SYMBOL_GPL(s2fs_register);
+
+void s2fs_unregister(struct s2fs_entry *entry) {
+    mutex_lock(&s2fs_entries_lock);
+    xa_erase(&s2fs_entries, entry->id);
+    mutex_unlock(&s2fs_entries_lock);
+
+    // Waits for a render in progress; none starts after this.
+    mutex_lock(&entry->lock);
+    WRITE_ONCE(entry->dead, true);
+    mutex_unlock(&entry->lock);
+
+    s2fs_entry_put(entry);
+}
+EXPORT_SYMBOL_GPL(s2fs_unregister);
+
+void s2fs_invalidate(struct s2fs_entry *entry) {
+    atomic_long_inc(&entry->generation);
+}
+EXPORT_SYMBOL_GPL(s2fs_invalidate);
+
+// The rendered copy for the current generation, rendering it if there is none yet. The
+// caller gets its own reference. The buffer starts at the size of the last render and
+// doubles while the callback overflows it.
+static struct s2fs_snapshot *s2fs_entry_snapshot(struct s2fs_entry *entry) {
+    struct s2fs_snapshot *snapshot;
+    unsigned long generation;
+    struct seq_buf s;
+    size_t size;
+    int ret;
+
+    mutex_lock(&entry->lock);
+    if (entry->dead) {
+        snapshot = entry->snapshot ? entry->snapshot : ERR_PTR(-ENOENT);
+        goto out;
+    }
+
+    // An invalidation during the render leaves the copy on the old generation, so the next
+    // open renders again.
+    generation = atomic_long_read(&entry->generation);
+    snapshot = entry->snapshot;
+    if (snapshot && snapshot->generation == generation)
+        goto out;
+
+    for (size = max_t(size_t, entry->size_hint + 1, PAGE_SIZE); ; size *= 2) {
+        snapshot = kvmalloc(struct_size(snapshot, data, size), GFP_KERNEL);
+        if (!snapshot) {
+            snapshot = ERR_PTR(-ENOMEM);
+            goto out;
+        }
+        seq_buf_init(&s, snapshot->data, size);
+        ret = entry->render(&s, entry->priv);
+        if (!ret && !seq_buf_has_overflowed(&s))
+            break;
+        kvfree(snapshot);
+        if (ret || size >= S2FS_STATS_MAX_SIZE) {
+            snapshot = ERR_PTR(ret ? ret : -EFBIG);
+            goto out;
+        }
+    }
+
+    kref_init(&snapshot->ref);
+    snapshot->generation = generation;
+    snapshot->len = seq_buf_used(&s);
+    if (entry->snapshot)
+        s2fs_snapshot_put(entry->snapshot);
+    entry->snapshot = snapshot;
+    entry->size_hint = snapshot->len;
+out:
+    if (!IS_ERR(snapshot))
+        kref_get(&snapshot->ref);
+    mutex_unlock(&entry->lock);
+    return snapshot;
+}
+
+// Called with s2fs_entries_lock held. The number of entry in the mount of sbi, taking one
+// from the mount's counter the first time it is listed or looked up there. 0 on failure.
+static unsigned long s2fs_stats_ino(struct s2fs_sb_info *sbi, struct s2fs_entry *entry) {
+    struct s2fs_stats_ino *si = xa_load(&sbi->stats_ino, entry->id);
+
+    if (si && si->serial == entry->serial)
+        return si->ino;
+    if (!si) {
+        si = kmalloc(sizeof(*si), GFP_KERNEL);
+        if (!si)
+            return 0;
+        if (xa_is_err(xa_store(&sbi->stats_ino, entry->id, si, GFP_KERNEL))) {
+            kfree(si);
+            return 0;
+        }
+    }
+    si->serial = entry->serial;
+    si->ino = s2fs_next_ino(sbi);
+    return si->ino;
+}
+
+static void s2fs_stats_ino_free(struct s2fs_sb_info *sbi) {
+    struct s2fs_stats_ino *si;
+    unsigned long id;
+
+    xa_for_each(&sbi->stats_ino, id, si)
+        kfree(si);
+    xa_destroy(&sbi->stats_ino);
+}
+
+static struct dentry *s2fs_stats_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags) {
+    struct s2fs_entry *entry;
+    struct inode *inode = NULL;
+    unsigned long ino = 0;
+
+    if (dentry->d_name.len > NAME_MAX)
+        return ERR_PTR(-ENAMETOOLONG);
+
+    mutex_lock(&s2fs_entries_lock);
+    entry = s2fs_entry_find(dentry->d_name.name, dentry->d_name.len);
+    if (entry) {
+        kref_get(&entry->ref);
+        ino = s2fs_stats_ino(S2FS_SB(dir->i_sb), entry);
+    }
+    mutex_unlock(&s2fs_entries_lock);
+
+    if (entry) {
+        inode = ino ? new_inode(dir->i_sb) : NULL;
+        if (!inode) {
+            s2fs_entry_put(entry);
+            return ERR_PTR(-ENOMEM);
+        }
+        inode->i_ino = ino;
+        inode->i_mode = S_IFREG | 0444;
+        inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+        inode->i_fop = &s2fs_stats_fops;
+        inode->i_private = entry;
+    }
+
+    d_set_d_op(dentry, &s2fs_stats_dentry_ops);
+    return d_splice_alias(inode, dentry);
+}
+
+// A name stays valid while its entry is registered; a negative one is never cached. Not
+// under RCU, where the inode and its entry may be freed under us.
+static int s2fs_stats_revalidate(struct dentry *dentry, unsigned int flags) {
     struct inode *inode;
-    struct qstr qname;
 
-    qname.name = file_name;
-    qname.len = strlen(file_name);
-    qname.hash = full_name_hash(parent, file_name, qname.len);
+    if (flags & LOOKUP_RCU)
+        return -ECHILD;
+    inode = d_inode(dentry);
 
-    dentry = d_alloc(parent, &qname);
-    if (!dentry)
-        return NULL;
+    if (!inode)
+        return 0;
+    return !READ_ONCE(((struct s2fs_entry *)inode->i_private)->dead);
+}
 
-    inode = s2fs_make_inode(sb, S_IFREG | 0644);
-    if (!inode) {
-        dput(dentry);
-        return NULL;
+static int s2fs_stats_readdir(struct file *filp, struct dir_context *ctx) {
+    struct s2fs_sb_info *sbi = S2FS_SB(file_inode(filp)->i_sb);
+    struct s2fs_entry *entry;
+    unsigned long id, ino;
+    int ret = 0;
+
+    if (!dir_emit_dots(filp, ctx))
+        return 0;
+
+    mutex_lock(&s2fs_entries_lock);
+    xa_for_each_start(&s2fs_entries, id, entry, ctx->pos) {
+        ctx->pos = id;
+        ino = s2fs_stats_ino(sbi, entry);
+        if (!ino) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        if (!dir_emit(ctx, entry->name, strlen(entry->name), ino, DT_REG))
+            goto out;
     }
+    ctx->pos = (loff_t)INT_MAX + 1;
+out:
+    mutex_unlock(&s2fs_entries_lock);
+    return ret;
+}
 
-    inode->i_fop = &s2fs_fops;
+static int s2fs_stats_open(struct inode *inode, struct file *filp) {
+    struct s2fs_snapshot *snapshot = s2fs_entry_snapshot(inode->i_private);
 
-    d_add(dentry, inode);
-    return dentry;
+    if (IS_ERR(snapshot))
+        return PTR_ERR(snapshot);
+    filp->private_data = snapshot;
+    return 0;
+}
+
+static ssize_t s2fs_stats_read(struct kiocb *iocb, struct iov_iter *to) {
+    struct s2fs_snapshot *snapshot = iocb->ki_filp->private_data;
+    size_t n, copied;
+
+    if (iocb->ki_pos >= snapshot->len)
+        return 0;
+    n = min_t(size_t, snapshot->len - iocb->ki_pos, iov_iter_count(to));
+    copied = copy_to_iter(snapshot->data + iocb->ki_pos, n, to);
+    if (!copied && n)
+        return -EFAULT;
+    iocb->ki_pos += copied;
+    return copied;
+}
+
+static loff_t s2fs_stats_llseek(struct file *filp, loff_t offset, int whence) {
+    struct s2fs_snapshot *snapshot = filp->private_data;
+
+    return fixed_size_llseek(filp, offset, whence, snapshot->len);
+}
+
+static int s2fs_stats_release(struct inode *inode, struct file *filp) {
+    s2fs_snapshot_put(filp->private_data);
+    return 0;
+}
+
+// Built-in entries
+// Built-in entries are invalidated once a second, so reads within the same second share one
+// render.
+static struct s2fs_entry *s2fs_meminfo_entry;
+static void s2fs_meminfo_tick(struct work_struct *work);
+static DECLARE_DELAYED_WORK(s2fs_meminfo_work, s2fs_meminfo_tick);
+
+static int s2fs_meminfo_render(struct seq_buf *s, void *priv) {
+    struct sysinfo info;
+
+    si_meminfo(&info);
+    seq_buf_printf(s, "MemTotal: %lu kB\n", info.totalram << (PAGE_SHIFT - 10));
+    seq_buf_printf(s, "MemFree: %lu kB\n", info.freeram << (PAGE_SHIFT - 10));
+    seq_buf_printf(s, "Buffers: %lu kB\n", info.bufferram << (PAGE_SHIFT - 10));
+    seq_buf_printf(s, "Shmem: %lu kB\n", info.sharedram << (PAGE_SHIFT - 10));
+    return 0;
+}
+
+// compress reports the totals of every mount with compress= or dedup. The ratio is of the
+// pages held out of the page cache to the memory their copies take.
+static struct s2fs_entry *s2fs_compress_entry;
+static struct s2fs_entry *s2fs_dedup_entry;
+
+static void s2fs_print_ratio(struct seq_buf *s, const char *name, u64 num, u64 den) {
+    u64 ratio = den ? div64_u64(num * 100, den) : 0;
+    u32 hundredths;
+
+    ratio = div_u64_rem(ratio, 100, &hundredths);
+    seq_buf_printf(s, "%s: %llu.%02u\n", name, ratio, hundredths);
+}
+
+static int s2fs_compress_render(struct seq_buf *s, void *priv) {
+    u64 pages = atomic_long_read(&s2fs_zstats.pages);
+    u64 bytes = atomic_long_read(&s2fs_zstats.bytes);
+    u64 n = atomic_long_read(&s2fs_zstats.decompressed);
+
+    seq_buf_printf(s, "Stored: %llu kB\n", pages << (PAGE_SHIFT - 10));
+    seq_buf_printf(s, "Compressed: %llu kB\n", bytes >> 10);
+    s2fs_print_ratio(s, "Ratio", pages * PAGE_SIZE, bytes);
+    seq_buf_printf(s, "PagesCompressed: %ld\n", atomic_long_read(&s2fs_zstats.compressed));
+    seq_buf_printf(s, "PagesIncompressible: %ld\n", atomic_long_read(&s2fs_zstats.incompressible));
+    seq_buf_printf(s, "PagesDecompressed: %llu\n", n);
+    seq_buf_printf(s, "DecompressAvg: %llu ns\n", n ? div64_u64(atomic64_read(&s2fs_zstats.decompress_ns), n) : 0);
+    seq_buf_printf(s, "DecompressMax: %lld ns\n", atomic64_read(&s2fs_zstats.decompress_max_ns));
+    return 0;
+}
+
+// dedup splits the pages of compress by what they share. The ratio is of the pages that
+// have a copy to the copies, so it leaves out both zero pages and compression.
+static int s2fs_dedup_render(struct seq_buf *s, void *priv) {
+    u64 zero = atomic_long_read(&s2fs_zstats.zero);
+    u64 pages = atomic_long_read(&s2fs_zstats.pages) - zero;
+    u64 copies = atomic_long_read(&s2fs_zstats.copies);
+
+    seq_buf_printf(s, "Pages: %llu\n", pages);
+    seq_buf_printf(s, "ZeroPages: %llu\n", zero);
+    seq_buf_printf(s, "Copies: %llu\n", copies);
+    s2fs_print_ratio(s, "Ratio", pages, copies);
+    seq_buf_printf(s, "DuplicatesFound: %ld\n", atomic_long_read(&s2fs_zstats.duplicates));
+    return 0;
+}
+
+static void s2fs_meminfo_tick(struct work_struct *work) {
+    s2fs_invalidate(s2fs_meminfo_entry);
+    s2fs_invalidate(s2fs_compress_entry);
+    s2fs_invalidate(s2fs_dedup_entry);
+    schedule_delayed_work(&s2fs_meminfo_work, HZ);
 }
 
 static int s2fs_open(struct inode *inode, struct file *filp) {
     return 0;
 }
 
-static ssize_t s2fs_read_file(struct file *filp, char __user *buf, size_t count, loff_t *offset) {
-    char *data = "Hello World!\n";
-    size_t datalen = strlen(data);
+// Initial contents of a folio entering the page cache: the file's data from its compressed
+// copy, the log or the image where it has some and no hole was punched, zeros everywhere
+// else. Returns 1 if any page came from a compressed copy, which the caller drops once the
+// folio is in the page cache.
+static int s2fs_fill_folio(struct inode *inode, struct folio *folio) {
+    struct s2fs_inode_info *info = S2FS_I(inode);
+    struct file *image = S2FS_SB(inode->i_sb)->image;
+    loff_t pos = folio_pos(folio);
+    int ret, unzipped = 0;
+    long i;
+
+    for (i = 0; i < folio_nr_pages(folio); i++, pos += PAGE_SIZE) {
+        void *kaddr, *entry;
+        loff_t ckpt_len;
+        ssize_t n = 0;
+
+        ret = s2fs_unzip(inode, folio, i);
+        if (ret < 0)
+            return ret;
+        if (ret) {
+            unzipped = 1;
+            continue;
+        }
+
+        kaddr = kmap_local_folio(folio, i * PAGE_SIZE);
+        entry = xa_load(&info->ckpt_map, folio->index + i);
+        ckpt_len = READ_ONCE(info->ckpt_len);
+
+        if (entry && pos < ckpt_len) {
+            struct s2fs_sb_info *sbi = S2FS_SB(inode->i_sb);
+            loff_t log_pos;
+
+            // Looked up again, as compaction may have moved the page to a new log meanwhile.
+            down_read(&sbi->ckpt_sem);
+            entry = xa_load(&info->ckpt_map, folio->index + i);
+            if (entry) {
+                log_pos = (loff_t)xa_to_value(entry) << PAGE_SHIFT;
+                n = kernel_read(sbi->ckpt, kaddr, min_t(loff_t, PAGE_SIZE, ckpt_len - pos), &log_pos);
+            }
+            up_read(&sbi->ckpt_sem);
+            if (n < 0) {
+                kunmap_local(kaddr);
+                return n;
+            }
+        } else if (pos < info->image_len && !s2fs_punched(info, folio->index + i)) {
+            loff_t image_pos = info->image_off + pos;
+
+            n = kernel_read(image, kaddr, min_t(loff_t, PAGE_SIZE, info->image_len - pos), &image_pos);
+            if (n < 0) {
+                kunmap_local(kaddr);
+                return n;
+            }
+        }
+        memset(kaddr + n, 0, PAGE_SIZE - n);
+        kunmap_local(kaddr);
+    }
+    flush_dcache_folio(folio);
+    folio_mark_uptodate(folio);
+    return unzipped;
+}
+
+// The compressed copies a filled folio was made from are dropped once it is in the page
+// cache, so its pages are charged once. It holds the only copy of that data again, so it is
+// dirty like a written one.
+static void s2fs_unzipped(struct inode *inode, struct folio *folio) {
+    folio_mark_dirty(folio);
+    s2fs_zmap_drop(inode, folio->index, folio->index + folio_nr_pages(folio) - 1, true);
+}
+
+// A page that was never written reads as zeros, or as its image data. It is in the page
+// cache now, so it is charged like a written one.
+static int s2fs_read_folio(struct file *filp, struct folio *folio) {
+    struct inode *inode = folio->mapping->host;
+    int ret = s2fs_charge(inode, folio_nr_pages(folio));
+
+    if (!ret) {
+        ret = s2fs_fill_folio(inode, folio);
+        if (ret < 0)
+            s2fs_uncharge(inode, folio_nr_pages(folio));
+        else if (ret)
+            s2fs_unzipped(inode, folio);
+    }
+    folio_unlock(folio);
+    return min(ret, 0);
+}
+
+// Sparse files
+// A page holds data if it is cached, held compressed or shared, or has data in the log or
+// the image that no hole was punched into. Every other page of a file is a hole: it takes no
+// memory, reads as zeros without entering the page cache and is skipped by SEEK_DATA. Holes
+// come from writing past the end, truncating up and punching. Punching a hole frees what
+// backs the whole pages of the range and zeroes the partial ones at its edges; truncation
+// only visits the pages that hold data, so it costs nothing for a sparse file.
+static bool s2fs_has_data(struct inode *inode, pgoff_t index) {
+    struct s2fs_inode_info *info = S2FS_I(inode);
+    loff_t pos = (loff_t)index << PAGE_SHIFT;
+    void *entry = xa_load(&inode->i_mapping->i_pages, index);
+
+    if (entry && !xa_is_value(entry))
+        return true;
+    if (xa_load(&info->zmap, index))
+        return true;
+    if (pos < READ_ONCE(info->ckpt_len) && xa_load(&info->ckpt_map, index))
+        return true;
+    return pos < info->image_len && !s2fs_punched(info, index);
+}
+
+// The first page from index on, and before end, that holds data, or end. Each source is
+// searched once instead of testing page by page.
+static pgoff_t s2fs_next_data(struct inode *inode, pgoff_t index, pgoff_t end) {
+    struct s2fs_inode_info *info = S2FS_I(inode);
+    pgoff_t ckpt_end = DIV_ROUND_UP(READ_ONCE(info->ckpt_len), PAGE_SIZE);
+    pgoff_t image_end = DIV_ROUND_UP(info->image_len, PAGE_SIZE);
+    unsigned long next;
+    void *entry;
+
+    // Value entries in the page cache are shadows of evicted folios.
+    next = index;
+    entry = xa_find(&inode->i_mapping->i_pages, &next, end - 1, XA_PRESENT);
+    while (entry && xa_is_value(entry))
+        entry = xa_find_after(&inode->i_mapping->i_pages, &next, end - 1, XA_PRESENT);
+    if (entry)
+        end = max(next, index);
+
+    next = index;
+    if (end > index && xa_find(&info->zmap, &next, end - 1, XA_PRESENT))
+        end = next;
+    next = index;
+    if (min(end, ckpt_end) > index && xa_find(&info->ckpt_map, &next, min(end, ckpt_end) - 1, XA_PRESENT))
+        end = next;
+
+    // Image data is contiguous, less whatever holes were punched into it.
+    next = index;
+    while (next < min(end, image_end)) {
+        MA_STATE(mas, &info->holes, next, next);
+
+        rcu_read_lock();
+        entry = mas_walk(&mas);
+        rcu_read_unlock();
+        if (!entry) {
+            end = next;
+            break;
+        }
+        next = mas.last + 1;
+    }
+    return end;
+}
+
+// The first index from index on, and before end, that xa has no entry at, or end. With
+// shadows set, value entries count as missing, as the page cache's do.
+static pgoff_t s2fs_xa_next_miss(struct xarray *xa, pgoff_t index, pgoff_t end, bool shadows) {
+    XA_STATE(xas, xa, index);
+    void *entry;
+
+    rcu_read_lock();
+    for (;;) {
+        entry = xas_next(&xas);
+        if (xas_retry(&xas, entry))
+            continue;
+        if (!entry || (shadows && xa_is_value(entry)) || xas.xa_index + 1 >= end)
+            break;
+        if (!((xas.xa_index + 1) % PAGEVEC_SIZE)) {
+            xas_pause(&xas);
+            rcu_read_unlock();
+            cond_resched();
+            rcu_read_lock();
+        }
+    }
+    rcu_read_unlock();
+    return entry && !(shadows && xa_is_value(entry)) ? end : xas.xa_index;
+}
+
+// The first page from index on, and before end, that is a hole, or end. Each source gives
+// the end of the run of data it has at index, and the search moves on to the furthest one
+// until no source has data there, so each source is searched once instead of testing page
+// by page.
+static pgoff_t s2fs_next_hole(struct inode *inode, pgoff_t index, pgoff_t end) {
+    struct s2fs_inode_info *info = S2FS_I(inode);
+    pgoff_t ckpt_end = min_t(pgoff_t, DIV_ROUND_UP(READ_ONCE(info->ckpt_len), PAGE_SIZE), end);
+    pgoff_t image_end = min_t(pgoff_t, DIV_ROUND_UP(info->image_len, PAGE_SIZE), end);
+    pgoff_t next;
+
+    while (index < end) {
+        next = s2fs_xa_next_miss(&inode->i_mapping->i_pages, index, end, true);
+        next = max(next, s2fs_xa_next_miss(&info->zmap, index, end, false));
+        if (index < ckpt_end)
+            next = max(next, s2fs_xa_next_miss(&info->ckpt_map, index, ckpt_end, false));
+        // Image data is contiguous up to the next hole punched into it.
+        if (index < image_end) {
+            MA_STATE(mas, &info->holes, index, index);
+
+            rcu_read_lock();
+            if (!mas_walk(&mas))
+                next = max(next, mas.last >= image_end - 1 ? image_end : (pgoff_t)mas.last + 1);
+            rcu_read_unlock();
+        }
+        if (next == index)
+            break;
+        index = next;
+    }
+    return index;
+}
+
+// Runs of holes are copied out as zeros and runs of data read through the page cache, so
+// reading a sparse file never fills it in. A page that gains data meanwhile may still read
+// as zeros, as if the read had come first.
+static ssize_t s2fs_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t ret = 0, done = 0;
+    bool read_data = false;
+
+    while (iov_iter_count(to)) {
+        size_t count = iov_iter_count(to);
+        loff_t pos = iocb->ki_pos, size = i_size_read(inode);
+        pgoff_t index = pos >> PAGE_SHIFT, end, next;
+        size_t n;
+
+        if (pos >= size)
+            break;
+        n = min_t(loff_t, count, size - pos);
+        end = DIV_ROUND_UP(pos + n, PAGE_SIZE);
+
+        next = s2fs_next_data(inode, index, end);
+        if (next > index) {
+            n = min_t(loff_t, n, ((loff_t)next << PAGE_SHIFT) - pos);
+            ret = iov_iter_zero(n, to);
+            if (!ret) {
+                ret = -EFAULT;
+                break;
+            }
+            iocb->ki_pos += ret;
+            done += ret;
+            if (ret < n)
+                break;
+            continue;
+        }
+
+        next = s2fs_next_hole(inode, index, end);
+        n = min_t(loff_t, n, ((loff_t)next << PAGE_SHIFT) - pos);
+        iov_iter_truncate(to, n);
+        ret = filemap_read(iocb, to, 0);
+        read_data = true;
+        iov_iter_reexpand(to, count - max_t(ssize_t, ret, 0));
+        if (ret <= 0)
+            break;
+        done += ret;
+        if (ret < n)
+            break;
+    }
+    // filemap_read() updates the access time itself.
+    if (!read_data)
+        file_accessed(iocb->ki_filp);
+    return done ? done : ret;
+}
+
+static loff_t s2fs_llseek(struct file *filp, loff_t offset, int whence) {
+    struct inode *inode = file_inode(filp);
+    pgoff_t index, end, next;
+    loff_t size;
+
+    if (whence != SEEK_DATA && whence != SEEK_HOLE)
+        return generic_file_llseek(filp, offset, whence);
+
+    inode_lock_shared(inode);
+    size = i_size_read(inode);
+    if (offset < 0 || offset >= size) {
+        offset = -ENXIO;
+    } else {
+        index = offset >> PAGE_SHIFT;
+        end = DIV_ROUND_UP(size, PAGE_SIZE);
+        next = whence == SEEK_DATA ? s2fs_next_data(inode, index, end) : s2fs_next_hole(inode, index, end);
+        if (next > index)
+            offset = (loff_t)next << PAGE_SHIFT;
+        // The end of the file counts as a hole.
+        if (offset >= size)
+            offset = whence == SEEK_DATA ? -ENXIO : size;
+    }
+    if (offset >= 0)
+        offset = vfs_setpos(filp, offset, inode->i_sb->s_maxbytes);
+    inode_unlock_shared(inode);
+    return offset;
+}
+
+// Punches the hole [offset, end). Partial pages at its edges keep data on their other side,
+// so any that hold data are brought into the page cache to be zeroed there, and dirtied so
+// the zeroed copy is the one kept. What backs the whole pages in between goes before the
+// pages themselves, under the invalidate lock, so nothing fills them from it again.
+static int s2fs_punch_hole(struct inode *inode, loff_t offset, loff_t end) {
+    struct s2fs_inode_info *info = S2FS_I(inode);
+    struct address_space *mapping = inode->i_mapping;
+    pgoff_t first = DIV_ROUND_UP(offset, PAGE_SIZE), last = end >> PAGE_SHIFT;
+    pgoff_t edges[2] = { offset >> PAGE_SHIFT, end >> PAGE_SHIFT };
+    bool partial[2] = { offset_in_page(offset), offset_in_page(end) };
+    pgoff_t src = DIV_ROUND_UP(max(info->image_len, READ_ONCE(info->ckpt_len)), PAGE_SIZE);
+    struct folio *folio;
+    int i, ret = 0;
+
+    for (i = 0; i < 2; i++) {
+        if (!partial[i] || !s2fs_has_data(inode, edges[i]))
+            continue;
+        folio = read_mapping_folio(mapping, edges[i], NULL);
+        if (IS_ERR(folio))
+            return PTR_ERR(folio);
+        folio_put(folio);
+    }
+
+    filemap_invalidate_lock(mapping);
+    if (first < last) {
+        if (first < src)
+            ret = mtree_store_range(&info->holes, first, min(last, src) - 1, S2FS_HOLE, GFP_KERNEL);
+        if (!ret) {
+            s2fs_ckpt_punch(inode, first, last - 1);
+            s2fs_zmap_drop(inode, first, last - 1, false);
+        }
+    }
+    if (!ret)
+        truncate_pagecache_range(inode, offset, end - 1);
+    filemap_invalidate_unlock(mapping);
+    if (ret)
+        return ret;
+
+    for (i = 0; i < 2; i++) {
+        if (!partial[i])
+            continue;
+        folio = filemap_lock_folio(mapping, edges[i]);
+        if (!folio)
+            continue;
+        if (!folio_test_large(folio))
+            folio_clear_checked(folio);
+        folio_mark_dirty(folio);
+        folio_unlock(folio);
+        folio_put(folio);
+        s2fs_ckpt_dirty(inode, edges[i], edges[i]);
+    }
+    return 0;
+}
+
+// Preallocation fills every page of [offset, end) in the page cache now, charged and dirty
+// so it stays, and later writes there cannot run out of room. Pages that already held data
+// keep it. If the mount fills up partway, the pages preallocated so far stay.
+static int s2fs_prealloc(struct inode *inode, loff_t offset, loff_t end) {
+    struct address_space *mapping = inode->i_mapping;
+    pgoff_t index = offset >> PAGE_SHIFT, last = (end - 1) >> PAGE_SHIFT;
+    struct folio *folio;
+
+    while (index <= last) {
+        folio = read_mapping_folio(mapping, index, NULL);
+        if (IS_ERR(folio))
+            return PTR_ERR(folio);
+        folio_lock(folio);
+        if (folio->mapping == mapping)
+            folio_mark_dirty(folio);
+        folio_unlock(folio);
+        index = folio->index + folio_nr_pages(folio);
+        folio_put(folio);
+
+        if (fatal_signal_pending(current))
+            return -EINTR;
+        cond_resched();
+    }
+    return 0;
+}
+
+static long s2fs_fallocate(struct file *filp, int mode, loff_t offset, loff_t len) {
+    struct inode *inode = file_inode(filp);
+    loff_t end = offset + len, size;
+    bool changed = true;
+    int ret;
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+        return -EOPNOTSUPP;
+
+    inode_lock(inode);
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        ret = s2fs_punch_hole(inode, offset, end);
+    } else {
+        size = i_size_read(inode);
+        ret = inode_newsize_ok(inode, end);
+        if (!ret)
+            ret = s2fs_prealloc(inode, offset, end);
+        if (!ret && !(mode & FALLOC_FL_KEEP_SIZE) && end > size)
+            i_size_write(inode, end);
+        changed = i_size_read(inode) != size;
+    }
+    if (!ret && changed) {
+        inode->i_mtime = inode->i_ctime = current_time(inode);
+        s2fs_ckpt_mark(inode);
+    }
+    s2fs_recalc_inode(inode);
+    inode_unlock(inode);
+    return ret;
+}
+
+// Large folios
+// Order of the folio to allocate at index, for the huge= policy. Zero if the PMD-sized
+// range around index would not fit, in which case the caller falls back to a single page.
+static unsigned int s2fs_folio_order(struct inode *inode, pgoff_t index, loff_t end) {
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    pgoff_t first = round_down(index, HPAGE_PMD_NR);
 
-    if (*offset > datalen)
+    // Only set on files created while huge= was not never, which a remount may change since.
+    if (!mapping_large_folio_support(inode->i_mapping))
+        return 0;
+    switch (S2FS_SB(inode->i_sb)->huge) {
+    case S2FS_HUGE_ALWAYS:
+        return HPAGE_PMD_ORDER;
+    case S2FS_HUGE_WITHIN_SIZE:
+        end = max(end, i_size_read(inode));
+        if (DIV_ROUND_UP(end, PAGE_SIZE) >= first + HPAGE_PMD_NR)
+            return HPAGE_PMD_ORDER;
         return 0;
+    default:
+        return 0;
+    }
+#else
+    return 0;
+#endif
+}
 
-    if (count > datalen - *offset)
-        count = datalen - *offset;
+// A new folio of the given order covering index, filled, uptodate and locked in the page
+// cache. Returns -EEXIST if any page of its range is already cached, and -ENOSPC if the
+// mount has no room for it.
+static struct folio *s2fs_add_folio(struct address_space *mapping, pgoff_t index, unsigned int order) {
+    gfp_t gfp = mapping_gfp_mask(mapping);
+    struct folio *folio;
+    int ret, unzipped;
 
-    if (copy_to_user(buf, data + *offset, count)) {
-        return -EFAULT;
+    ret = s2fs_charge(mapping->host, 1L << order);
+    if (ret)
+        return ERR_PTR(ret);
+
+    if (order)
+        gfp |= __GFP_COMP | __GFP_NORETRY | __GFP_NOWARN;
+    folio = folio_alloc(gfp, order);
+    if (!folio) {
+        s2fs_uncharge(mapping->host, 1L << order);
+        return ERR_PTR(-ENOMEM);
     }
 
-    *offset += count;
-    return count;
+    // The image is read at the folio's final position, before anyone can see it.
+    folio->index = round_down(index, 1UL << order);
+    unzipped = s2fs_fill_folio(mapping->host, folio);
+    ret = min(unzipped, 0);
+    if (!ret)
+        ret = filemap_add_folio(mapping, folio, folio->index, mapping_gfp_mask(mapping));
+    if (ret) {
+        folio_put(folio);
+        s2fs_uncharge(mapping->host, 1L << order);
+        return ERR_PTR(ret);
+    }
+    if (unzipped)
+        s2fs_unzipped(mapping->host, folio);
+    return folio;
+}
+
+// Writes land in the cached folio covering pos, or in a new one sized by the huge= policy.
+// New folios start filled and uptodate, so a short copy never leaves stale data behind.
+static int s2fs_write_begin(struct file *filp, struct address_space *mapping, loff_t pos, unsigned int len,
+                            struct page **pagep, void **fsdata) {
+    pgoff_t index = pos >> PAGE_SHIFT;
+    unsigned int order;
+    struct folio *folio;
+
+    order = s2fs_folio_order(mapping->host, index, pos + len);
+    for (;;) {
+        folio = __filemap_get_folio(mapping, index, FGP_LOCK, 0);
+        if (folio)
+            break;
+        folio = s2fs_add_folio(mapping, index, order);
+        if (!IS_ERR(folio))
+            break;
+        if (PTR_ERR(folio) != -EEXIST && !order)
+            return PTR_ERR(folio);
+        // Part of the range is cached already, or there is no room for a huge folio: use one page.
+        order = 0;
+    }
+
+    *pagep = folio_file_page(folio, index);
+    return 0;
+}
+
+static int s2fs_write_end(struct file *filp, struct address_space *mapping, loff_t pos, unsigned int len,
+                          unsigned int copied, struct page *page, void *fsdata) {
+    struct folio *folio = page_folio(page);
+    struct inode *inode = mapping->host;
+
+    // Pages filled by read_folio are uptodate too, so only a short copy into a page that
+    // never had data needs zeroing.
+    if (!folio_test_uptodate(folio)) {
+        if (copied < len)
+            zero_user(page, offset_in_page(pos) + copied, len - copied);
+        folio_mark_uptodate(folio);
+    }
+    if (pos + copied > i_size_read(inode))
+        i_size_write(inode, pos + copied);
+    if (copied)
+        s2fs_ckpt_dirty(inode, pos >> PAGE_SHIFT, (pos + copied - 1) >> PAGE_SHIFT);
+
+    // New data may compress where the old did not, and was just used.
+    if (!folio_test_large(folio))
+        folio_clear_checked(folio);
+    folio_mark_accessed(folio);
+    folio_mark_dirty(folio);
+    folio_unlock(folio);
+    folio_put(folio);
+    return copied;
+}
+
+static int s2fs_mmap(struct file *filp, struct vm_area_struct *vma) {
+    file_accessed(filp);
+    vma->vm_ops = &s2fs_vm_ops;
+    return 0;
 }
 
-static ssize_t s2fs_write_file(struct file *filp, const char __user *buf, size_t count, loff_t *offset) {
+// First store to a page of a shared mapping. The folio is dirtied under its lock, after
+// checking it was not truncated away while the fault was in flight.
+static vm_fault_t s2fs_page_mkwrite(struct vm_fault *vmf) {
+    struct inode *inode = file_inode(vmf->vma->vm_file);
+    struct folio *folio = page_folio(vmf->page);
+    vm_fault_t ret = VM_FAULT_LOCKED;
+
+    sb_start_pagefault(inode->i_sb);
+    file_update_time(vmf->vma->vm_file);
+    folio_lock(folio);
+    if (folio->mapping != inode->i_mapping || folio_pos(folio) >= i_size_read(inode)) {
+        folio_unlock(folio);
+        ret = VM_FAULT_NOPAGE;
+        goto out;
+    }
+    if (!folio_test_large(folio))
+        folio_clear_checked(folio);
+    folio_mark_dirty(folio);
+    s2fs_ckpt_dirty(inode, vmf->pgoff, vmf->pgoff);
+    folio_wait_stable(folio);
+out:
+    sb_end_pagefault(inode->i_sb);
+    return ret;
+}
+
+// Initial contents for a newly created file, written through the page cache.
+static int s2fs_fill_file(struct inode *inode, const char *data, size_t len) {
+    struct address_space *mapping = inode->i_mapping;
+    loff_t pos = 0;
+
+    while (len) {
+        unsigned int offset = offset_in_page(pos);
+        unsigned int n = min_t(size_t, len, PAGE_SIZE - offset);
+        struct page *page;
+        void *fsdata;
+        int ret;
+
+        ret = mapping->a_ops->write_begin(NULL, mapping, pos, n, &page, &fsdata);
+        if (ret)
+            return ret;
+        memcpy_to_page(page, offset, data, n);
+        ret = mapping->a_ops->write_end(NULL, mapping, pos, n, n, page, fsdata);
+        if (ret < 0)
+            return ret;
+        pos += n;
+        data += n;
+        len -= n;
+    }
     return 0;
 }
 
 int s2fs_init(void) {
     int ret;
 
+    s2fs_inode_cachep = kmem_cache_create("s2fs_inode_cache", sizeof(struct s2fs_inode_info), 0,
+                                          SLAB_RECLAIM_ACCOUNT | SLAB_ACCOUNT, s2fs_inode_init_once);
+    if (!s2fs_inode_cachep)
+        return -ENOMEM;
+
+    s2fs_meminfo_entry = s2fs_register("meminfo", s2fs_meminfo_render, NULL);
+    if (IS_ERR(s2fs_meminfo_entry)) {
+        printk(KERN_ERR "s2fs: Failed to register meminfo\n");
+        kmem_cache_destroy(s2fs_inode_cachep);
+        return PTR_ERR(s2fs_meminfo_entry);
+    }
+    s2fs_compress_entry = s2fs_register("compress", s2fs_compress_render, NULL);
+    if (IS_ERR(s2fs_compress_entry)) {
+        printk(KERN_ERR "s2fs: Failed to register compress\n");
+        s2fs_unregister(s2fs_meminfo_entry);
+        kmem_cache_destroy(s2fs_inode_cachep);
+        return PTR_ERR(s2fs_compress_entry);
+    }
+    s2fs_dedup_entry = s2fs_register("dedup", s2fs_dedup_render, NULL);
+    if (IS_ERR(s2fs_dedup_entry)) {
+        printk(KERN_ERR "s2fs: Failed to register dedup\n");
+        s2fs_unregister(s2fs_compress_entry);
+        s2fs_unregister(s2fs_meminfo_entry);
+        kmem_cache_destroy(s2fs_inode_cachep);
+        return PTR_ERR(s2fs_dedup_entry);
+    }
+    schedule_delayed_work(&s2fs_meminfo_work, HZ);
+
     ret = register_filesystem(&s2fs_type);
     if (ret != 0) {
         printk(KERN_ERR "s2fs: Failed to register file system\n");
+        cancel_delayed_work_sync(&s2fs_meminfo_work);
+        s2fs_unregister(s2fs_dedup_entry);
+        s2fs_unregister(s2fs_compress_entry);
+        s2fs_unregister(s2fs_meminfo_entry);
+        kmem_cache_destroy(s2fs_inode_cachep);
         return ret;
     }
 
@@ -199,6 +4449,15 @@ void s2fs_exit(void) {
     if (ret != 0)
         printk(KERN_ERR "s2fs: Failed to unregister file system\n");
 
+    cancel_delayed_work_sync(&s2fs_meminfo_work);
+    s2fs_unregister(s2fs_dedup_entry);
+    s2fs_unregister(s2fs_compress_entry);
+    s2fs_unregister(s2fs_meminfo_entry);
+
+    // Inodes and dropped copies are freed after an RCU grace period.
+    rcu_barrier();
+    kmem_cache_destroy(s2fs_inode_cachep);
+
     printk(KERN_INFO "s2fs: File system unregistered\n");
 }
 
@@ -0,0 +1,24 @@
+#ifndef _S2FS_H
+#define _S2FS_H
+
+#include <linux/seq_buf.h>
+
+// Generated files in the stats directory of every s2fs mount.
+//
+// A module registers a render callback under a name. The callback prints the file into s;
+// if s overflows it is called again with a larger buffer. Content is rendered on the first
+// open after registration or after s2fs_invalidate(), and every open until the next
+// invalidation shares that rendered copy. An open file keeps the copy it started with, so
+// a reader never sees two generations mixed.
+//
+// After s2fs_unregister() returns the callback is never called again and priv is no longer
+// used; files still open keep reading their last copy.
+struct s2fs_entry;
+
+typedef int (*s2fs_render_t)(struct seq_buf *s, void *priv);
+
+struct s2fs_entry *s2fs_register(const char *name, s2fs_render_t render, void *priv);
+void s2fs_unregister(struct s2fs_entry *entry);
+void s2fs_invalidate(struct s2fs_entry *entry);
+
+#endif /* _S2FS_H */
@@ -0,0 +1,284 @@
+// Userspace benchmark for files on a mounted s2fs.
+//
+// Fills a file of the given size, then reads it back repeatedly with read() into a buffer
+// and through shared and private mappings, summing every 64-bit word so both sides touch
+// the same data. Reports the best and median throughput over the repetitions and fails if
+// any way of reading disagrees with the others. Where perf events are available, the dTLB
+// misses of each run are reported too, to compare mounts with and without huge=.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static size_t file_size = 256UL << 20;
+static size_t buf_size = 128UL << 10;
+static int repetitions = 10;
+static int tlb_fd = -1;
+
+struct bench {
+    const char *name;
+    uint64_t (*run)(int fd); // Returns the sum of every 64-bit word of the file.
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t sum_words(const uint64_t *words, size_t n) {
+    uint64_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        sum += words[i];
+    return sum;
+}
+
+// Setup
+// Word i of the file holds i, so the expected sum is known without reading it.
+static int fill_file(int fd) {
+    uint64_t *buf = malloc(buf_size);
+    size_t off, i;
+
+    if (!buf)
+        return -1;
+    if (ftruncate(fd, 0)) {
+        free(buf);
+        return -1;
+    }
+    for (off = 0; off < file_size; off += buf_size) {
+        for (i = 0; i < buf_size / sizeof(*buf); i++)
+            buf[i] = off / sizeof(*buf) + i;
+        if (pwrite(fd, buf, buf_size, off) != (ssize_t)buf_size) {
+            free(buf);
+            return -1;
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+// dTLB load misses of this process, or -1 if perf events are unavailable.
+static int tlb_open(void) {
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HW_CACHE,
+        .size = sizeof(attr),
+        .config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        .disabled = 1,
+        .exclude_hv = 1,
+    };
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void tlb_start(void) {
+    if (tlb_fd >= 0) {
+        ioctl(tlb_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(tlb_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static uint64_t tlb_stop(void) {
+    uint64_t misses = 0;
+
+    if (tlb_fd >= 0) {
+        ioctl(tlb_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(tlb_fd, &misses, sizeof(misses)) != sizeof(misses))
+            misses = 0;
+    }
+    return misses;
+}
+
+// Benchmarks
+static uint64_t run_read(int fd) {
+    uint64_t *buf = malloc(buf_size), sum = 0;
+    ssize_t n;
+    off_t off = 0;
+
+    if (!buf)
+        return 0;
+    while ((n = pread(fd, buf, buf_size, off)) > 0) {
+        sum += sum_words(buf, n / sizeof(*buf));
+        off += n;
+    }
+    free(buf);
+    return sum;
+}
+
+static uint64_t run_mmap(int fd, int flags) {
+    uint64_t *map, sum;
+
+    map = mmap(NULL, file_size, PROT_READ, flags, fd, 0);
+    if (map == MAP_FAILED)
+        return 0;
+    sum = sum_words(map, file_size / sizeof(*map));
+    munmap(map, file_size);
+    return sum;
+}
+
+static uint64_t run_mmap_shared(int fd) {
+    return run_mmap(fd, MAP_SHARED);
+}
+
+static uint64_t run_mmap_private(int fd) {
+    return run_mmap(fd, MAP_PRIVATE);
+}
+
+// Populating up front maps every page in one call instead of one fault per fault-around block.
+static uint64_t run_mmap_populate(int fd) {
+    return run_mmap(fd, MAP_SHARED | MAP_POPULATE);
+}
+
+// Every word is read and stored back through a shared mapping, so each page takes a write
+// fault and is dirtied by page_mkwrite. The stored values are what the file already held,
+// so later repetitions and the other benchmarks still see the same sum.
+static uint64_t run_mmap_write(int fd) {
+    uint64_t *map, sum = 0;
+    size_t i;
+
+    map = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return 0;
+    for (i = 0; i < file_size / sizeof(*map); i++) {
+        sum += map[i];
+        map[i] = i;
+    }
+    munmap(map, file_size);
+    return sum;
+}
+
+// Rewrites the whole file with pwrite(). Large folios mean fewer allocations and lookups.
+static uint64_t run_write(int fd) {
+    uint64_t *buf = malloc(buf_size), sum = 0;
+    size_t off, i;
+
+    if (!buf)
+        return 0;
+    for (off = 0; off < file_size; off += buf_size) {
+        for (i = 0; i < buf_size / sizeof(*buf); i++) {
+            buf[i] = off / sizeof(*buf) + i;
+            sum += buf[i];
+        }
+        if (pwrite(fd, buf, buf_size, off) != (ssize_t)buf_size)
+            break;
+    }
+    free(buf);
+    return sum;
+}
+
+static struct bench benches[] = {
+    { "write", run_write },
+    { "read", run_read },
+    { "mmap_shared", run_mmap_shared },
+    { "mmap_private", run_mmap_private },
+    { "mmap_populate", run_mmap_populate },
+    { "mmap_write", run_mmap_write },
+};
+
+// Driver
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double gib_per_s(uint64_t ns) {
+    return ns ? (double)file_size / ns * 1e9 / (1UL << 30) : 0;
+}
+
+static int run_bench(struct bench *b, int fd, uint64_t expect) {
+    uint64_t *ns = calloc(repetitions, sizeof(*ns)), start, sum, misses = 0;
+    int i, ret = 0;
+
+    if (!ns)
+        return -1;
+    for (i = 0; i < repetitions; i++) {
+        tlb_start();
+        start = now_ns();
+        sum = b->run(fd);
+        ns[i] = now_ns() - start;
+        misses += tlb_stop();
+        if (sum != expect) {
+            fprintf(stderr, "%s: sum %llu, expected %llu\n", b->name,
+                    (unsigned long long)sum, (unsigned long long)expect);
+            ret = -1;
+        }
+    }
+    qsort(ns, repetitions, sizeof(*ns), cmp_u64);
+    printf("%-16s best %7.2f GiB/s  median %7.2f GiB/s", b->name,
+           gib_per_s(ns[0]), gib_per_s(ns[repetitions / 2]));
+    if (tlb_fd >= 0)
+        printf("  dTLB misses %10.1f per MiB", (double)misses / repetitions / (file_size >> 20));
+    printf("\n");
+    free(ns);
+    return ret;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-s size_mb] [-b buf_kb] [-r repetitions] file [bench...]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t words, expect;
+    int opt, fd, i, j, ret = 0;
+
+    while ((opt = getopt(argc, argv, "s:b:r:")) != -1) {
+        switch (opt) {
+        case 's':
+            file_size = strtoul(optarg, NULL, 0) << 20;
+            break;
+        case 'b':
+            buf_size = strtoul(optarg, NULL, 0) << 10;
+            break;
+        case 'r':
+            repetitions = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || !file_size || !buf_size || file_size % buf_size || repetitions <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    fd = open(argv[optind], O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || fill_file(fd)) {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    tlb_fd = tlb_open();
+    words = file_size / sizeof(uint64_t);
+    expect = words * (words - 1) / 2;
+
+    printf("%zu MiB file, %zu KiB read buffer, %d repetitions\n", file_size >> 20, buf_size >> 10, repetitions);
+    for (i = 0; i < (int)(sizeof(benches) / sizeof(benches[0])); i++) {
+        bool pick = optind + 1 >= argc;
+
+        for (j = optind + 1; j < argc; j++)
+            pick |= strstr(benches[i].name, argv[j]) != NULL;
+        if (pick && run_bench(&benches[i], fd, expect))
+            ret = 1;
+    }
+
+    if (tlb_fd >= 0)
+        close(tlb_fd);
+    close(fd);
+    return ret;
+}
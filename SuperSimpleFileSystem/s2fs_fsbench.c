@@ -0,0 +1,515 @@
+// fio-style benchmark suite comparing s2fs with tmpfs and ramfs.
+//
+// With -m it mounts s2fs, tmpfs and ramfs side by side under a fresh directory in /tmp
+// (which needs root and the s2fs module loaded), and unmounts them at the end; otherwise it
+// runs on whatever directories are given, one column each. Every target runs the same jobs:
+//
+//   seq_write, seq_read, rand_read, rand_write
+//       at each block size given with -b, each thread on a file of its own. The total
+//       amount of data stays -s MiB whatever the thread count, so columns compare directly.
+//   create, stat, unlink
+//       of -n files per thread, each thread in a directory of its own.
+//   sh_create, sh_stat, sh_missing, sh_unlink
+//       the same in one directory shared by all threads, which adds the directory lock the
+//       VFS holds across every create and unlink, and sh_missing looks up a few names the
+//       directory does not have over and over, like a $PATH search.
+//
+// Each job runs once single-threaded and once with -t threads, or with -S at 1, 2, 4, ...
+// threads up to -t, to see how it scales. The threads are released together by a barrier
+// and timed from the first one starting to the last one finishing. The report has one row
+// per job and thread count, with MiB/s for data and thousands of operations per second for
+// metadata, and every column after the first also shows its ratio to the first.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_TARGETS 8
+#define MAX_SIZES 8
+#define MAX_ROWS 256
+#define MISSING_NAMES 256
+
+static size_t total_size = 256UL << 20;
+static size_t block_sizes[MAX_SIZES] = { 4UL << 10, 64UL << 10, 1UL << 20 };
+static int nr_block_sizes = 3;
+static int max_threads;
+static bool sweep;
+static int files_per_thread = 10000;
+static const char *s2fs_opts = "";
+
+struct target {
+    const char *name;
+    char path[PATH_MAX];
+    bool mounted;
+};
+
+static struct target targets[MAX_TARGETS];
+static int nr_targets;
+
+// One row of the report: a job at a block size and thread count, with a result per target.
+struct row {
+    char name[32];
+    int threads;
+    bool meta; // Result is in operations per second rather than bytes per second.
+    double result[MAX_TARGETS];
+};
+
+static struct row rows[MAX_ROWS];
+static int nr_rows;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t *state) {
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// Records result for target t in the row named name, adding the row on first use.
+static void report(const char *name, int threads, bool meta, int t, double result) {
+    int i;
+
+    for (i = 0; i < nr_rows; i++) {
+        if (!strcmp(rows[i].name, name) && rows[i].threads == threads)
+            break;
+    }
+    if (i == nr_rows) {
+        if (nr_rows == MAX_ROWS)
+            return;
+        snprintf(rows[i].name, sizeof(rows[i].name), "%s", name);
+        rows[i].threads = threads;
+        rows[i].meta = meta;
+        nr_rows++;
+    }
+    rows[i].result[t] = result;
+}
+
+// Workers
+enum op {
+    OP_SEQ_WRITE,
+    OP_SEQ_READ,
+    OP_RAND_READ,
+    OP_RAND_WRITE,
+    OP_CREATE,
+    OP_STAT,
+    OP_UNLINK,
+    OP_SHARED_CREATE,
+    OP_SHARED_STAT,
+    OP_MISSING,
+    OP_SHARED_UNLINK,
+};
+
+static const char *op_names[] = {
+    [OP_SEQ_WRITE] = "seq_write",
+    [OP_SEQ_READ] = "seq_read",
+    [OP_RAND_READ] = "rand_read",
+    [OP_RAND_WRITE] = "rand_write",
+    [OP_CREATE] = "create",
+    [OP_STAT] = "stat",
+    [OP_UNLINK] = "unlink",
+    [OP_SHARED_CREATE] = "sh_create",
+    [OP_SHARED_STAT] = "sh_stat",
+    [OP_MISSING] = "sh_missing",
+    [OP_SHARED_UNLINK] = "sh_unlink",
+};
+
+struct worker {
+    pthread_t thread;
+    pthread_barrier_t *barrier;
+    enum op op;
+    const char *dir;
+    int id;
+    size_t size; // Of this worker's file.
+    size_t bs;
+    uint64_t start, end;
+    int ret;
+    int err; // errno of the call that failed, or EIO for a short read or write.
+};
+
+static void file_path(char *path, const struct worker *w) {
+    snprintf(path, PATH_MAX, "%s/fsbench.%d", w->dir, w->id);
+}
+
+static void meta_path(char *path, const struct worker *w, int i) {
+    if (w->op == OP_MISSING)
+        snprintf(path, PATH_MAX, "%s/fsbench.shared/missing.%d.%d", w->dir, w->id, i % MISSING_NAMES);
+    else if (w->op >= OP_SHARED_CREATE)
+        snprintf(path, PATH_MAX, "%s/fsbench.shared/%d.%d", w->dir, w->id, i);
+    else
+        snprintf(path, PATH_MAX, "%s/fsbench.meta.%d/%d", w->dir, w->id, i);
+}
+
+static int run_io(struct worker *w, int fd, char *buf) {
+    size_t blocks = w->size / w->bs, i, off;
+    uint64_t rng = 0x9e3779b97f4a7c15ULL * (w->id + 1);
+    bool write = w->op == OP_SEQ_WRITE || w->op == OP_RAND_WRITE;
+    bool rand = w->op == OP_RAND_READ || w->op == OP_RAND_WRITE;
+    ssize_t n;
+
+    for (i = 0; i < blocks; i++) {
+        off = (rand ? xorshift(&rng) % blocks : i) * w->bs;
+        n = write ? pwrite(fd, buf, w->bs, off) : pread(fd, buf, w->bs, off);
+        if (n != (ssize_t)w->bs)
+            return -1;
+    }
+    return 0;
+}
+
+static int run_meta(struct worker *w) {
+    char path[PATH_MAX];
+    struct stat st;
+    int i, fd;
+
+    for (i = 0; i < files_per_thread; i++) {
+        meta_path(path, w, i);
+        switch (w->op) {
+        case OP_CREATE:
+        case OP_SHARED_CREATE:
+            fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+            if (fd < 0)
+                return -1;
+            close(fd);
+            break;
+        case OP_STAT:
+        case OP_SHARED_STAT:
+            if (stat(path, &st))
+                return -1;
+            break;
+        case OP_MISSING:
+            if (!stat(path, &st)) {
+                errno = EEXIST;
+                return -1;
+            }
+            if (errno != ENOENT)
+                return -1;
+            break;
+        default:
+            if (unlink(path))
+                return -1;
+            break;
+        }
+    }
+    return 0;
+}
+
+// Files are opened and buffers allocated before the barrier, so only the job is timed.
+static void *worker_fn(void *arg) {
+    struct worker *w = arg;
+    char path[PATH_MAX];
+    char *buf = NULL;
+    int fd = -1;
+
+    w->ret = 0;
+    errno = 0;
+    if (w->op <= OP_RAND_WRITE) {
+        file_path(path, w);
+        fd = open(path, O_RDWR | O_CREAT, 0644);
+        buf = malloc(w->bs);
+        if (fd < 0 || !buf)
+            w->ret = -1;
+        else
+            memset(buf, 0x5a, w->bs);
+    }
+    pthread_barrier_wait(w->barrier);
+    w->start = now_ns();
+    if (!w->ret)
+        w->ret = w->op <= OP_RAND_WRITE ? run_io(w, fd, buf) : run_meta(w);
+    w->end = now_ns();
+    if (w->ret)
+        w->err = errno ? errno : EIO;
+
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    return NULL;
+}
+
+// Runs op on threads workers in dir and returns the time from the first worker starting to
+// the last one finishing in ns, or 0 on a failure.
+static uint64_t run_job(const char *dir, enum op op, int threads, size_t bs) {
+    struct worker *workers = calloc(threads, sizeof(*workers));
+    pthread_barrier_t barrier;
+    uint64_t start = UINT64_MAX, end = 0;
+    int i, err = 0;
+
+    if (!workers)
+        return 0;
+    pthread_barrier_init(&barrier, NULL, threads);
+    for (i = 0; i < threads; i++) {
+        workers[i] = (struct worker){
+            .barrier = &barrier,
+            .op = op,
+            .dir = dir,
+            .id = i,
+            .size = total_size / threads,
+            .bs = bs,
+        };
+        if (pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i])) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].ret && !err)
+            err = workers[i].err;
+        if (workers[i].start < start)
+            start = workers[i].start;
+        if (workers[i].end > end)
+            end = workers[i].end;
+    }
+    pthread_barrier_destroy(&barrier);
+    free(workers);
+    if (err) {
+        fprintf(stderr, "%s: %s failed: %s\n", dir, op_names[op], strerror(err));
+        return 0;
+    }
+    return end > start ? end - start : 1;
+}
+
+static void cleanup_files(const char *dir, int threads) {
+    struct worker w = { .dir = dir };
+    char path[PATH_MAX];
+
+    for (w.id = 0; w.id < threads; w.id++) {
+        file_path(path, &w);
+        unlink(path);
+    }
+}
+
+static void bench_io(int t, int threads) {
+    const char *dir = targets[t].path;
+    char name[32];
+    uint64_t ns, bytes;
+    int b, op;
+
+    for (b = 0; b < nr_block_sizes; b++) {
+        size_t bs = block_sizes[b];
+
+        if (total_size / threads < bs)
+            continue;
+        // seq_write comes first and lays the files out for the others.
+        for (op = OP_SEQ_WRITE; op <= OP_RAND_WRITE; op++) {
+            ns = run_job(dir, op, threads, bs);
+            snprintf(name, sizeof(name), "%s %zuk", op_names[op], bs >> 10);
+            bytes = total_size / threads / bs * bs * threads;
+            report(name, threads, false, t, ns ? (double)bytes / ns * 1e9 : 0);
+        }
+        cleanup_files(dir, threads);
+    }
+}
+
+static void bench_meta(int t, int threads) {
+    const char *dir = targets[t].path;
+    char path[PATH_MAX];
+    uint64_t ns;
+    int i, op;
+
+    for (i = 0; i <= threads; i++) {
+        if (i < threads)
+            snprintf(path, sizeof(path), "%s/fsbench.meta.%d", dir, i);
+        else
+            snprintf(path, sizeof(path), "%s/fsbench.shared", dir);
+        if (mkdir(path, 0755) && errno != EEXIST) {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            return;
+        }
+    }
+    // Each unlink comes after the jobs that use its files and empties the directories again.
+    for (op = OP_CREATE; op <= OP_SHARED_UNLINK; op++) {
+        ns = run_job(dir, op, threads, 0);
+        report(op_names[op], threads, true, t, ns ? (double)files_per_thread * threads / ns * 1e9 : 0);
+    }
+    for (i = 0; i < threads; i++) {
+        snprintf(path, sizeof(path), "%s/fsbench.meta.%d", dir, i);
+        rmdir(path);
+    }
+    snprintf(path, sizeof(path), "%s/fsbench.shared", dir);
+    rmdir(path);
+}
+
+// Mounting
+static char mount_root[] = "/tmp/s2fs_fsbench.XXXXXX";
+
+static int mount_targets(void) {
+    static const char *types[] = { "s2fs", "tmpfs", "ramfs" };
+    int i;
+
+    if (!mkdtemp(mount_root)) {
+        perror(mount_root);
+        return -1;
+    }
+    for (i = 0; i < 3; i++) {
+        struct target *tg = &targets[nr_targets];
+
+        tg->name = types[i];
+        snprintf(tg->path, sizeof(tg->path), "%s/%s", mount_root, types[i]);
+        if (mkdir(tg->path, 0755) ||
+            mount("none", tg->path, types[i], 0, i ? "" : s2fs_opts)) {
+            fprintf(stderr, "mount %s on %s: %s\n", types[i], tg->path, strerror(errno));
+            rmdir(tg->path);
+            continue;
+        }
+        tg->mounted = true;
+        nr_targets++;
+    }
+    return nr_targets ? 0 : -1;
+}
+
+static void unmount_targets(void) {
+    int i;
+
+    for (i = 0; i < nr_targets; i++) {
+        if (!targets[i].mounted)
+            continue;
+        if (umount(targets[i].path))
+            fprintf(stderr, "umount %s: %s\n", targets[i].path, strerror(errno));
+        rmdir(targets[i].path);
+    }
+    rmdir(mount_root);
+}
+
+// Driver
+// Rows are printed grouped by job, so each job's thread counts are next to each other.
+static void print_report(void) {
+    int i, j, k, t;
+
+    printf("%-18s %7s", "job", "threads");
+    for (t = 0; t < nr_targets; t++)
+        printf(" %20s", targets[t].name);
+    printf("\n");
+    for (i = 0; i < nr_rows; i++) {
+        for (k = 0; k < i && strcmp(rows[k].name, rows[i].name); k++)
+            ;
+        if (k < i)
+            continue;
+        for (j = i; j < nr_rows; j++) {
+            struct row *r = &rows[j];
+
+            if (strcmp(r->name, rows[i].name))
+                continue;
+
+            printf("%-18s %7d", r->name, r->threads);
+            for (t = 0; t < nr_targets; t++) {
+                double v = r->meta ? r->result[t] / 1e3 : r->result[t] / (1 << 20);
+                char cell[32];
+
+                if (t && r->result[0] > 0)
+                    snprintf(cell, sizeof(cell), "%.1f (%.2fx)", v, r->result[t] / r->result[0]);
+                else
+                    snprintf(cell, sizeof(cell), "%.1f", v);
+                printf(" %20s", cell);
+            }
+            printf("\n");
+        }
+    }
+    printf("\nData jobs in MiB/s, metadata jobs in thousands of operations per second; ratios are to %s.\n",
+           targets[0].name);
+}
+
+static int parse_sizes(char *arg) {
+    char *tok, *save;
+
+    nr_block_sizes = 0;
+    for (tok = strtok_r(arg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (nr_block_sizes == MAX_SIZES || !(block_sizes[nr_block_sizes] = strtoul(tok, NULL, 0) << 10))
+            return -1;
+        nr_block_sizes++;
+    }
+    return nr_block_sizes ? 0 : -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-s size_mb] [-b bs_kb,...] [-t threads] [-S] [-n files] [-o s2fs_options] -m\n"
+            "       %s [-s size_mb] [-b bs_kb,...] [-t threads] [-S] [-n files] dir...\n",
+            prog, prog);
+}
+
+int main(int argc, char *argv[]) {
+    bool do_mount = false;
+    int opt, t, i, threads;
+
+    max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "s:b:t:Sn:o:m")) != -1) {
+        switch (opt) {
+        case 's':
+            total_size = strtoul(optarg, NULL, 0) << 20;
+            break;
+        case 'b':
+            if (parse_sizes(optarg)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'S':
+            sweep = true;
+            break;
+        case 'n':
+            files_per_thread = atoi(optarg);
+            break;
+        case 'o':
+            s2fs_opts = optarg;
+            break;
+        case 'm':
+            do_mount = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!total_size || max_threads <= 0 || files_per_thread <= 0 || do_mount == (optind < argc)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (do_mount) {
+        if (mount_targets())
+            return 1;
+    } else {
+        for (i = optind; i < argc && nr_targets < MAX_TARGETS; i++, nr_targets++) {
+            targets[nr_targets].name = argv[i];
+            snprintf(targets[nr_targets].path, sizeof(targets[nr_targets].path), "%s", argv[i]);
+        }
+    }
+
+    printf("%zu MiB of data per job, %d files per thread for metadata, %s %d threads\n\n",
+           total_size >> 20, files_per_thread, sweep ? "1, 2, 4, ... up to" : "1 and", max_threads);
+    for (t = 0; t < nr_targets; t++) {
+        // 1, then doubling with -S, and -t last whether or not it is a power of two.
+        for (threads = 1;; threads = sweep && threads * 2 < max_threads ? threads * 2 : max_threads) {
+            bench_io(t, threads);
+            bench_meta(t, threads);
+            if (threads == max_threads)
+                break;
+        }
+    }
+    print_report();
+
+    if (do_mount)
+        unmount_targets();
+    return 0;
+}
@@ -0,0 +1,193 @@
+// Userspace benchmark for extended attributes, to compare s2fs with tmpfs.
+//
+// For each directory given (say an s2fs and a tmpfs mount), creates a file there and times
+// setting n attributes on it, looking them up in random order, looking up names it
+// does not have, listing them and removing them again. Lookups are where the two differ:
+// tmpfs walks a list per lookup, s2fs hashes the name, so the gap grows with n. Every value
+// read back is checked against what was set. Run as root, the attributes are trusted.*
+// ones, which tmpfs has always supported; otherwise they are user.*, which tmpfs only
+// supports from Linux 6.6 on.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NAME_LEN 32
+#define VALUE_LEN 32
+
+static int nattrs = 1000;
+static int lookups = 100000;
+static const char *prefix = "user.";
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void attr_name(char *name, int i) {
+    snprintf(name, NAME_LEN, "%sattr%07d", prefix, i);
+}
+
+static void attr_value(char *value, int i) {
+    memset(value, 'a' + i % 26, VALUE_LEN);
+    memcpy(value, &i, sizeof(i));
+}
+
+// Benchmarks
+// Each returns the number of operations it timed, or -1 on a failure.
+static int run_set(const char *path) {
+    char name[NAME_LEN], value[VALUE_LEN];
+    int i;
+
+    for (i = 0; i < nattrs; i++) {
+        attr_name(name, i);
+        attr_value(value, i);
+        if (setxattr(path, name, value, VALUE_LEN, XATTR_CREATE))
+            return -1;
+    }
+    return nattrs;
+}
+
+static int run_get(const char *path) {
+    char name[NAME_LEN], value[VALUE_LEN], expect[VALUE_LEN];
+    int i, j;
+
+    for (i = 0; i < lookups; i++) {
+        j = rand() % nattrs;
+        attr_name(name, j);
+        attr_value(expect, j);
+        if (getxattr(path, name, value, VALUE_LEN) != VALUE_LEN || memcmp(value, expect, VALUE_LEN)) {
+            fprintf(stderr, "%s: bad value for %s\n", path, name);
+            return -1;
+        }
+    }
+    return lookups;
+}
+
+static int run_get_missing(const char *path) {
+    char name[NAME_LEN], value[VALUE_LEN];
+    int i;
+
+    for (i = 0; i < lookups; i++) {
+        attr_name(name, nattrs + rand() % nattrs);
+        if (getxattr(path, name, value, VALUE_LEN) >= 0 || errno != ENODATA)
+            return -1;
+    }
+    return lookups;
+}
+
+static int run_list(const char *path) {
+    ssize_t len = listxattr(path, NULL, 0);
+    char *buf;
+    int i, n = 0;
+
+    if (len < 0 || !(buf = malloc(len)))
+        return -1;
+    for (i = 0; i < 100; i++) {
+        if (listxattr(path, buf, len) != len) {
+            free(buf);
+            return -1;
+        }
+        n++;
+    }
+    free(buf);
+    return n;
+}
+
+static int run_remove(const char *path) {
+    char name[NAME_LEN];
+    int i;
+
+    for (i = 0; i < nattrs; i++) {
+        attr_name(name, i);
+        if (removexattr(path, name))
+            return -1;
+    }
+    return nattrs;
+}
+
+static struct {
+    const char *name;
+    int (*run)(const char *path);
+} benches[] = {
+    { "set", run_set },
+    { "get", run_get },
+    { "get_missing", run_get_missing },
+    { "list", run_list },
+    { "remove", run_remove },
+};
+
+#define NBENCHES (int)(sizeof(benches) / sizeof(benches[0]))
+
+// Driver
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-n attributes] [-l lookups] dir...\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int opt, i, j, n, fd, ret = 0;
+    char path[4096];
+    uint64_t start;
+
+    while ((opt = getopt(argc, argv, "n:l:")) != -1) {
+        switch (opt) {
+        case 'n':
+            nattrs = atoi(optarg);
+            break;
+        case 'l':
+            lookups = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || nattrs <= 0 || lookups <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!geteuid())
+        prefix = "trusted.";
+    printf("%d %s attributes, %d lookups, ns per operation\n", nattrs, prefix, lookups);
+    printf("%-24s", "");
+    for (j = 0; j < NBENCHES; j++)
+        printf(" %12s", benches[j].name);
+    printf("\n");
+
+    for (i = optind; i < argc; i++) {
+        snprintf(path, sizeof(path), "%s/xattr_bench.%d", argv[i], getpid());
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            return 1;
+        }
+        close(fd);
+
+        srand(1);
+        printf("%-24s", argv[i]);
+        for (j = 0; j < NBENCHES; j++) {
+            start = now_ns();
+            n = benches[j].run(path);
+            if (n < 0) {
+                printf(" %12s", "failed");
+                fprintf(stderr, "%s: %s: %s\n", path, benches[j].name, strerror(errno));
+                ret = 1;
+                continue;
+            }
+            printf(" %12.1f", (double)(now_ns() - start) / n);
+        }
+        printf("\n");
+        unlink(path);
+    }
+    return ret;
+}